@@ -1,8 +1,37 @@
 #include <algorithm>
+#include <atomic>
+#include <bitset>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
 #include <string>
 #include <regex>
 #include <cmath>
+#include <thread>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TEXTEDITOR_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
 
 #include "TextEditor.h"
 
@@ -12,16 +41,16 @@
 // TODO
 // - multiline comments vs single-line: latter is blocking start of a ML
 
-template<class InputIt1, class InputIt2, class BinaryPredicate>
-bool equals(InputIt1 first1, InputIt1 last1,
-	InputIt2 first2, InputIt2 last2, BinaryPredicate p)
+static bool equals(const TextEditor::Line& aLine, int aIndex, const std::string& aString)
 {
-	for (; first1 != last1 && first2 != last2; ++first1, ++first2)
+	if (aIndex < 0 || aIndex + (int)aString.size() > aLine.size())
+		return false;
+	for (size_t i = 0; i < aString.size(); ++i)
 	{
-		if (!p(*first1, *first2))
+		if (aLine[aIndex + (int)i] != (TextEditor::Char)aString[i])
 			return false;
 	}
-	return first1 == last1 && first2 == last2;
+	return true;
 }
 
 TextEditor::TextEditor()
@@ -36,19 +65,38 @@ TextEditor::TextEditor()
 	, mTextChanged(false)
 	, mColorizerEnabled(true)
 	, mTextStart(20.0f)
+	, mTextStartLines(-1)
+	, mLayoutFont(nullptr)
+	, mLayoutFontSize(0.0f)
+	, mLayoutTabSize(0)
+	, mLayoutMonospace(false)
 	, mLeftMargin(10)
 	, mCursorPositionChanged(false)
 	, mColorRangeMin(0)
 	, mColorRangeMax(0)
+	, mColorizerBudget(4000)
+	, mLastScrollY(0.0f)
+	, mScrollDirection(1)
 	, mSelectionMode(SelectionMode::Normal)
-	, mCheckComments(true)
+	, mPaletteAlpha(-1.0f)
+	, mPaletteVersion(0)
+	, mDrawnLineMin(0)
+	, mDrawnLineMax(0)
+	, mTokenCache(std::make_shared<TokenCache>())
+	, mLanguageKey(0)
+	, mCommentRangeMin(0)
+	, mCommentRangeTail(0)
 	, mLastClick(-1.0f)
 	, mHandleKeyboardInputs(true)
 	, mHandleMouseInputs(true)
 	, mIgnoreImGuiChild(false)
 	, mShowWhitespaces(true)
-	, mStartTime(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count())
+	, mMonospace(false)
+	, mStartTime(0.0)
+	, mRedrawNeeded(true)
+	, mBlinking(false)
 {
+	mSpanPalette.fill(0);
 	SetPalette(GetDarkPalette());
 	SetLanguageDefinition(LanguageDefinition::HLSL());
 	mLines.push_back(Line());
@@ -58,2464 +106,5926 @@ TextEditor::~TextEditor()
 {
 }
 
-void TextEditor::SetLanguageDefinition(const LanguageDefinition & aLanguageDef)
+void TextEditor::Line::Materialize()
 {
-	mLanguageDefinition = aLanguageDef;
-	mRegexList.clear();
-
-	for (auto& r : mLanguageDefinition.mTokenRegexStrings)
-		mRegexList.push_back(std::make_pair(std::regex(r.first, std::regex_constants::optimize), r.second));
-
-	Colorize();
-}
+	if (mPiece == nullptr)
+		return;
 
-void TextEditor::SetPalette(const Palette & aValue)
-{
-	mPaletteBase = aValue;
+	mChars.assign(mPiece, mPiece + mPieceSize);
+	mPiece = nullptr;
+	mPieceSize = 0;
 }
 
-std::string TextEditor::GetText(const Coordinates & aStart, const Coordinates & aEnd) const
+void TextEditor::Line::SetAttributes(int aIndex, uint8_t aMask, uint8_t aValue)
 {
-	std::string result;
-
-	auto lstart = aStart.mLine;
-	auto lend = aEnd.mLine;
-	auto istart = GetCharacterIndex(aStart);
-	auto iend = GetCharacterIndex(aEnd);
-	size_t s = 0;
-
-	for (size_t i = lstart; i < lend; i++)
-		s += mLines[i].size();
-
-	result.reserve(s + s / 8);
+	assert((aValue & ~aMask) == 0);
 
-	while (istart < iend || lstart < lend)
+	if (mAttributes.empty())
 	{
-		if (lstart >= (int)mLines.size())
-			break;
-
-		auto& line = mLines[lstart];
-		if (istart < (int)line.size())
-		{
-			result += line[istart].mChar;
-			istart++;
-		}
-		else
-		{
-			istart = 0;
-			++lstart;
-			result += '\n';
-		}
+		if (aValue == 0)
+			return;
+		mAttributes.resize(size(), 0);
 	}
+	mAttributes[aIndex] = (uint8_t)((mAttributes[aIndex] & ~aMask) | aValue);
+}
 
-	return result;
+TextEditor::PaletteIndex TextEditor::Line::GetColorIndex(int aIndex) const
+{
+	auto span = FindSpan(aIndex);
+	return span < 0 ? PaletteIndex::Default : (PaletteIndex)mSpans[span].mColorIndex;
 }
 
-TextEditor::Coordinates TextEditor::GetActualCursorCoordinates() const
+int TextEditor::Line::FindSpan(int aIndex) const
 {
-	return SanitizeCoordinates(mState.mCursorPosition);
+	if (mSpans.empty())
+		return -1;
+	auto it = std::upper_bound(mSpans.begin(), mSpans.end(), aIndex, [](int aValue, const Span& aSpan) { return aValue < aSpan.mStart; });
+	return it == mSpans.begin() ? 0 : (int)(it - mSpans.begin()) - 1;
 }
 
-TextEditor::Coordinates TextEditor::SanitizeCoordinates(const Coordinates & aValue) const
+void TextEditor::Line::AddSpan(int aStart, int aEnd, PaletteIndex aColorIndex)
 {
-	auto line = aValue.mLine;
-	auto column = aValue.mColumn;
-	if (line >= (int)mLines.size())
+	const auto colorIndex = (uint8_t)aColorIndex;
+	for (int i = aStart; i < aEnd; )
 	{
-		if (mLines.empty())
-		{
-			line = 0;
-			column = 0;
-		}
+		// a run of characters with the same flags
+		auto attributes = GetAttributes(i);
+		int end = aEnd;
+		if (!mAttributes.empty())
+			for (end = i + 1; end < aEnd && mAttributes[end] == attributes; ++end)
+				;
+
+		uint8_t color;
+		if (attributes & CommentFlag)
+			color = (uint8_t)PaletteIndex::Comment;
+		else if (attributes & MultiLineCommentFlag)
+			color = (uint8_t)PaletteIndex::MultiLineComment;
+		else if (attributes & LongStringFlag)
+			color = (uint8_t)PaletteIndex::String;
+		else if (attributes & PreprocessorFlag)
+			color = (uint8_t)(PreprocessorColor + colorIndex);
 		else
-		{
-			line = (int)mLines.size() - 1;
-			column = GetLineMaxColumn(line);
-		}
-		return Coordinates(line, column);
-	}
-	else
-	{
-		column = mLines.empty() ? 0 : std::min(column, GetLineMaxColumn(line));
-		return Coordinates(line, column);
+			color = colorIndex;
+
+		if (!mSpans.empty() && mSpans.back().mStart + mSpans.back().mLength == i && mSpans.back().mColorIndex == colorIndex && mSpans.back().mColor == color)
+			mSpans.back().mLength += end - i;
+		else
+			mSpans.push_back(Span{ i, end - i, colorIndex, color });
+		i = end;
 	}
 }
 
-// https://en.wikipedia.org/wiki/UTF-8
-// We assume that the char is a standalone character (<128) or a leading byte of an UTF-8 code sequence (non-10xxxxxx code)
-static int UTF8CharLength(TextEditor::Char c)
+// Keeps the spans of a line over aCount characters inserted at aIndex (or removed before it, if negative),
+// which take the color of the span they are inserted in until the line is colorized again.
+void TextEditor::Line::ResizeSpans(int aIndex, int aCount)
 {
-	if ((c & 0xFE) == 0xFC)
-		return 6;
-	if ((c & 0xFC) == 0xF8)
-		return 5;
-	if ((c & 0xF8) == 0xF0)
-		return 4;
-	else if ((c & 0xF0) == 0xE0)
-		return 3;
-	else if ((c & 0xE0) == 0xC0)
-		return 2;
-	return 1;
-}
+	if (mSpans.empty())
+		return;
 
-// "Borrowed" from ImGui source
-static inline int ImTextCharToUtf8(char* buf, int buf_size, unsigned int c)
-{
-	if (c < 0x80)
+	if (aCount < 0)
 	{
-		buf[0] = (char)c;
-		return 1;
+		std::vector<Span> spans;
+		CopySpans(spans, *this, 0, aIndex + aCount, 0);
+		CopySpans(spans, *this, aIndex, size(), aCount);
+		mSpans.swap(spans);
+		return;
 	}
-	if (c < 0x800)
+
+	for (auto& span : mSpans)
 	{
-		if (buf_size < 2) return 0;
-		buf[0] = (char)(0xc0 + (c >> 6));
-		buf[1] = (char)(0x80 + (c & 0x3f));
-		return 2;
+		if (span.mStart > aIndex)
+			span.mStart += aCount;
+		else if (aIndex < span.mStart + span.mLength || &span == &mSpans.back())
+			span.mLength += aCount;
 	}
-	if (c >= 0xdc00 && c < 0xe000)
+}
+
+// Appends the spans of aFrom over [aStart, aEnd) to aTo, moved by aOffset. Without spans, the characters
+// get one in the default color.
+void TextEditor::Line::CopySpans(std::vector<Span>& aTo, const Line& aFrom, int aStart, int aEnd, int aOffset)
+{
+	if (aStart >= aEnd)
+		return;
+
+	if (aFrom.mSpans.empty())
 	{
-		return 0;
+		aTo.push_back(Span{ aStart + aOffset, aEnd - aStart, (uint8_t)PaletteIndex::Default, (uint8_t)PaletteIndex::Default });
+		return;
 	}
-	if (c >= 0xd800 && c < 0xdc00)
+
+	for (size_t i = (size_t)aFrom.FindSpan(aStart); i < aFrom.mSpans.size() && aFrom.mSpans[i].mStart < aEnd; ++i)
 	{
-		if (buf_size < 4) return 0;
-		buf[0] = (char)(0xf0 + (c >> 18));
-		buf[1] = (char)(0x80 + ((c >> 12) & 0x3f));
-		buf[2] = (char)(0x80 + ((c >> 6) & 0x3f));
-		buf[3] = (char)(0x80 + ((c) & 0x3f));
-		return 4;
+		auto& span = aFrom.mSpans[i];
+		auto start = std::max(span.mStart, aStart);
+		auto end = std::min(span.mStart + span.mLength, aEnd);
+		if (start < end)
+			aTo.push_back(Span{ start + aOffset, end - start, span.mColorIndex, span.mColor });
 	}
-	//else if (c < 0x10000)
+}
+
+// Sets the comment, multiline comment, preprocessor and long string flags of the characters in [aStart, aEnd) at once.
+void TextEditor::Line::SetScanFlags(int aStart, int aEnd, bool aComment, bool aMultiLineComment, bool aPreprocessor, bool aLongString)
+{
+	auto flags = (uint8_t)((aComment ? CommentFlag : 0) | (aMultiLineComment ? MultiLineCommentFlag : 0) | (aPreprocessor ? PreprocessorFlag : 0) | (aLongString ? LongStringFlag : 0));
+	if (mAttributes.empty())
 	{
-		if (buf_size < 3) return 0;
-		buf[0] = (char)(0xe0 + (c >> 12));
-		buf[1] = (char)(0x80 + ((c >> 6) & 0x3f));
-		buf[2] = (char)(0x80 + ((c) & 0x3f));
-		return 3;
+		if (flags == 0)
+			return;
+		mAttributes.resize(size(), 0);
 	}
+	for (int i = aStart; i < aEnd; ++i)
+		mAttributes[i] = flags;
 }
 
-void TextEditor::Advance(Coordinates & aCoordinates) const
+// Called before the characters in [aBegin, aEnd) are inserted at aIndex, or removed from there.
+void TextEditor::Line::Changed(int aIndex, const Char* aBegin, const Char* aEnd, bool aInserted)
 {
-	if (aCoordinates.mLine < (int)mLines.size())
+	mScanState = 0;
+	mColorized = false;
+	mTaken = false;
+	mTextRuns.reset();
+
+	// the layout of a line of single byte characters without tabs only changes by the number of printable ones
+	const auto count = (int)(aEnd - aBegin);
+	auto printable = mLayoutTabSize != -1 && mSimple;
+	for (auto p = aBegin; p != aEnd && printable; ++p)
+		printable = *p >= 0x20 && *p < 0x7f;
+	if (printable)
 	{
-		auto& line = mLines[aCoordinates.mLine];
-		auto cindex = GetCharacterIndex(aCoordinates);
+		mMaxColumn += aInserted ? count : -count;
+		mCharacterCount += aInserted ? count : -count;
+	}
+	else
+		mLayoutTabSize = -1;
 
-		if (cindex + 1 < (int)line.size())
-		{
-			auto delta = UTF8CharLength(line[cindex].mChar);
-			cindex = std::min(cindex + delta, (int)line.size() - 1);
-		}
-		else
-		{
-			++aCoordinates.mLine;
-			cindex = 0;
-		}
-		aCoordinates.mColumn = GetCharacterColumn(aCoordinates.mLine, cindex);
+	// the changed characters are kept in one range, with the ones after it moved by as much as they were
+	if (mEdit.mStart < 0)
+		mEdit = Edit{ aIndex, aIndex, 0 };
+	mEdit.mStart = std::min(mEdit.mStart, aIndex);
+	if (aInserted)
+	{
+		mEdit.mEnd = std::max(mEdit.mEnd >= aIndex ? mEdit.mEnd + count : mEdit.mEnd, aIndex + count);
+		mEdit.mDelta += count;
+	}
+	else
+	{
+		mEdit.mEnd = std::max(mEdit.mEnd >= aIndex + count ? mEdit.mEnd - count : std::min(mEdit.mEnd, aIndex), aIndex);
+		mEdit.mDelta -= count;
 	}
 }
 
-void TextEditor::DeleteRange(const Coordinates & aStart, const Coordinates & aEnd)
+void TextEditor::Line::Insert(int aIndex, Char aChar)
 {
-	assert(aEnd >= aStart);
-	assert(!mReadOnly);
+	Changed(aIndex, &aChar, &aChar + 1, true);
+	ResizeSpans(aIndex, 1);
+	Materialize();
+	mChars.insert(mChars.begin() + aIndex, aChar);
+	if (!mAttributes.empty())
+		mAttributes.insert(mAttributes.begin() + aIndex, 0);
+}
 
-	//printf("D(%d.%d)-(%d.%d)\n", aStart.mLine, aStart.mColumn, aEnd.mLine, aEnd.mColumn);
+void TextEditor::Line::Insert(int aIndex, const Line& aFrom, int aFromStart, int aFromEnd)
+{
+	assert(&aFrom != this);
 
-	if (aEnd == aStart)
+	if (aFromStart >= aFromEnd)
 		return;
 
-	auto start = GetCharacterIndex(aStart);
-	auto end = GetCharacterIndex(aEnd);
+	Changed(aIndex, aFrom.data() + aFromStart, aFrom.data() + aFromEnd, true);
 
-	if (aStart.mLine == aEnd.mLine)
+	if (!mSpans.empty() || !aFrom.mSpans.empty())
 	{
-		auto& line = mLines[aStart.mLine];
-		auto n = GetLineMaxColumn(aStart.mLine);
-		if (aEnd.mColumn >= n)
-			line.erase(line.begin() + start, line.end());
-		else
-			line.erase(line.begin() + start, line.begin() + end);
+		std::vector<Span> spans;
+		CopySpans(spans, *this, 0, aIndex, 0);
+		CopySpans(spans, aFrom, aFromStart, aFromEnd, aIndex - aFromStart);
+		CopySpans(spans, *this, aIndex, size(), aFromEnd - aFromStart);
+		mSpans.swap(spans);
 	}
-	else
+
+	if (!aFrom.mAttributes.empty())
 	{
-		auto& firstLine = mLines[aStart.mLine];
-		auto& lastLine = mLines[aEnd.mLine];
+		if (mAttributes.empty())
+			mAttributes.resize(size(), 0);
+		mAttributes.insert(mAttributes.begin() + aIndex, aFrom.mAttributes.begin() + aFromStart, aFrom.mAttributes.begin() + aFromEnd);
+	}
+	else if (!mAttributes.empty())
+		mAttributes.insert(mAttributes.begin() + aIndex, aFromEnd - aFromStart, 0);
+
+	Materialize();
+	mChars.insert(mChars.begin() + aIndex, aFrom.data() + aFromStart, aFrom.data() + aFromEnd);
+}
 
-		firstLine.erase(firstLine.begin() + start, firstLine.end());
-		lastLine.erase(lastLine.begin(), lastLine.begin() + end);
+void TextEditor::Line::Insert(int aIndex, const Char* aBegin, const Char* aEnd)
+{
+	if (aBegin == aEnd)
+		return;
 
-		if (aStart.mLine < aEnd.mLine)
-			firstLine.insert(firstLine.end(), lastLine.begin(), lastLine.end());
+	Changed(aIndex, aBegin, aEnd, true);
+	ResizeSpans(aIndex, (int)(aEnd - aBegin));
 
-		if (aStart.mLine < aEnd.mLine)
-			RemoveLine(aStart.mLine + 1, aEnd.mLine + 1);
-	}
+	if (!mAttributes.empty())
+		mAttributes.insert(mAttributes.begin() + aIndex, aEnd - aBegin, 0);
 
-	mTextChanged = true;
+	Materialize();
+	mChars.insert(mChars.begin() + aIndex, aBegin, aEnd);
 }
 
-int TextEditor::InsertTextAt(Coordinates& /* inout */ aWhere, const char * aValue)
+void TextEditor::Line::Erase(int aStart, int aEnd)
 {
-	assert(!mReadOnly);
+	if (aStart >= aEnd)
+		return;
 
-	int cindex = GetCharacterIndex(aWhere);
-	int totalLines = 0;
-	while (*aValue != '\0')
-	{
-		assert(!mLines.empty());
+	Changed(aStart, data() + aStart, data() + aEnd, false);
+	ResizeSpans(aEnd, aStart - aEnd);
 
-		if (*aValue == '\r')
-		{
-			// skip
-			++aValue;
-		}
-		else if (*aValue == '\n')
+	if (!mAttributes.empty())
+		mAttributes.erase(mAttributes.begin() + aStart, mAttributes.begin() + aEnd);
+
+	if (mPiece != nullptr)
+	{
+		// cutting off the beginning or the end of a piece leaves it a piece
+		if (aStart == 0)
 		{
-			if (cindex < (int)mLines[aWhere.mLine].size())
-			{
-				auto& newLine = InsertLine(aWhere.mLine + 1);
-				auto& line = mLines[aWhere.mLine];
-				newLine.insert(newLine.begin(), line.begin() + cindex, line.end());
-				line.erase(line.begin() + cindex, line.end());
-			}
-			else
-			{
-				InsertLine(aWhere.mLine + 1);
-			}
-			++aWhere.mLine;
-			aWhere.mColumn = 0;
-			cindex = 0;
-			++totalLines;
-			++aValue;
+			mPiece += aEnd;
+			mPieceSize -= aEnd;
+			return;
 		}
-		else
+		if (aEnd == mPieceSize)
 		{
-			auto& line = mLines[aWhere.mLine];
-			auto d = UTF8CharLength(*aValue);
-			while (d-- > 0 && *aValue != '\0')
-				line.insert(line.begin() + cindex++, Glyph(*aValue++, PaletteIndex::Default));
-			++aWhere.mColumn;
+			mPieceSize = aStart;
+			return;
 		}
-
-		mTextChanged = true;
 	}
 
-	return totalLines;
+	Materialize();
+	mChars.erase(mChars.begin() + aStart, mChars.begin() + aEnd);
 }
 
-void TextEditor::AddUndo(UndoRecord& aValue)
+#ifdef TEXTEDITOR_SSE2
+// Returns a mask with a bit set for each newline among the 32 characters at aText.
+static unsigned NewLineMask(const TextEditor::Char* aText)
 {
-	assert(!mReadOnly);
-	//printf("AddUndo: (@%d.%d) +\'%s' [%d.%d .. %d.%d], -\'%s', [%d.%d .. %d.%d] (@%d.%d)\n",
-	//	aValue.mBefore.mCursorPosition.mLine, aValue.mBefore.mCursorPosition.mColumn,
-	//	aValue.mAdded.c_str(), aValue.mAddedStart.mLine, aValue.mAddedStart.mColumn, aValue.mAddedEnd.mLine, aValue.mAddedEnd.mColumn,
-	//	aValue.mRemoved.c_str(), aValue.mRemovedStart.mLine, aValue.mRemovedStart.mColumn, aValue.mRemovedEnd.mLine, aValue.mRemovedEnd.mColumn,
-	//	aValue.mAfter.mCursorPosition.mLine, aValue.mAfter.mCursorPosition.mColumn
-	//	);
+	const __m128i newLine = _mm_set1_epi8('\n');
+	auto low = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)aText), newLine));
+	auto high = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(aText + 16)), newLine));
+	return low | (high << 16);
+}
 
-	mUndoBuffer.resize((size_t)(mUndoIndex + 1));
-	mUndoBuffer.back() = aValue;
-	++mUndoIndex;
+static int CountTrailingZeros(unsigned aValue)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, aValue);
+	return (int)index;
+#else
+	return __builtin_ctz(aValue);
+#endif
 }
 
-TextEditor::Coordinates TextEditor::ScreenPosToCoordinates(const ImVec2& aPosition) const
+static int CountBits(unsigned aValue)
 {
-	ImVec2 origin = ImGui::GetCursorScreenPos();
-	ImVec2 local(aPosition.x - origin.x, aPosition.y - origin.y);
+	aValue = aValue - ((aValue >> 1) & 0x55555555u);
+	aValue = (aValue & 0x33333333u) + ((aValue >> 2) & 0x33333333u);
+	return (int)((((aValue + (aValue >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24);
+}
+#endif
 
-	int lineNo = std::max(0, (int)floor(local.y / mCharAdvance.y));
+#ifdef TEXTEDITOR_SSE2
+// Returns a mask with a bit set for each of the 16 characters in aChars within [aLow, aHigh]. The bounds have to
+// be below 0x80, the signed compares leave out the characters from 0x80 on.
+static unsigned RangeMask(__m128i aChars, char aLow, char aHigh)
+{
+	auto above = _mm_cmpgt_epi8(aChars, _mm_set1_epi8((char)(aLow - 1)));
+	auto below = _mm_cmplt_epi8(aChars, _mm_set1_epi8((char)(aHigh + 1)));
+	return (unsigned)_mm_movemask_epi8(_mm_and_si128(above, below));
+}
+#endif
 
-	int columnCoord = 0;
+// The lexing primitives below look at 16 characters at a time where SSE2 is available, and return the first
+// character from aBegin which is not of their kind (or which they look for), aEnd if there is none.
 
-	if (lineNo >= 0 && lineNo < (int)mLines.size())
+// Letters, digits and '_'.
+static const char* SkipIdentifierCharacters(const char* aBegin, const char* aEnd)
+{
+	auto p = aBegin;
+#ifdef TEXTEDITOR_SSE2
+	for (; aEnd - p >= 16; p += 16)
 	{
-		auto& line = mLines.at(lineNo);
-
-		int columnIndex = 0;
-		float columnX = 0.0f;
-
-		while ((size_t)columnIndex < line.size())
-		{
-			float columnWidth = 0.0f;
-
-			if (line[columnIndex].mChar == '\t')
-			{
-				float spaceSize = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, " ").x;
-				float oldX = columnX;
-				float newColumnX = (1.0f + std::floor((1.0f + columnX) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
-				columnWidth = newColumnX - oldX;
-				if (mTextStart + columnX + columnWidth * 0.5f > local.x)
-					break;
-				columnX = newColumnX;
-				columnCoord = (columnCoord / mTabSize) * mTabSize + mTabSize;
-				columnIndex++;
-			}
-			else
-			{
-				char buf[7];
-				auto d = UTF8CharLength(line[columnIndex].mChar);
-				int i = 0;
-				while (i < 6 && d-- > 0)
-					buf[i++] = line[columnIndex++].mChar;
-				buf[i] = '\0';
-				columnWidth = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, buf).x;
-				if (mTextStart + columnX + columnWidth * 0.5f > local.x)
-					break;
-				columnX += columnWidth;
-				columnCoord++;
-			}
-		}
+		auto chars = _mm_loadu_si128((const __m128i*)p);
+		auto lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+		auto mask = RangeMask(lower, 'a', 'z') | RangeMask(chars, '0', '9') | (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8('_')));
+		if (mask != 0xffff)
+			return p + CountTrailingZeros(~mask);
 	}
+#endif
+	while (p < aEnd && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_'))
+		++p;
+	return p;
+}
 
-	return SanitizeCoordinates(Coordinates(lineNo, columnCoord));
+// Decimal digits.
+static const char* SkipDigits(const char* aBegin, const char* aEnd)
+{
+	auto p = aBegin;
+#ifdef TEXTEDITOR_SSE2
+	for (; aEnd - p >= 16; p += 16)
+	{
+		auto mask = RangeMask(_mm_loadu_si128((const __m128i*)p), '0', '9');
+		if (mask != 0xffff)
+			return p + CountTrailingZeros(~mask);
+	}
+#endif
+	while (p < aEnd && *p >= '0' && *p <= '9')
+		++p;
+	return p;
 }
 
-TextEditor::Coordinates TextEditor::FindWordStart(const Coordinates & aFrom) const
+// Hexadecimal digits.
+static const char* SkipHexDigits(const char* aBegin, const char* aEnd)
 {
-	Coordinates at = aFrom;
-	if (at.mLine >= (int)mLines.size())
-		return at;
-
-	auto& line = mLines[at.mLine];
-	auto cindex = GetCharacterIndex(at);
+	auto p = aBegin;
+#ifdef TEXTEDITOR_SSE2
+	for (; aEnd - p >= 16; p += 16)
+	{
+		auto chars = _mm_loadu_si128((const __m128i*)p);
+		auto mask = RangeMask(chars, '0', '9') | RangeMask(_mm_or_si128(chars, _mm_set1_epi8(0x20)), 'a', 'f');
+		if (mask != 0xffff)
+			return p + CountTrailingZeros(~mask);
+	}
+#endif
+	while (p < aEnd && ((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f') || (*p >= 'A' && *p <= 'F')))
+		++p;
+	return p;
+}
 
-	if (cindex >= (int)line.size())
-		return at;
+// Spaces and tabs.
+static const char* SkipBlanks(const char* aBegin, const char* aEnd)
+{
+	auto p = aBegin;
+#ifdef TEXTEDITOR_SSE2
+	for (; aEnd - p >= 16; p += 16)
+	{
+		auto chars = _mm_loadu_si128((const __m128i*)p);
+		auto blanks = _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chars, _mm_set1_epi8('\t')));
+		auto mask = (unsigned)_mm_movemask_epi8(blanks);
+		if (mask != 0xffff)
+			return p + CountTrailingZeros(~mask);
+	}
+#endif
+	while (p < aEnd && (*p == ' ' || *p == '\t'))
+		++p;
+	return p;
+}
 
-	while (cindex > 0 && isspace(line[cindex].mChar))
-		--cindex;
+// The first aFirst or aSecond character.
+static const char* FindEither(const char* aBegin, const char* aEnd, char aFirst, char aSecond)
+{
+	auto p = aBegin;
+#ifdef TEXTEDITOR_SSE2
+	for (; aEnd - p >= 16; p += 16)
+	{
+		auto chars = _mm_loadu_si128((const __m128i*)p);
+		auto found = _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8(aFirst)), _mm_cmpeq_epi8(chars, _mm_set1_epi8(aSecond)));
+		auto mask = (unsigned)_mm_movemask_epi8(found);
+		if (mask != 0)
+			return p + CountTrailingZeros(mask);
+	}
+#endif
+	while (p < aEnd && *p != aFirst && *p != aSecond)
+		++p;
+	return p;
+}
 
-	auto cstart = (PaletteIndex)line[cindex].mColorIndex;
-	while (cindex > 0)
+// Calls aFunc with the position of each newline in [aBegin, aEnd), 32 characters at a time where SSE2 is available.
+template<class F>
+static void ForEachNewLine(const TextEditor::Char* aBegin, const TextEditor::Char* aEnd, F aFunc)
+{
+	auto p = aBegin;
+#ifdef TEXTEDITOR_SSE2
+	for (; aEnd - p >= 32; p += 32)
 	{
-		auto c = line[cindex].mChar;
-		if ((c & 0xC0) != 0x80)	// not UTF code sequence 10xxxxxx
-		{
-			if (c <= 32 && isspace(c))
-			{
-				cindex++;
-				break;
-			}
-			if (cstart != (PaletteIndex)line[size_t(cindex - 1)].mColorIndex)
-				break;
-		}
-		--cindex;
+		for (auto mask = NewLineMask(p); mask != 0; mask &= mask - 1)
+			aFunc(p + CountTrailingZeros(mask));
+	}
+#endif
+	for (; p != aEnd; ++p)
+	{
+		if (*p == '\n')
+			aFunc(p);
 	}
-	return Coordinates(at.mLine, GetCharacterColumn(at.mLine, cindex));
 }
 
-TextEditor::Coordinates TextEditor::FindWordEnd(const Coordinates & aFrom) const
+static size_t CountNewLines(const TextEditor::Char* aBegin, const TextEditor::Char* aEnd)
 {
-	Coordinates at = aFrom;
-	if (at.mLine >= (int)mLines.size())
-		return at;
+	size_t count = 0;
+	auto p = aBegin;
+#ifdef TEXTEDITOR_SSE2
+	for (; aEnd - p >= 32; p += 32)
+		count += CountBits(NewLineMask(p));
+#endif
+	for (; p != aEnd; ++p)
+		count += *p == '\n';
+	return count;
+}
 
-	auto& line = mLines[at.mLine];
-	auto cindex = GetCharacterIndex(at);
+// Makes a line which refers to a piece of the loaded text. Carriage returns are not part of the document,
+// so a line containing them anywhere else but at its end gets its own glyphs instead.
+static TextEditor::Line MakeLoadedLine(const TextEditor::Char* aBegin, const TextEditor::Char* aEnd)
+{
+	while (aBegin != aEnd && aEnd[-1] == '\r')
+		--aEnd;
 
-	if (cindex >= (int)line.size())
-		return at;
+	if (std::find(aBegin, aEnd, '\r') == aEnd)
+		return TextEditor::Line(aBegin, (int)(aEnd - aBegin));
 
-	bool prevspace = (bool)isspace(line[cindex].mChar);
-	auto cstart = (PaletteIndex)line[cindex].mColorIndex;
-	while (cindex < (int)line.size())
+	TextEditor::Line line;
+	for (auto p = aBegin; p != aEnd; ++p)
 	{
-		auto c = line[cindex].mChar;
-		auto d = UTF8CharLength(c);
-		if (cstart != (PaletteIndex)line[cindex].mColorIndex)
-			break;
-
-		if (prevspace != !!isspace(c))
-		{
-			if (isspace(c))
-				while (cindex < (int)line.size() && isspace(line[cindex].mChar))
-					++cindex;
-			break;
-		}
-		cindex += d;
+		if (*p != '\r')
+			line.Insert(line.size(), *p);
 	}
-	return Coordinates(aFrom.mLine, GetCharacterColumn(aFrom.mLine, cindex));
+	return line;
 }
 
-TextEditor::Coordinates TextEditor::FindNextWord(const Coordinates & aFrom) const
+struct TextEditor::Lines::Mapping
 {
-	Coordinates at = aFrom;
-	if (at.mLine >= (int)mLines.size())
-		return at;
-
-	// skip to the next non-word character
-	auto cindex = GetCharacterIndex(aFrom);
-	bool isword = false;
-	bool skip = false;
-	if (cindex < (int)mLines[at.mLine].size())
+	struct CachedLine
 	{
-		auto& line = mLines[at.mLine];
-		isword = isalnum(line[cindex].mChar);
-		skip = isword;
-	}
+		CachedLine() : mLastUsed(0) {}
+
+		Line mLine;
+		unsigned mLastUsed;		// the frame the line was last accessed in, 0 until the line is made
+	};
+
+	static const size_t BlockSize = 1 << 20;	// the indexer publishes the line starts found in each block
+	static const size_t CacheSize = 4096;		// the cache is trimmed back to this many lines
+
+	Mapping();
+	~Mapping();
+
+	bool Open(const char* aPath);
+	void Index();
+	Line MakeLine(size_t aIndex) const;
+
+	const Char* mData;
+	size_t mSize;
+#ifdef _WIN32
+	HANDLE mFile;
+	HANDLE mFileMapping;
+#endif
+
+	// shared with the indexer thread
+	std::mutex mMutex;
+	std::vector<size_t> mFoundStarts;
+	size_t mFoundSize;
+	bool mFound;
+	std::atomic<bool> mCancel;
+	std::thread mIndexer;
+
+	// the index as seen by the editor, only updated between frames
+	std::vector<size_t> mLineStarts;
+	size_t mIndexedSize;
+	bool mIndexed;
+	std::unordered_map<size_t, CachedLine> mCache;
+	unsigned mFrame;
+};
+
+TextEditor::Lines::Mapping::Mapping()
+	: mData(nullptr)
+	, mSize(0)
+#ifdef _WIN32
+	, mFile(INVALID_HANDLE_VALUE)
+	, mFileMapping(nullptr)
+#endif
+	, mFoundSize(0)
+	, mFound(false)
+	, mCancel(false)
+	, mLineStarts(1, 0)
+	, mIndexedSize(0)
+	, mIndexed(false)
+	, mFrame(1)
+{
+}
 
-	while (!isword || skip)
-	{
-		if (at.mLine >= mLines.size())
-		{
-			auto l = std::max(0, (int) mLines.size() - 1);
-			return Coordinates(l, GetLineMaxColumn(l));
-		}
+TextEditor::Lines::Mapping::~Mapping()
+{
+	mCancel = true;
+	if (mIndexer.joinable())
+		mIndexer.join();
+
+#ifdef _WIN32
+	if (mData != nullptr)
+		UnmapViewOfFile(mData);
+	if (mFileMapping != nullptr)
+		CloseHandle(mFileMapping);
+	if (mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+#else
+	if (mData != nullptr)
+		munmap((void*)mData, mSize);
+#endif
+}
 
-		auto& line = mLines[at.mLine];
-		if (cindex < (int)line.size())
-		{
-			isword = isalnum(line[cindex].mChar);
+bool TextEditor::Lines::Mapping::Open(const char* aPath)
+{
+#ifdef _WIN32
+	mFile = CreateFileA(aPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return false;
 
-			if (isword && !skip)
-				return Coordinates(at.mLine, GetCharacterColumn(at.mLine, cindex));
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mFile, &size))
+		return false;
+	mSize = (size_t)size.QuadPart;
 
-			if (!isword)
-				skip = false;
+	// an empty file cannot be mapped
+	if (mSize > 0)
+	{
+		mFileMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mFileMapping == nullptr)
+			return false;
+		mData = (const Char*)MapViewOfFile(mFileMapping, FILE_MAP_READ, 0, 0, 0);
+		if (mData == nullptr)
+			return false;
+	}
+#else
+	int file = open(aPath, O_RDONLY);
+	if (file < 0)
+		return false;
 
-			cindex++;
-		}
-		else
+	struct stat info;
+	if (fstat(file, &info) != 0)
+	{
+		close(file);
+		return false;
+	}
+
+	// an empty file cannot be mapped
+	if (info.st_size > 0)
+	{
+		auto data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data == MAP_FAILED)
 		{
-			cindex = 0;
-			++at.mLine;
-			skip = false;
-			isword = false;
+			close(file);
+			return false;
 		}
+		mData = (const Char*)data;
+		mSize = (size_t)info.st_size;
 	}
+	close(file);
+#endif
 
-	return at;
+	mIndexer = std::thread(&Mapping::Index, this);
+	return true;
 }
 
-int TextEditor::GetCharacterIndex(const Coordinates& aCoordinates) const
+void TextEditor::Lines::Mapping::Index()
 {
-	if (aCoordinates.mLine >= mLines.size())
-		return -1;
-	auto& line = mLines[aCoordinates.mLine];
-	int c = 0;
-	int i = 0;
-	for (; i < line.size() && c < aCoordinates.mColumn;)
+	std::vector<size_t> starts;
+	size_t from = 0;
+	while (from < mSize && !mCancel)
 	{
-		if (line[i].mChar == '\t')
-			c = (c / mTabSize) * mTabSize + mTabSize;
-		else
-			++c;
-		i += UTF8CharLength(line[i].mChar);
+		auto to = std::min(from + BlockSize, mSize);
+		ForEachNewLine(mData + from, mData + to, [&](const Char* aNewLine) { starts.push_back(aNewLine + 1 - mData); });
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		mFoundStarts.insert(mFoundStarts.end(), starts.begin(), starts.end());
+		mFoundSize = to;
+		starts.clear();
+		from = to;
 	}
-	return i;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	mFound = true;
 }
 
-int TextEditor::GetCharacterColumn(int aLine, int aIndex) const
+struct TextEditor::Lines::Loader
+{
+	static const size_t BlockSize = 1 << 20;	// the lines are made and published in blocks of this many characters
+
+	Loader(const Char* aText, size_t aSize, std::shared_ptr<const void> aOwner);
+	~Loader();
+
+	void LoadBlock(std::vector<Line>& aLines);
+	void Load();
+
+	std::shared_ptr<const void> mOwner;
+	const Char* mText;
+	size_t mSize;
+	size_t mLineStart;		// where the line being scanned starts
+	size_t mScanned;
+	bool mCarriageReturn;	// whether the line being scanned has a carriage return in the part scanned so far
+
+	// shared with the loader thread
+	std::mutex mMutex;
+	std::vector<Line> mFoundLines;
+	size_t mFoundSize;
+	bool mDone;
+	std::atomic<bool> mCancel;
+	std::thread mThread;
+
+	size_t mLoadedSize;
+	bool mPartial;			// whether the only line is the start of the first line, see Lines::Load()
+};
+
+TextEditor::Lines::Loader::Loader(const Char* aText, size_t aSize, std::shared_ptr<const void> aOwner)
+	: mOwner(std::move(aOwner))
+	, mText(aText)
+	, mSize(aSize)
+	, mLineStart(0)
+	, mScanned(0)
+	, mCarriageReturn(false)
+	, mFoundSize(0)
+	, mDone(false)
+	, mCancel(false)
+	, mLoadedSize(0)
+	, mPartial(false)
 {
-	if (aLine >= mLines.size())
-		return 0;
-	auto& line = mLines[aLine];
-	int col = 0;
-	int i = 0;
-	while (i < aIndex && i < (int)line.size())
-	{
-		auto c = line[i].mChar;
-		i += UTF8CharLength(c);
-		if (c == '\t')
-			col = (col / mTabSize) * mTabSize + mTabSize;
-		else
-			col++;
-	}
-	return col;
 }
 
-int TextEditor::GetLineCharacterCount(int aLine) const
+TextEditor::Lines::Loader::~Loader()
 {
-	if (aLine >= mLines.size())
-		return 0;
-	auto& line = mLines[aLine];
-	int c = 0;
-	for (unsigned i = 0; i < line.size(); c++)
-		i += UTF8CharLength(line[i].mChar);
-	return c;
+	mCancel = true;
+	if (mThread.joinable())
+		mThread.join();
 }
 
-int TextEditor::GetLineMaxColumn(int aLine) const
+// Makes the lines which end in the next block, and the last line at the end of the text.
+void TextEditor::Lines::Loader::LoadBlock(std::vector<Line>& aLines)
 {
-	if (aLine >= mLines.size())
-		return 0;
-	auto& line = mLines[aLine];
-	int col = 0;
-	for (unsigned i = 0; i < line.size(); )
+	auto to = std::min(mScanned + BlockSize, mSize);
+	auto begin = mText + mLineStart;
+	// only the new block is searched, the part of the line before it was searched with the previous blocks
+	auto carriageReturns = mCarriageReturn || (to > mScanned && memchr(mText + mScanned, '\r', to - mScanned) != nullptr);
+	auto addLine = [&](const Char* aLineEnd)
 	{
-		auto c = line[i].mChar;
-		if (c == '\t')
-			col = (col / mTabSize) * mTabSize + mTabSize;
+		if (carriageReturns)
+			aLines.push_back(MakeLoadedLine(begin, aLineEnd));
 		else
-			col++;
-		i += UTF8CharLength(c);
-	}
-	return col;
+			aLines.emplace_back(begin, (int)(aLineEnd - begin));
+		begin = aLineEnd + 1;
+	};
+	ForEachNewLine(mText + mScanned, mText + to, addLine);
+	if (to == mSize)
+		addLine(mText + mSize);
+
+	// a line made in this block ends in it, so the rest of the block is all there is left of the next line
+	if (begin != mText + mLineStart)
+		carriageReturns = carriageReturns && begin < mText + to && memchr(begin, '\r', mText + to - begin) != nullptr;
+	mCarriageReturn = carriageReturns;
+	mLineStart = begin - mText;
+	mScanned = to;
 }
 
-bool TextEditor::IsOnWordBoundary(const Coordinates & aAt) const
+void TextEditor::Lines::Loader::Load()
 {
-	if (aAt.mLine >= (int)mLines.size() || aAt.mColumn == 0)
-		return true;
+	while (mScanned < mSize && !mCancel)
+	{
+		std::vector<Line> lines;
+		LoadBlock(lines);
 
-	auto& line = mLines[aAt.mLine];
-	auto cindex = GetCharacterIndex(aAt);
-	if (cindex >= (int)line.size())
-		return true;
+		std::lock_guard<std::mutex> lock(mMutex);
+		mFoundLines.insert(mFoundLines.end(), std::make_move_iterator(lines.begin()), std::make_move_iterator(lines.end()));
+		mFoundSize = mScanned;
+	}
 
-	if (mColorizerEnabled)
-		return line[cindex].mColorIndex != line[size_t(cindex - 1)].mColorIndex;
+	std::lock_guard<std::mutex> lock(mMutex);
+	mDone = true;
+}
+
+bool TextEditor::Lines::Map(const char* aPath)
+{
+	auto mapping = std::make_shared<Mapping>();
+	if (!mapping->Open(aPath))
+		return false;
 
-	return isspace(line[cindex].mChar) != isspace(line[cindex - 1].mChar);
+	mLoader.reset();
+	std::vector<Line>().swap(mLines);
+	ClearOffsets();
+	mMapping = mapping;
+	ClearWidths();
+	return true;
 }
 
-void TextEditor::RemoveLine(int aStart, int aEnd)
+void TextEditor::Lines::Load(const Char* aText, size_t aSize, std::shared_ptr<const void> aOwner)
 {
-	assert(!mReadOnly);
-	assert(aEnd >= aStart);
-	assert(mLines.size() > (size_t)(aEnd - aStart));
+	clear();
 
-	ErrorMarkers etmp;
-	for (auto& i : mErrorMarkers)
+	// the lines in the first block are made right away, so that there is something to show. A first line
+	// which goes on past it is shown up to the end of the block, and replaced once the loader thread has made it.
+	auto loader = std::make_shared<Loader>(aText, aSize, std::move(aOwner));
+	loader->LoadBlock(mLines);
+	if (mLines.empty())
 	{
-		ErrorMarkers::value_type e(i.first >= aStart ? i.first - 1 : i.first, i.second);
-		if (e.first >= aStart && e.first <= aEnd)
-			continue;
-		etmp.insert(e);
+		mLines.push_back(MakeLoadedLine(aText, aText + loader->mScanned));
+		loader->mPartial = true;
 	}
-	mErrorMarkers = std::move(etmp);
+	ClearWidths();
+	loader->mLoadedSize = loader->mScanned;
 
-	Breakpoints btmp;
-	for (auto i : mBreakpoints)
+	if (loader->mScanned < aSize)
 	{
-		if (i >= aStart && i <= aEnd)
-			continue;
-		btmp.insert(i >= aStart ? i - 1 : i);
+		loader->mThread = std::thread(&Loader::Load, loader.get());
+		mLoader = loader;
 	}
-	mBreakpoints = std::move(btmp);
+}
 
-	mLines.erase(mLines.begin() + aStart, mLines.begin() + aEnd);
-	assert(!mLines.empty());
+bool TextEditor::Lines::IsPartial() const
+{
+	return mLoader != nullptr && mLoader->mPartial;
+}
 
-	mTextChanged = true;
+bool TextEditor::Lines::IsIndexing() const
+{
+	return mMapping != nullptr && !mMapping->mIndexed;
 }
 
-void TextEditor::RemoveLine(int aIndex)
+float TextEditor::Lines::GetLoadProgress() const
 {
-	assert(!mReadOnly);
-	assert(mLines.size() > 1);
+	return mLoader ? (float)((double)mLoader->mLoadedSize / (double)mLoader->mSize) : 1.0f;
+}
 
-	ErrorMarkers etmp;
-	for (auto& i : mErrorMarkers)
+void TextEditor::Lines::Update()
+{
+	if (mLoader)
 	{
-		ErrorMarkers::value_type e(i.first > aIndex ? i.first - 1 : i.first, i.second);
-		if (e.first - 1 == aIndex)
-			continue;
-		etmp.insert(e);
+		std::vector<Line> lines;
+		bool done;
+		{
+			std::lock_guard<std::mutex> lock(mLoader->mMutex);
+			lines.swap(mLoader->mFoundLines);
+			mLoader->mLoadedSize = mLoader->mFoundSize;
+			done = mLoader->mDone;
+		}
+		if (!lines.empty())
+		{
+			if (mLoader->mPartial)
+			{
+				Erase(0, 1);
+				mLoader->mPartial = false;
+			}
+			Insert((int)mLines.size(), std::move(lines));
+		}
+
+		if (done)
+			mLoader.reset();
 	}
-	mErrorMarkers = std::move(etmp);
 
-	Breakpoints btmp;
-	for (auto i : mBreakpoints)
+	if (!mMapping)
+		return;
+
+	auto& mapping = *mMapping;
+	++mapping.mFrame;
+
+	if (!mapping.mIndexed)
 	{
-		if (i == aIndex)
-			continue;
-		btmp.insert(i >= aIndex ? i - 1 : i);
+		std::lock_guard<std::mutex> lock(mapping.mMutex);
+		if (mapping.mFoundSize != mapping.mIndexedSize || mapping.mFound)
+		{
+			// the last line may continue in the newly indexed part
+			mapping.mCache.erase(mapping.mLineStarts.size() - 1);
+			mapping.mLineStarts.insert(mapping.mLineStarts.end(), mapping.mFoundStarts.begin(), mapping.mFoundStarts.end());
+			mapping.mFoundStarts.clear();
+			mapping.mIndexedSize = mapping.mFoundSize;
+			mapping.mIndexed = mapping.mFound;
+		}
 	}
-	mBreakpoints = std::move(btmp);
 
-	mLines.erase(mLines.begin() + aIndex);
-	assert(!mLines.empty());
+	// only trimmed between frames, so the lines used within a frame stay valid
+	if (mapping.mCache.size() > 2 * Mapping::CacheSize)
+	{
+		std::vector<unsigned> used;
+		used.reserve(mapping.mCache.size());
+		for (auto& cached : mapping.mCache)
+			used.push_back(cached.second.mLastUsed);
 
-	mTextChanged = true;
+		auto nth = used.end() - Mapping::CacheSize;
+		std::nth_element(used.begin(), nth, used.end());
+		auto oldest = *nth;
+
+		// lines last used in the same frame as the oldest kept one go too, as long as there are too many
+		for (auto it = mapping.mCache.begin(); it != mapping.mCache.end(); )
+		{
+			if (it->second.mLastUsed < oldest || (it->second.mLastUsed == oldest && mapping.mCache.size() > Mapping::CacheSize))
+				it = mapping.mCache.erase(it);
+			else
+				++it;
+		}
+	}
 }
 
-TextEditor::Line& TextEditor::InsertLine(int aIndex)
+bool TextEditor::Lines::IsColorized(int aIndex) const
 {
-	assert(!mReadOnly);
+	if (!mMapping)
+		return mLines[aIndex].IsColorized();
 
-	auto& result = *mLines.insert(mLines.begin() + aIndex, Line());
-
-	ErrorMarkers etmp;
-	for (auto& i : mErrorMarkers)
-		etmp.insert(ErrorMarkers::value_type(i.first >= aIndex ? i.first + 1 : i.first, i.second));
-	mErrorMarkers = std::move(etmp);
+	auto it = mMapping->mCache.find(aIndex);
+	return it != mMapping->mCache.end() && it->second.mLine.IsColorized();
+}
 
-	Breakpoints btmp;
-	for (auto i : mBreakpoints)
-		btmp.insert(i >= aIndex ? i + 1 : i);
-	mBreakpoints = std::move(btmp);
+void TextEditor::Lines::SetColorized(int aIndex)
+{
+	if (!mMapping)
+	{
+		mLines[aIndex].SetColorized(true);
+		return;
+	}
 
-	return result;
+	auto it = mMapping->mCache.find(aIndex);
+	if (it != mMapping->mCache.end())
+		it->second.mLine.SetColorized(true);
 }
 
-std::string TextEditor::GetWordUnderCursor() const
+void TextEditor::Lines::ResetColorized(int aFromLine, int aToLine)
 {
-	auto c = GetCursorPosition();
-	return GetWordAt(c);
+	if (!mMapping)
+	{
+		for (int i = aFromLine; i < aToLine; ++i)
+			mLines[i].SetColorized(false);
+		return;
+	}
+
+	for (auto& cached : mMapping->mCache)
+	{
+		if ((int)cached.first >= aFromLine && (int)cached.first < aToLine)
+			cached.second.mLine.SetColorized(false);
+	}
 }
 
-std::string TextEditor::GetWordAt(const Coordinates & aCoords) const
+// The number of lines a block of offsets is made with. It is split once it gets twice as many.
+static const int OffsetBlockLines = 64;
+
+// Fenwick trees are 1-based, aTree[0] is unused.
+static void BuildTree(std::vector<size_t>& aTree)
 {
-	auto start = FindWordStart(aCoords);
-	auto end = FindWordEnd(aCoords);
+	auto count = aTree.size() - 1;
+	for (size_t i = 1; i <= count; ++i)
+	{
+		auto parent = i + (i & (0 - i));
+		if (parent <= count)
+			aTree[parent] += aTree[i];
+	}
+}
 
-	std::string r;
+static void AddToTree(std::vector<size_t>& aTree, size_t aIndex, size_t aDelta)
+{
+	for (size_t i = aIndex + 1; i < aTree.size(); i += i & (0 - i))
+		aTree[i] += aDelta;
+}
 
-	auto istart = GetCharacterIndex(start);
-	auto iend = GetCharacterIndex(end);
+// The sum of the first aCount values.
+static size_t SumTree(const std::vector<size_t>& aTree, size_t aCount)
+{
+	size_t sum = 0;
+	for (size_t i = std::min(aCount, aTree.size() - 1); i > 0; i -= i & (0 - i))
+		sum += aTree[i];
+	return sum;
+}
 
-	for (auto it = istart; it < iend; ++it)
-		r.push_back(mLines[aCoords.mLine][it].mChar);
+// The number of values (all of them positive) whose sum is at most aValue, which is reduced by that sum.
+static size_t DescendTree(const std::vector<size_t>& aTree, size_t& aValue)
+{
+	auto count = aTree.size() - 1;
+	size_t step = 1;
+	while (step * 2 <= count)
+		step *= 2;
 
-	return r;
+	size_t index = 0;
+	for (; step > 0; step /= 2)
+	{
+		if (index + step <= count && aTree[index + step] <= aValue)
+		{
+			index += step;
+			aValue -= aTree[index];
+		}
+	}
+	return index;
 }
 
-ImU32 TextEditor::GetGlyphColor(const Glyph & aGlyph) const
+void TextEditor::Lines::BuildOffsets() const
 {
-	if (!mColorizerEnabled)
-		return mPalette[(int)PaletteIndex::Default];
-	if (aGlyph.mComment)
-		return mPalette[(int)PaletteIndex::Comment];
-	if (aGlyph.mMultiLineComment)
-		return mPalette[(int)PaletteIndex::MultiLineComment];
-	auto const color = mPalette[(int)aGlyph.mColorIndex];
-	if (aGlyph.mPreprocessor)
+	auto count = (int)mLines.size();
+	mBlockLines.clear();
+	mBlockSizes.clear();
+	for (int i = 0; i < count; i += OffsetBlockLines)
 	{
-		const auto ppcolor = mPalette[(int)PaletteIndex::Preprocessor];
-		const int c0 = ((ppcolor & 0xff) + (color & 0xff)) / 2;
-		const int c1 = (((ppcolor >> 8) & 0xff) + ((color >> 8) & 0xff)) / 2;
-		const int c2 = (((ppcolor >> 16) & 0xff) + ((color >> 16) & 0xff)) / 2;
-		const int c3 = (((ppcolor >> 24) & 0xff) + ((color >> 24) & 0xff)) / 2;
-		return ImU32(c0 | (c1 << 8) | (c2 << 16) | (c3 << 24));
+		auto end = std::min(count, i + OffsetBlockLines);
+		size_t size = 0;
+		for (int j = i; j < end; ++j)
+			size += mLines[j].size() + 1;
+		mBlockLines.push_back(end - i);
+		mBlockSizes.push_back(size);
 	}
-	return color;
+	BuildOffsetTrees();
 }
 
-void TextEditor::HandleKeyboardInputs()
+void TextEditor::Lines::BuildOffsetTrees() const
 {
-	ImGuiIO& io = ImGui::GetIO();
-	auto shift = io.KeyShift;
-	auto ctrl = io.ConfigMacOSXBehaviors ? io.KeySuper : io.KeyCtrl;
-	auto alt = io.ConfigMacOSXBehaviors ? io.KeyCtrl : io.KeyAlt;
+	mLineTree.assign(1, 0);
+	mLineTree.insert(mLineTree.end(), mBlockLines.begin(), mBlockLines.end());
+	BuildTree(mLineTree);
+	mSizeTree.assign(1, 0);
+	mSizeTree.insert(mSizeTree.end(), mBlockSizes.begin(), mBlockSizes.end());
+	BuildTree(mSizeTree);
+}
 
-	if (ImGui::IsWindowFocused())
+// The block which has the line aIndex, and the first line of that block. A line past the end is in the last block.
+int TextEditor::Lines::FindBlock(int aIndex, int& aFirstLine) const
+{
+	size_t within = aIndex;
+	auto block = (int)DescendTree(mLineTree, within);
+	if (block == (int)mBlockLines.size())
 	{
-		if (ImGui::IsWindowHovered())
-			ImGui::SetMouseCursor(ImGuiMouseCursor_TextInput);
-		//ImGui::CaptureKeyboardFromApp(true);
+		--block;
+		within = mBlockLines[block];
+	}
+	aFirstLine = aIndex - (int)within;
+	return block;
+}
 
-		io.WantCaptureKeyboard = true;
-		io.WantTextInput = true;
+// Sums the sizes of the lines of a block again.
+void TextEditor::Lines::UpdateBlockSize(int aBlock, int aFirstLine)
+{
+	size_t size = 0;
+	for (int i = aFirstLine; i < aFirstLine + mBlockLines[aBlock]; ++i)
+		size += mLines[i].size() + 1;
+	AddToTree(mSizeTree, aBlock, size - mBlockSizes[aBlock]);
+	mBlockSizes[aBlock] = size;
+}
 
-		if (!IsReadOnly() && ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Z)))
-			Undo();
-		else if (!IsReadOnly() && !ctrl && !shift && alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Backspace)))
-			Undo();
-		else if (!IsReadOnly() && ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Y)))
-			Redo();
-		else if (!ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_UpArrow)))
-			MoveUp(1, shift);
-		else if (!ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_DownArrow)))
-			MoveDown(1, shift);
-		else if (!alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_LeftArrow)))
-			MoveLeft(1, shift, ctrl);
-		else if (!alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_RightArrow)))
-			MoveRight(1, shift, ctrl);
-		else if (!alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_PageUp)))
-			MoveUp(GetPageSize() - 4, shift);
-		else if (!alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_PageDown)))
-			MoveDown(GetPageSize() - 4, shift);
-		else if (!alt && ctrl && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Home)))
-			MoveTop(shift);
-		else if (ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_End)))
-			MoveBottom(shift);
-		else if (!ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Home)))
-			MoveHome(shift);
-		else if (!ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_End)))
-			MoveEnd(shift);
-		else if (!IsReadOnly() && !ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Delete)))
-			Delete();
-		else if (!IsReadOnly() && !ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Backspace)))
-			Backspace();
-		else if (!ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Insert)))
-			mOverwrite ^= true;
-		else if (ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Insert)))
-			Copy();
-		else if (ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_C)))
-			Copy();
-		else if (!IsReadOnly() && !ctrl && shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Insert)))
-			Paste();
-		else if (!IsReadOnly() && ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_V)))
-			Paste();
-		else if (ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_X)))
-			Cut();
-		else if (!ctrl && shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Delete)))
-			Cut();
-		else if (ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_A)))
-			SelectAll();
-		else if (!IsReadOnly() && !ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Enter)))
-			EnterCharacter('\n', false);
-		else if (!IsReadOnly() && !ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Tab)))
-			EnterCharacter('\t', shift);
+// Called once aCount lines are inserted at aIndex, they are added to the block of the line which was there.
+void TextEditor::Lines::AddOffsets(int aIndex, int aCount)
+{
+	if (mBlockLines.empty() || aCount == 0)
+		return;
 
-		if (!IsReadOnly() && !io.InputQueueCharacters.empty())
+	int first;
+	auto block = FindBlock(aIndex, first);
+	mBlockLines[block] += aCount;
+	AddToTree(mLineTree, block, aCount);
+	UpdateBlockSize(block, first);
+
+	if (mBlockLines[block] < 2 * OffsetBlockLines)
+		return;
+
+	// splits the block into blocks of OffsetBlockLines lines
+	auto count = mBlockLines[block];
+	auto blocks = (count + OffsetBlockLines - 1) / OffsetBlockLines;
+	mBlockLines.insert(mBlockLines.begin() + block + 1, blocks - 1, 0);
+	mBlockSizes.insert(mBlockSizes.begin() + block + 1, blocks - 1, 0);
+	for (int i = 0; i < blocks; ++i)
+	{
+		auto lines = std::min(OffsetBlockLines, count - i * OffsetBlockLines);
+		size_t size = 0;
+		for (int j = first; j < first + lines; ++j)
+			size += mLines[j].size() + 1;
+		mBlockLines[block + i] = lines;
+		mBlockSizes[block + i] = size;
+		first += lines;
+	}
+	BuildOffsetTrees();
+}
+
+// Called once the lines in [aStart, aEnd) are removed, the blocks they were in are updated (and dropped if
+// they have no line left).
+void TextEditor::Lines::RemoveOffsets(int aStart, int aEnd)
+{
+	if (mBlockLines.empty() || aStart >= aEnd)
+		return;
+
+	int first;
+	auto block = FindBlock(aStart, first);
+	auto within = aStart - first;
+	auto removed = aEnd - aStart;
+	auto last = block;
+	for (; removed > 0; ++last)
+	{
+		auto count = std::min(removed, mBlockLines[last] - within);
+		mBlockLines[last] -= count;
+		AddToTree(mLineTree, last, 0 - (size_t)count);
+		removed -= count;
+		within = 0;
+	}
+
+	// the lines left of the blocks are the ones before aStart, and the ones after aEnd
+	bool empty = false;
+	for (auto i = block; i < last; ++i)
+	{
+		UpdateBlockSize(i, first);
+		first += mBlockLines[i];
+		empty = empty || mBlockLines[i] == 0;
+	}
+
+	if (empty)
+	{
+		size_t kept = 0;
+		for (size_t i = 0; i < mBlockLines.size(); ++i)
 		{
-			for (int i = 0; i < io.InputQueueCharacters.Size; i++)
+			if (mBlockLines[i] > 0)
 			{
-				auto c = io.InputQueueCharacters[i];
-				if (c != 0 && (c == '\n' || c >= 32))
-					EnterCharacter(c, shift);
+				mBlockLines[kept] = mBlockLines[i];
+				mBlockSizes[kept] = mBlockSizes[i];
+				++kept;
 			}
-			io.InputQueueCharacters.resize(0);
 		}
+		mBlockLines.resize(kept);
+		mBlockSizes.resize(kept);
+		BuildOffsetTrees();
 	}
 }
 
-void TextEditor::HandleMouseInputs()
+void TextEditor::Lines::Resized(int aIndex)
 {
-	ImGuiIO& io = ImGui::GetIO();
-	auto shift = io.KeyShift;
-	auto ctrl = io.ConfigMacOSXBehaviors ? io.KeySuper : io.KeyCtrl;
-	auto alt = io.ConfigMacOSXBehaviors ? io.KeyCtrl : io.KeyAlt;
+	// the line is measured again
+	if (mWidths[aIndex] >= 0.0f)
+	{
+		CountWidth(mWidths[aIndex], -1);
+		mWidths[aIndex] = -1.0f;
+		AddUnmeasured(aIndex, aIndex + 1);
+	}
 
-	if (ImGui::IsWindowHovered())
+	if (mBlockLines.empty())
+		return;
+
+	int first;
+	auto block = FindBlock(aIndex, first);
+	UpdateBlockSize(block, first);
+}
+
+void TextEditor::Lines::SetWidth(int aIndex, float aWidth)
+{
+	if (mMapping)
 	{
-		if (!shift && !alt)
-		{
-			auto click = ImGui::IsMouseClicked(0);
-			auto doubleClick = ImGui::IsMouseDoubleClicked(0);
-			auto t = ImGui::GetTime();
-			auto tripleClick = click && !doubleClick && (mLastClick != -1.0f && (t - mLastClick) < io.MouseDoubleClickTime);
+		mMappedWidth = std::max(mMappedWidth, aWidth);
+		return;
+	}
 
-			/*
-			Left mouse button triple click
-			*/
+	CountWidth(mWidths[aIndex], -1);
+	mWidths[aIndex] = aWidth;
+	CountWidth(aWidth, 1);
+}
 
-			if (tripleClick)
-			{
-				if (!ctrl)
-				{
-					mState.mCursorPosition = mInteractiveStart = mInteractiveEnd = ScreenPosToCoordinates(ImGui::GetMousePos());
-					mSelectionMode = SelectionMode::Line;
-					SetSelection(mInteractiveStart, mInteractiveEnd, mSelectionMode);
-				}
+void TextEditor::Lines::ClearWidths()
+{
+	mWidths.assign(mMapping ? 0 : mLines.size(), -1.0f);
+	mWidthCounts.clear();
+	mUnmeasuredMin = 0;
+	mUnmeasuredMax = (int)mWidths.size();
+	mMappedWidth = 0.0f;
+}
 
-				mLastClick = -1.0f;
-			}
+int TextEditor::Lines::NextUnmeasured() const
+{
+	while (mUnmeasuredMin < mUnmeasuredMax && mWidths[mUnmeasuredMin] >= 0.0f)
+		++mUnmeasuredMin;
+	return mUnmeasuredMin < mUnmeasuredMax ? mUnmeasuredMin : (int)size();
+}
 
-			/*
-			Left mouse button double click
-			*/
+// Inserts aCount lines without a width at aIndex.
+void TextEditor::Lines::AddWidths(int aIndex, int aCount)
+{
+	mWidths.insert(mWidths.begin() + aIndex, aCount, -1.0f);
+	if (mUnmeasuredMax > aIndex)
+		mUnmeasuredMax += aCount;
+	AddUnmeasured(aIndex, aIndex + aCount);
+}
 
-			else if (doubleClick)
-			{
-				if (!ctrl)
-				{
-					mState.mCursorPosition = mInteractiveStart = mInteractiveEnd = ScreenPosToCoordinates(ImGui::GetMousePos());
-					if (mSelectionMode == SelectionMode::Line)
-						mSelectionMode = SelectionMode::Normal;
-					else
-						mSelectionMode = SelectionMode::Word;
-					SetSelection(mInteractiveStart, mInteractiveEnd, mSelectionMode);
-				}
+void TextEditor::Lines::RemoveWidths(int aStart, int aEnd)
+{
+	for (int i = aStart; i < aEnd; ++i)
+		CountWidth(mWidths[i], -1);
+	mWidths.erase(mWidths.begin() + aStart, mWidths.begin() + aEnd);
 
-				mLastClick = (float)ImGui::GetTime();
-			}
+	auto move = [&](int aLine) { return aLine < aStart ? aLine : std::max(aStart, aLine - (aEnd - aStart)); };
+	mUnmeasuredMin = move(mUnmeasuredMin);
+	mUnmeasuredMax = move(mUnmeasuredMax);
+}
 
-			/*
-			Left mouse button click
-			*/
-			else if (click)
-			{
-				mState.mCursorPosition = mInteractiveStart = mInteractiveEnd = ScreenPosToCoordinates(ImGui::GetMousePos());
-				if (ctrl)
-					mSelectionMode = SelectionMode::Word;
-				else
-					mSelectionMode = SelectionMode::Normal;
-				SetSelection(mInteractiveStart, mInteractiveEnd, mSelectionMode);
+void TextEditor::Lines::CountWidth(float aWidth, int aCount)
+{
+	if (aWidth < 0.0f)
+		return;
 
-				mLastClick = (float)ImGui::GetTime();
-			}
-			// Mouse left button dragging (=> update selection)
-			else if (ImGui::IsMouseDragging(0) && ImGui::IsMouseDown(0))
-			{
-				io.WantCaptureMouse = true;
-				mState.mCursorPosition = mInteractiveEnd = ScreenPosToCoordinates(ImGui::GetMousePos());
-				SetSelection(mInteractiveStart, mInteractiveEnd, mSelectionMode);
-			}
-		}
+	auto& count = mWidthCounts[aWidth];
+	count += aCount;
+	if (count == 0)
+		mWidthCounts.erase(aWidth);
+}
+
+void TextEditor::Lines::AddUnmeasured(int aStart, int aEnd)
+{
+	if (mUnmeasuredMin >= mUnmeasuredMax)
+	{
+		mUnmeasuredMin = aStart;
+		mUnmeasuredMax = aEnd;
+	}
+	else
+	{
+		mUnmeasuredMin = std::min(mUnmeasuredMin, aStart);
+		mUnmeasuredMax = std::max(mUnmeasuredMax, aEnd);
 	}
 }
 
-void TextEditor::Render()
+size_t TextEditor::Lines::GetOffset(int aIndex) const
 {
-	/* Compute mCharAdvance regarding to scaled font size (Ctrl + mouse wheel)*/
-	const float fontSize = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, "#", nullptr, nullptr).x;
-	mCharAdvance = ImVec2(fontSize, ImGui::GetTextLineHeightWithSpacing() * mLineSpacing);
+	if (mMapping)
+		return aIndex < (int)mMapping->mLineStarts.size() ? mMapping->mLineStarts[aIndex] : mMapping->mIndexedSize;
+
+	if (mBlockLines.empty())
+		BuildOffsets();
+	if (aIndex >= (int)mLines.size())
+		return SumTree(mSizeTree, mBlockSizes.size());
+
+	int first;
+	auto block = FindBlock(aIndex, first);
+	auto offset = SumTree(mSizeTree, block);
+	for (int i = first; i < aIndex; ++i)
+		offset += mLines[i].size() + 1;
+	return offset;
+}
 
-	/* Update palette with the current alpha from style */
-	for (int i = 0; i < (int)PaletteIndex::Max; ++i)
+int TextEditor::Lines::FindOffset(size_t aOffset) const
+{
+	if (mMapping)
 	{
-		auto color = ImGui::ColorConvertU32ToFloat4(mPaletteBase[i]);
-		color.w *= ImGui::GetStyle().Alpha;
-		mPalette[i] = ImGui::ColorConvertFloat4ToU32(color);
+		auto& starts = mMapping->mLineStarts;
+		return (int)(std::upper_bound(starts.begin(), starts.end(), aOffset) - starts.begin()) - 1;
 	}
 
-	assert(mLineBuffer.empty());
+	if (mBlockLines.empty())
+		BuildOffsets();
+
+	// descends the tree to the block, skipping the ones which end before the offset, then its lines
+	auto block = DescendTree(mSizeTree, aOffset);
+	if (block >= mBlockSizes.size())
+		return std::max(0, (int)mLines.size() - 1);
+	auto index = (int)SumTree(mLineTree, block);
+	for (auto end = index + mBlockLines[block] - 1; index < end && (size_t)mLines[index].size() + 1 <= aOffset; ++index)
+		aOffset -= mLines[index].size() + 1;
+	return index;
+}
 
-	auto contentSize = ImGui::GetWindowContentRegionMax();
-	auto drawList = ImGui::GetWindowDrawList();
-	float longest(mTextStart);
+size_t TextEditor::Lines::MappedSize() const
+{
+	return mMapping->mLineStarts.size();
+}
 
-	if (mScrollToTop)
-	{
-		mScrollToTop = false;
-		ImGui::SetScrollY(0.f);
-	}
+TextEditor::Line TextEditor::Lines::Mapping::MakeLine(size_t aIndex) const
+{
+	auto begin = mData + mLineStarts[aIndex];
+	auto end = aIndex + 1 < mLineStarts.size() ? mData + mLineStarts[aIndex + 1] - 1 : mData + mIndexedSize;
+	return MakeLoadedLine(begin, end);
+}
 
-	ImVec2 cursorScreenPos = ImGui::GetCursorScreenPos();
-	auto scrollX = ImGui::GetScrollX();
-	auto scrollY = ImGui::GetScrollY();
+TextEditor::Line& TextEditor::Lines::GetMapped(size_t aIndex) const
+{
+	auto& mapping = *mMapping;
+	auto& cached = mapping.mCache[aIndex];
+	if (cached.mLastUsed == 0)
+		cached.mLine = mapping.MakeLine(aIndex);
+	cached.mLastUsed = mapping.mFrame;
+	return cached.mLine;
+}
 
-	auto lineNo = (int)floor(scrollY / mCharAdvance.y);
-	auto globalLineMax = (int)mLines.size();
-	auto lineMax = std::max(0, std::min((int)mLines.size() - 1, lineNo + (int)floor((scrollY + contentSize.y) / mCharAdvance.y)));
+const TextEditor::Line& TextEditor::Lines::Get(size_t aIndex, Line& aScratch) const
+{
+	if (!mMapping)
+		return mLines[aIndex];
 
-	// Deduce mTextStart by evaluating mLines size (global lineMax) plus two spaces as text width
-	char buf[16];
-	snprintf(buf, 16, " %d ", globalLineMax);
-	mTextStart = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, buf, nullptr, nullptr).x + mLeftMargin;
+	auto it = mMapping->mCache.find(aIndex);
+	if (it != mMapping->mCache.end())
+		return it->second.mLine;
 
-	if (!mLines.empty())
+	aScratch = mMapping->MakeLine(aIndex);
+	return aScratch;
+}
+
+struct TextEditor::Colorizer
+{
+	// What the lines are colorized with, shared by the jobs until the language changes
+	struct Language
+	{
+		LanguageDefinition mDefinition;
+		TokenDFA mTokenDFA;
+		RegexList mRegexList;
+		IdentifierClassifier mIdentifierClassifier;
+		std::shared_ptr<TokenCache> mTokenCache;
+		uint64_t mLanguageKey;
+	};
+
+	struct Job
 	{
-		float spaceSize = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, " ", nullptr, nullptr).x;
+		std::shared_ptr<const Language> mLanguage;
+		std::shared_ptr<const void> mText;	// the text the pieces of the lines point into
+		std::vector<Line> mLines;
+		std::vector<int> mIndices;	// where the lines are in the document, -1 for a line removed since
+		size_t mApplied;			// the number of lines whose colors were given to the document
+	};
+
+	Colorizer();
+	~Colorizer();
+
+	void Run();
+	void Cancel();
+
+	std::shared_ptr<const Language> mLanguage;
+
+	// shared with the colorizer thread
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	Job mJob;		// its lines past mFinished are only used by the thread while it is busy and not done
+	bool mBusy;
+	bool mDone;
+	bool mQuit;
+	std::atomic<bool> mCancel;		// stops the thread after the line it is at
+	std::atomic<size_t> mFinished;	// the number of lines of the job colorized so far, without the lock
+
+	std::thread mThread;
+};
+
+TextEditor::Colorizer::Colorizer()
+	: mBusy(false)
+	, mDone(false)
+	, mQuit(false)
+	, mCancel(false)
+	, mFinished(0)
+{
+	mJob.mApplied = 0;
+	mThread = std::thread(&Colorizer::Run, this);
+}
 
-		while (lineNo <= lineMax)
-		{
-			ImVec2 lineStartScreenPos = ImVec2(cursorScreenPos.x, cursorScreenPos.y + lineNo * mCharAdvance.y);
-			ImVec2 textScreenPos = ImVec2(lineStartScreenPos.x + mTextStart, lineStartScreenPos.y);
+TextEditor::Colorizer::~Colorizer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mCondition.notify_one();
+	mThread.join();
+}
 
-			auto& line = mLines[lineNo];
-			longest = std::max(mTextStart + TextDistanceToLineStart(Coordinates(lineNo, GetLineMaxColumn(lineNo))), longest);
-			auto columnNo = 0;
-			Coordinates lineStartCoord(lineNo, 0);
-			Coordinates lineEndCoord(lineNo, GetLineMaxColumn(lineNo));
+void TextEditor::Colorizer::Run()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	for (;;)
+	{
+		mCondition.wait(lock, [this] { return mQuit || (mBusy && !mDone); });
+		if (mQuit)
+			return;
 
-			// Draw selection for the current line
-			float sstart = -1.0f;
-			float ssend = -1.0f;
+		lock.unlock();
+		auto& language = *mJob.mLanguage;
+		for (size_t i = 0; i < mJob.mLines.size() && !mCancel; ++i)
+		{
+			ColorizeLine(mJob.mLines[i], language.mDefinition, language.mTokenDFA, language.mRegexList, language.mIdentifierClassifier, language.mTokenCache.get(), language.mLanguageKey);
+			mFinished.store(i + 1, std::memory_order_release);
+		}
+		lock.lock();
 
-			assert(mState.mSelectionStart <= mState.mSelectionEnd);
+		mDone = true;
+		mCondition.notify_one();
+	}
+}
+
+// Drops the job, once the thread stopped working on it. The lines of a text shown with SetTextView() don't
+// keep it alive, so this has to be done before the text is replaced.
+void TextEditor::Colorizer::Cancel()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mCancel = true;
+	mCondition.wait(lock, [this] { return !mBusy || mDone; });
+
+	mJob.mLines.clear();
+	mJob.mIndices.clear();
+	mJob.mText.reset();
+	mJob.mApplied = 0;
+	mFinished = 0;
+	mBusy = mDone = false;
+	mCancel = false;
+}
+
+// FNV-1a of everything the colors of a line depend on in a language, to tell it apart from others in a
+// TokenCache. The sets are added up, as their order is not defined.
+static uint64_t HashLanguage(const TextEditor::LanguageDefinition& aLanguage)
+{
+	auto hash = [](const std::string& aString, uint64_t aHash)
+	{
+		for (auto c : aString)
+			aHash = (aHash ^ (uint8_t)c) * 1099511628211ull;
+		return aHash;
+	};
+
+	uint64_t result = hash(aLanguage.mCommentStart + '\n' + aLanguage.mCommentEnd + '\n' + aLanguage.mSingleLineComment, 14695981039346656037ull);
+	result = (result ^ (uint8_t)aLanguage.mPreprocChar) * 1099511628211ull;
+	result = (result ^ (aLanguage.mCaseSensitive ? 1 : 0)) * 1099511628211ull;
+	result = (result ^ (aLanguage.mLongStrings ? 1 : 0)) * 1099511628211ull;
+	result = (result ^ (uint64_t)reinterpret_cast<uintptr_t>(aLanguage.mTokenize)) * 1099511628211ull;
+	for (auto& r : aLanguage.mTokenRegexStrings)
+		result = (hash(r.first, result) ^ (uint64_t)r.second) * 1099511628211ull;
+
+	uint64_t keywords = 0, identifiers = 0, preprocIdentifiers = 0;
+	for (auto& k : aLanguage.mKeywords)
+		keywords += hash(k, 14695981039346656037ull);
+	for (auto& i : aLanguage.mIdentifiers)
+		identifiers += hash(i.first, 14695981039346656037ull);
+	for (auto& i : aLanguage.mPreprocIdentifiers)
+		preprocIdentifiers += hash(i.first, 14695981039346656037ull);
+	result = (result ^ keywords) * 1099511628211ull;
+	result = (result ^ identifiers) * 1099511628211ull;
+	return (result ^ preprocIdentifiers) * 1099511628211ull;
+}
+
+void TextEditor::SetLanguageDefinition(const LanguageDefinition & aLanguageDef)
+{
+	mLanguageDefinition = aLanguageDef;
+	mRegexList.clear();
+
+	// the regexes are only used one by one if they can't be compiled into a single DFA
+	if (!mTokenDFA.Compile(mLanguageDefinition.mTokenRegexStrings))
+	{
+		for (auto& r : mLanguageDefinition.mTokenRegexStrings)
+			mRegexList.push_back(std::make_pair(std::regex(r.first, std::regex_constants::optimize), r.second));
+	}
+	mIdentifierClassifier.Build(mLanguageDefinition);
+	mLanguageKey = HashLanguage(mLanguageDefinition);
+
+	if (mColorizer)
+		mColorizer->mLanguage.reset();
+
+	Colorize();
+}
+
+void TextEditor::SetPalette(const Palette & aValue)
+{
+	mPaletteBase = aValue;
+	mPaletteAlpha = -1.0f;
+	mRedrawNeeded = true;
+}
+
+std::string TextEditor::GetText(const Coordinates & aStart, const Coordinates & aEnd) const
+{
+	std::string result;
+
+	auto lstart = aStart.mLine;
+	auto lend = aEnd.mLine;
+	auto istart = GetCharacterIndex(aStart);
+	auto iend = GetCharacterIndex(aEnd);
+	size_t s = 0;
+
+	for (size_t i = lstart; i < lend; i++)
+		s += mLines[i].size() + 1;
+
+	result.reserve(s + iend);
+
+	while (istart < iend || lstart < lend)
+	{
+		if (lstart >= (int)mLines.size())
+			break;
+
+		auto& line = mLines[lstart];
+		if (istart < (int)line.size())
+		{
+			// the last line only up to iend
+			auto to = lstart < lend ? line.size() : std::min(line.size(), iend);
+			result.append((const char*)line.data() + istart, to - istart);
+			istart = to;
+		}
+		else
+		{
+			istart = 0;
+			++lstart;
+			result += '\n';
+		}
+	}
+
+	return result;
+}
+
+TextEditor::Coordinates TextEditor::GetActualCursorCoordinates() const
+{
+	return SanitizeCoordinates(mState.mCursorPosition);
+}
+
+TextEditor::Coordinates TextEditor::SanitizeCoordinates(const Coordinates & aValue) const
+{
+	auto line = aValue.mLine;
+	auto column = aValue.mColumn;
+	if (line >= (int)mLines.size())
+	{
+		if (mLines.empty())
+		{
+			line = 0;
+			column = 0;
+		}
+		else
+		{
+			line = (int)mLines.size() - 1;
+			column = GetLineMaxColumn(line);
+		}
+		return Coordinates(line, column);
+	}
+	else
+	{
+		column = mLines.empty() ? 0 : std::min(column, GetLineMaxColumn(line));
+		return Coordinates(line, column);
+	}
+}
+
+// https://en.wikipedia.org/wiki/UTF-8
+// We assume that the char is a standalone character (<128) or a leading byte of an UTF-8 code sequence (non-10xxxxxx code)
+static int UTF8CharLength(TextEditor::Char c)
+{
+	if ((c & 0xFE) == 0xFC)
+		return 6;
+	if ((c & 0xFC) == 0xF8)
+		return 5;
+	if ((c & 0xF8) == 0xF0)
+		return 4;
+	else if ((c & 0xF0) == 0xE0)
+		return 3;
+	else if ((c & 0xE0) == 0xC0)
+		return 2;
+	return 1;
+}
+
+void TextEditor::Line::UpdateLayout(int aTabSize) const
+{
+	if (mLayoutTabSize == aTabSize)
+		return;
+
+	auto text = data();
+	auto size = this->size();
+	int col = 0;
+	int count = 0;
+	bool simple = true;
+	bool ascii = true;
+	for (int i = 0; i < size; ++count)
+	{
+		auto c = text[i];
+		if (c == '\t')
+		{
+			col = (col / aTabSize) * aTabSize + aTabSize;
+			simple = false;
+		}
+		else
+		{
+			col++;
+			if (c >= 0x80)
+				simple = false;
+			if (c < 0x20 || c >= 0x7f)
+				ascii = false;
+		}
+		i += UTF8CharLength(c);
+	}
+
+	mMaxColumn = col;
+	mCharacterCount = count;
+	mSimple = simple;
+	mAscii = ascii;
+	mLayoutTabSize = aTabSize;
+}
+
+// Returns the last checkpoint aIsBefore is true for. It has to be true for the checkpoints up to some point
+// (the first one is taken to be before anything).
+template<class F>
+static const TextEditor::Line::Checkpoint& FindCheckpoint(const TextEditor::Line::Checkpoints& aCheckpoints, F aIsBefore)
+{
+	auto& points = aCheckpoints.mPoints;
+	return *(std::partition_point(points.begin() + 1, points.end(), aIsBefore) - 1);
+}
+
+// "Borrowed" from ImGui source
+static inline int ImTextCharToUtf8(char* buf, int buf_size, unsigned int c)
+{
+	if (c < 0x80)
+	{
+		buf[0] = (char)c;
+		return 1;
+	}
+	if (c < 0x800)
+	{
+		if (buf_size < 2) return 0;
+		buf[0] = (char)(0xc0 + (c >> 6));
+		buf[1] = (char)(0x80 + (c & 0x3f));
+		return 2;
+	}
+	if (c >= 0xdc00 && c < 0xe000)
+	{
+		return 0;
+	}
+	if (c >= 0xd800 && c < 0xdc00)
+	{
+		if (buf_size < 4) return 0;
+		buf[0] = (char)(0xf0 + (c >> 18));
+		buf[1] = (char)(0x80 + ((c >> 12) & 0x3f));
+		buf[2] = (char)(0x80 + ((c >> 6) & 0x3f));
+		buf[3] = (char)(0x80 + ((c) & 0x3f));
+		return 4;
+	}
+	//else if (c < 0x10000)
+	{
+		if (buf_size < 3) return 0;
+		buf[0] = (char)(0xe0 + (c >> 12));
+		buf[1] = (char)(0x80 + ((c >> 6) & 0x3f));
+		buf[2] = (char)(0x80 + ((c) & 0x3f));
+		return 3;
+	}
+}
+
+void TextEditor::Advance(Coordinates & aCoordinates) const
+{
+	if (aCoordinates.mLine < (int)mLines.size())
+	{
+		auto& line = mLines[aCoordinates.mLine];
+		auto cindex = GetCharacterIndex(aCoordinates);
+
+		if (cindex + 1 < (int)line.size())
+		{
+			auto delta = UTF8CharLength(line[cindex]);
+			cindex = std::min(cindex + delta, (int)line.size() - 1);
+		}
+		else
+		{
+			++aCoordinates.mLine;
+			cindex = 0;
+		}
+		aCoordinates.mColumn = GetCharacterColumn(aCoordinates.mLine, cindex);
+	}
+}
+
+void TextEditor::DeleteRange(const Coordinates & aStart, const Coordinates & aEnd)
+{
+	assert(aEnd >= aStart);
+	assert(!IsReadOnly());
+
+	//printf("D(%d.%d)-(%d.%d)\n", aStart.mLine, aStart.mColumn, aEnd.mLine, aEnd.mColumn);
+
+	if (aEnd == aStart)
+		return;
+
+	auto start = GetCharacterIndex(aStart);
+	auto end = GetCharacterIndex(aEnd);
+
+	if (aStart.mLine == aEnd.mLine)
+	{
+		auto& line = mLines[aStart.mLine];
+		auto n = GetLineMaxColumn(aStart.mLine);
+		if (aEnd.mColumn >= n)
+			line.Erase(start, line.size());
+		else
+			line.Erase(start, end);
+		mLines.Resized(aStart.mLine);
+	}
+	else
+	{
+		auto& firstLine = mLines[aStart.mLine];
+		auto& lastLine = mLines[aEnd.mLine];
+
+		firstLine.Erase(start, firstLine.size());
+		lastLine.Erase(0, end);
+
+		if (aStart.mLine < aEnd.mLine)
+			firstLine.Insert(firstLine.size(), lastLine, 0, lastLine.size());
+		mLines.Resized(aStart.mLine);
+
+		if (aStart.mLine < aEnd.mLine)
+			RemoveLine(aStart.mLine + 1, aEnd.mLine + 1);
+	}
+
+	mTextChanged = true;
+}
+
+int TextEditor::InsertTextAt(Coordinates& /* inout */ aWhere, const char * aValue)
+{
+	assert(!IsReadOnly());
+	assert(!mLines.empty());
+
+	if (*aValue == '\0')
+		return 0;
+
+	// The first line of the text goes into the line at aWhere, the others are made aside and inserted
+	// at once. The end of the line at aWhere, if the text splits it, goes to the end of the last one.
+	int cindex = GetCharacterIndex(aWhere);
+	auto lineNo = aWhere.mLine;
+	auto& line = mLines[lineNo];
+	Line tail;
+	if (strchr(aValue, '\n') != nullptr)
+	{
+		tail.Insert(0, line, cindex, line.size());
+		line.Erase(cindex, line.size());
+	}
+
+	std::vector<Line> newLines;
+	std::vector<Char> chars;
+	auto flush = [&]()
+	{
+		if (newLines.empty())
+			line.Insert(cindex, chars.data(), chars.data() + chars.size());
+		else
+			newLines.back().Insert(newLines.back().size(), chars.data(), chars.data() + chars.size());
+		chars.clear();
+	};
+
+	while (*aValue != '\0')
+	{
+		if (*aValue == '\r')
+		{
+			// skip
+			++aValue;
+		}
+		else if (*aValue == '\n')
+		{
+			flush();
+			newLines.emplace_back();
+			++aWhere.mLine;
+			aWhere.mColumn = 0;
+			++aValue;
+		}
+		else
+		{
+			auto d = UTF8CharLength(*aValue);
+			while (d-- > 0 && *aValue != '\0')
+				chars.push_back(*aValue++);
+			++aWhere.mColumn;
+		}
+	}
+	flush();
+	mLines.Resized(lineNo);
+
+	int totalLines = (int)newLines.size();
+	if (totalLines > 0)
+	{
+		newLines.back().Insert(newLines.back().size(), tail, 0, tail.size());
+		InsertLines(lineNo + 1, std::move(newLines));
+	}
+
+	mTextChanged = true;
+
+	return totalLines;
+}
+
+void TextEditor::AddUndo(UndoRecord& aValue)
+{
+	assert(!IsReadOnly());
+	//printf("AddUndo: (@%d.%d) +\'%s' [%d.%d .. %d.%d], -\'%s', [%d.%d .. %d.%d] (@%d.%d)\n",
+	//	aValue.mBefore.mCursorPosition.mLine, aValue.mBefore.mCursorPosition.mColumn,
+	//	aValue.mAdded.c_str(), aValue.mAddedStart.mLine, aValue.mAddedStart.mColumn, aValue.mAddedEnd.mLine, aValue.mAddedEnd.mColumn,
+	//	aValue.mRemoved.c_str(), aValue.mRemovedStart.mLine, aValue.mRemovedStart.mColumn, aValue.mRemovedEnd.mLine, aValue.mRemovedEnd.mColumn,
+	//	aValue.mAfter.mCursorPosition.mLine, aValue.mAfter.mCursorPosition.mColumn
+	//	);
+
+	mUndoBuffer.resize((size_t)(mUndoIndex + 1));
+	mUndoBuffer.back() = aValue;
+	++mUndoIndex;
+}
+
+TextEditor::Coordinates TextEditor::ScreenPosToCoordinates(const ImVec2& aPosition) const
+{
+	ImVec2 origin = ImGui::GetCursorScreenPos();
+	ImVec2 local(aPosition.x - origin.x, aPosition.y - origin.y);
+
+	int lineNo = std::max(0, (int)floor(local.y / mCharAdvance.y));
+
+	int columnCoord = 0;
+
+	if (lineNo >= 0 && lineNo < (int)mLines.size())
+	{
+		auto& line = mLines[lineNo];
+		auto& advances = GetAdvances();
+
+		// the column whose middle is right of the position, counted from the last checkpoint left of it
+		auto columnAdvance = GetColumnAdvance(line);
+		if (columnAdvance != 0.0f)
+		{
+			const float x = local.x - mTextStart;
+			if (line.IsSimple(mTabSize))
+				return SanitizeCoordinates(Coordinates(lineNo, std::max(0, std::min(line.size(), (int)std::floor(x / columnAdvance + 0.5f)))));
+
+			int i = 0;
+			auto checkpoints = GetCheckpoints(line, false);
+			if (checkpoints != nullptr)
+			{
+				auto& checkpoint = FindCheckpoint(*checkpoints, [&](const Line::Checkpoint& aPoint) { return aPoint.mColumn * columnAdvance <= x; });
+				i = checkpoint.mIndex;
+				columnCoord = checkpoint.mColumn;
+			}
+			for (; i < line.size(); ++i)
+			{
+				int next = line[i] == '\t' ? (columnCoord / mTabSize) * mTabSize + mTabSize : columnCoord + 1;
+				if ((columnCoord + next) * 0.5f * columnAdvance > x)
+					break;
+				columnCoord = next;
+			}
+			return SanitizeCoordinates(Coordinates(lineNo, columnCoord));
+		}
+
+		int columnIndex = 0;
+		float columnX = 0.0f;
+
+		// the characters before the last checkpoint left of the position are left of it too
+		auto checkpoints = GetCheckpoints(line, true);
+		if (checkpoints != nullptr)
+		{
+			auto& checkpoint = FindCheckpoint(*checkpoints, [&](const Line::Checkpoint& aPoint) { return mTextStart + aPoint.mX <= local.x; });
+			columnIndex = checkpoint.mIndex;
+			columnX = checkpoint.mX;
+			columnCoord = checkpoint.mColumn;
+		}
+
+		while ((size_t)columnIndex < line.size())
+		{
+			float columnWidth = 0.0f;
+
+			if (line[columnIndex] == '\t')
+			{
+				float spaceSize = advances.Get(' ');
+				float oldX = columnX;
+				float newColumnX = (1.0f + std::floor((1.0f + columnX) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
+				columnWidth = newColumnX - oldX;
+				if (mTextStart + columnX + columnWidth * 0.5f > local.x)
+					break;
+				columnX = newColumnX;
+				columnCoord = (columnCoord / mTabSize) * mTabSize + mTabSize;
+				columnIndex++;
+			}
+			else
+			{
+				auto d = std::min(UTF8CharLength(line[columnIndex]), (int)line.size() - columnIndex);
+				columnWidth = advances.Get(line.data() + columnIndex, d);
+				if (mTextStart + columnX + columnWidth * 0.5f > local.x)
+					break;
+				columnIndex += d;
+				columnX += columnWidth;
+				columnCoord++;
+			}
+		}
+	}
+
+	return SanitizeCoordinates(Coordinates(lineNo, columnCoord));
+}
+
+TextEditor::Coordinates TextEditor::FindWordStart(const Coordinates & aFrom) const
+{
+	Coordinates at = aFrom;
+	if (at.mLine >= (int)mLines.size())
+		return at;
+
+	auto& line = mLines[at.mLine];
+	auto cindex = GetCharacterIndex(at);
+
+	if (cindex >= (int)line.size())
+		return at;
+
+	while (cindex > 0 && isspace(line[cindex]))
+		--cindex;
+
+	// the word doesn't go past the start of the spans of its color
+	int runStart = 0;
+	auto& spans = line.GetSpans();
+	auto span = line.FindSpan(cindex);
+	if (span >= 0)
+	{
+		while (span > 0 && spans[span - 1].mColorIndex == spans[span].mColorIndex)
+			--span;
+		runStart = spans[span].mStart;
+	}
+
+	while (cindex > 0)
+	{
+		auto c = line[cindex];
+		if ((c & 0xC0) != 0x80)	// not UTF code sequence 10xxxxxx
+		{
+			if (c <= 32 && isspace(c))
+			{
+				cindex++;
+				break;
+			}
+			if (cindex == runStart)
+				break;
+		}
+		--cindex;
+	}
+	return Coordinates(at.mLine, GetCharacterColumn(at.mLine, cindex));
+}
+
+TextEditor::Coordinates TextEditor::FindWordEnd(const Coordinates & aFrom) const
+{
+	Coordinates at = aFrom;
+	if (at.mLine >= (int)mLines.size())
+		return at;
+
+	auto& line = mLines[at.mLine];
+	auto cindex = GetCharacterIndex(at);
+
+	if (cindex >= (int)line.size())
+		return at;
+
+	// the word doesn't go past the end of the spans of its color
+	int runEnd = line.size();
+	auto& spans = line.GetSpans();
+	auto span = line.FindSpan(cindex);
+	if (span >= 0)
+	{
+		while (span + 1 < (int)spans.size() && spans[span + 1].mColorIndex == spans[span].mColorIndex)
+			++span;
+		runEnd = spans[span].mStart + spans[span].mLength;
+	}
+
+	bool prevspace = (bool)isspace(line[cindex]);
+	while (cindex < runEnd)
+	{
+		auto c = line[cindex];
+		auto d = UTF8CharLength(c);
+		if (prevspace != !!isspace(c))
+		{
+			if (isspace(c))
+				while (cindex < (int)line.size() && isspace(line[cindex]))
+					++cindex;
+			break;
+		}
+		cindex += d;
+	}
+	return Coordinates(aFrom.mLine, GetCharacterColumn(aFrom.mLine, cindex));
+}
+
+TextEditor::Coordinates TextEditor::FindNextWord(const Coordinates & aFrom) const
+{
+	Coordinates at = aFrom;
+	if (at.mLine >= (int)mLines.size())
+		return at;
+
+	// skip to the next non-word character
+	auto cindex = GetCharacterIndex(aFrom);
+	bool isword = false;
+	bool skip = false;
+	if (cindex < (int)mLines[at.mLine].size())
+	{
+		auto& line = mLines[at.mLine];
+		isword = isalnum(line[cindex]);
+		skip = isword;
+	}
+
+	while (!isword || skip)
+	{
+		if (at.mLine >= mLines.size())
+		{
+			auto l = std::max(0, (int) mLines.size() - 1);
+			return Coordinates(l, GetLineMaxColumn(l));
+		}
+
+		auto& line = mLines[at.mLine];
+		if (cindex < (int)line.size())
+		{
+			isword = isalnum(line[cindex]);
+
+			if (isword && !skip)
+				return Coordinates(at.mLine, GetCharacterColumn(at.mLine, cindex));
+
+			if (!isword)
+				skip = false;
+
+			cindex++;
+		}
+		else
+		{
+			cindex = 0;
+			++at.mLine;
+			skip = false;
+			isword = false;
+		}
+	}
+
+	return at;
+}
+
+int TextEditor::GetCharacterIndex(const Coordinates& aCoordinates) const
+{
+	if (aCoordinates.mLine >= mLines.size())
+		return -1;
+	auto& line = mLines[aCoordinates.mLine];
+	if (line.IsSimple(mTabSize))
+		return std::max(0, std::min(aCoordinates.mColumn, line.size()));
+
+	int c = 0;
+	int i = 0;
+	auto checkpoints = GetCheckpoints(line, false);
+	if (checkpoints != nullptr)
+	{
+		auto& checkpoint = FindCheckpoint(*checkpoints, [&](const Line::Checkpoint& aPoint) { return aPoint.mColumn < aCoordinates.mColumn; });
+		c = checkpoint.mColumn;
+		i = checkpoint.mIndex;
+	}
+	for (; i < line.size() && c < aCoordinates.mColumn;)
+	{
+		if (line[i] == '\t')
+			c = (c / mTabSize) * mTabSize + mTabSize;
+		else
+			++c;
+		i += UTF8CharLength(line[i]);
+	}
+	return i;
+}
+
+int TextEditor::GetCharacterColumn(int aLine, int aIndex) const
+{
+	if (aLine >= mLines.size())
+		return 0;
+	auto& line = mLines[aLine];
+	if (line.IsSimple(mTabSize))
+		return std::max(0, std::min(aIndex, line.size()));
+
+	int col = 0;
+	int i = 0;
+	auto checkpoints = GetCheckpoints(line, false);
+	if (checkpoints != nullptr)
+	{
+		auto& checkpoint = FindCheckpoint(*checkpoints, [&](const Line::Checkpoint& aPoint) { return aPoint.mIndex <= aIndex; });
+		col = checkpoint.mColumn;
+		i = checkpoint.mIndex;
+	}
+	while (i < aIndex && i < (int)line.size())
+	{
+		auto c = line[i];
+		i += UTF8CharLength(c);
+		if (c == '\t')
+			col = (col / mTabSize) * mTabSize + mTabSize;
+		else
+			col++;
+	}
+	return col;
+}
+
+int TextEditor::GetLineCharacterCount(int aLine) const
+{
+	if (aLine >= mLines.size())
+		return 0;
+	return mLines[aLine].GetCharacterCount(mTabSize);
+}
+
+int TextEditor::GetLineMaxColumn(int aLine) const
+{
+	if (aLine >= mLines.size())
+		return 0;
+	return mLines[aLine].GetMaxColumn(mTabSize);
+}
+
+bool TextEditor::IsOnWordBoundary(const Coordinates & aAt) const
+{
+	if (aAt.mLine >= (int)mLines.size() || aAt.mColumn == 0)
+		return true;
+
+	auto& line = mLines[aAt.mLine];
+	auto cindex = GetCharacterIndex(aAt);
+	if (cindex >= (int)line.size())
+		return true;
+
+	if (mColorizerEnabled)
+	{
+		// on the first character of a span, of another color than the one before
+		auto& spans = line.GetSpans();
+		auto span = line.FindSpan(cindex);
+		return span > 0 && spans[span].mStart == cindex && spans[span].mColorIndex != spans[span - 1].mColorIndex;
+	}
+
+	return isspace(line[cindex]) != isspace(line[cindex - 1]);
+}
+
+void TextEditor::RemoveLine(int aStart, int aEnd)
+{
+	assert(!IsReadOnly());
+	assert(aEnd >= aStart);
+	assert(mLines.size() > (size_t)(aEnd - aStart));
+
+	ErrorMarkers etmp;
+	for (auto& i : mErrorMarkers)
+	{
+		ErrorMarkers::value_type e(i.first >= aStart ? i.first - 1 : i.first, i.second);
+		if (e.first >= aStart && e.first <= aEnd)
+			continue;
+		etmp.insert(e);
+	}
+	mErrorMarkers = std::move(etmp);
+
+	Breakpoints btmp;
+	for (auto i : mBreakpoints)
+	{
+		if (i >= aStart && i <= aEnd)
+			continue;
+		btmp.insert(i >= aStart ? i - 1 : i);
+	}
+	mBreakpoints = std::move(btmp);
+
+	mLines.Erase(aStart, aEnd);
+	MoveColorRange(aStart, aStart - aEnd);
+	MoveDrawnRange(aStart, aStart - aEnd);
+	assert(!mLines.empty());
+
+	mTextChanged = true;
+}
+
+void TextEditor::RemoveLine(int aIndex)
+{
+	assert(!IsReadOnly());
+	assert(mLines.size() > 1);
+
+	ErrorMarkers etmp;
+	for (auto& i : mErrorMarkers)
+	{
+		ErrorMarkers::value_type e(i.first > aIndex ? i.first - 1 : i.first, i.second);
+		if (e.first - 1 == aIndex)
+			continue;
+		etmp.insert(e);
+	}
+	mErrorMarkers = std::move(etmp);
+
+	Breakpoints btmp;
+	for (auto i : mBreakpoints)
+	{
+		if (i == aIndex)
+			continue;
+		btmp.insert(i >= aIndex ? i - 1 : i);
+	}
+	mBreakpoints = std::move(btmp);
+
+	mLines.Erase(aIndex, aIndex + 1);
+	MoveColorRange(aIndex, -1);
+	MoveDrawnRange(aIndex, -1);
+	assert(!mLines.empty());
+
+	mTextChanged = true;
+}
+
+TextEditor::Line& TextEditor::InsertLine(int aIndex)
+{
+	assert(!IsReadOnly());
+
+	auto& result = mLines.Insert(aIndex);
+	MoveMarkers(aIndex, 1);
+	MoveColorRange(aIndex, 1);
+	MoveDrawnRange(aIndex, 1);
+
+	return result;
+}
+
+void TextEditor::InsertLines(int aIndex, std::vector<Line>&& aLines)
+{
+	assert(!IsReadOnly());
+
+	auto count = (int)aLines.size();
+	mLines.Insert(aIndex, std::move(aLines));
+	MoveMarkers(aIndex, count);
+	MoveColorRange(aIndex, count);
+	MoveDrawnRange(aIndex, count);
+}
+
+// Keeps the lines waiting to be colorized in the range when lines are inserted (aCount > 0) or removed (aCount < 0).
+void TextEditor::MoveColorRange(int aIndex, int aCount)
+{
+	// and the lines the colorizer thread has, a removed one is dropped
+	if (mColorizer)
+	{
+		std::lock_guard<std::mutex> lock(mColorizer->mMutex);
+		for (auto& i : mColorizer->mJob.mIndices)
+			i = i < aIndex ? i : i < aIndex - aCount ? -1 : i + aCount;
+	}
+
+	if (mColorRangeMin >= mColorRangeMax)
+		return;
+
+	auto move = [&](int aLine) { return aLine < aIndex ? aLine : std::max(aIndex, aLine + aCount); };
+	mColorRangeMin = move(mColorRangeMin);
+	mColorRangeMax = move(mColorRangeMax);
+}
+
+// Keeps the range of the lines drawn in the last frame on the same lines when lines are inserted or removed.
+void TextEditor::MoveDrawnRange(int aIndex, int aCount)
+{
+	auto move = [&](int aLine) { return aLine < aIndex ? aLine : std::max(aIndex, aLine + aCount); };
+	mDrawnLineMin = move(mDrawnLineMin);
+	mDrawnLineMax = move(mDrawnLineMax);
+}
+
+void TextEditor::MoveMarkers(int aIndex, int aCount)
+{
+	ErrorMarkers etmp;
+	for (auto& i : mErrorMarkers)
+		etmp.insert(ErrorMarkers::value_type(i.first >= aIndex ? i.first + aCount : i.first, i.second));
+	mErrorMarkers = std::move(etmp);
+
+	Breakpoints btmp;
+	for (auto i : mBreakpoints)
+		btmp.insert(i >= aIndex ? i + aCount : i);
+	mBreakpoints = std::move(btmp);
+}
+
+std::string TextEditor::GetWordUnderCursor() const
+{
+	auto c = GetCursorPosition();
+	return GetWordAt(c);
+}
+
+std::string TextEditor::GetWordAt(const Coordinates & aCoords) const
+{
+	auto start = FindWordStart(aCoords);
+	auto end = FindWordEnd(aCoords);
+
+	std::string r;
+
+	auto istart = GetCharacterIndex(start);
+	auto iend = GetCharacterIndex(end);
+
+	for (auto it = istart; it < iend; ++it)
+		r.push_back(mLines[aCoords.mLine][it]);
+
+	return r;
+}
+
+void TextEditor::HandleKeyboardInputs()
+{
+	ImGuiIO& io = ImGui::GetIO();
+	auto shift = io.KeyShift;
+	auto ctrl = io.ConfigMacOSXBehaviors ? io.KeySuper : io.KeyCtrl;
+	auto alt = io.ConfigMacOSXBehaviors ? io.KeyCtrl : io.KeyAlt;
+
+	if (ImGui::IsWindowFocused())
+	{
+		if (ImGui::IsWindowHovered())
+			ImGui::SetMouseCursor(ImGuiMouseCursor_TextInput);
+		//ImGui::CaptureKeyboardFromApp(true);
+
+		io.WantCaptureKeyboard = true;
+		io.WantTextInput = true;
+
+		if (!IsReadOnly() && ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Z)))
+			Undo();
+		else if (!IsReadOnly() && !ctrl && !shift && alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Backspace)))
+			Undo();
+		else if (!IsReadOnly() && ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Y)))
+			Redo();
+		else if (!ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_UpArrow)))
+			MoveUp(1, shift);
+		else if (!ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_DownArrow)))
+			MoveDown(1, shift);
+		else if (!alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_LeftArrow)))
+			MoveLeft(1, shift, ctrl);
+		else if (!alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_RightArrow)))
+			MoveRight(1, shift, ctrl);
+		else if (!alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_PageUp)))
+			MoveUp(GetPageSize() - 4, shift);
+		else if (!alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_PageDown)))
+			MoveDown(GetPageSize() - 4, shift);
+		else if (!alt && ctrl && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Home)))
+			MoveTop(shift);
+		else if (ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_End)))
+			MoveBottom(shift);
+		else if (!ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Home)))
+			MoveHome(shift);
+		else if (!ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_End)))
+			MoveEnd(shift);
+		else if (!IsReadOnly() && !ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Delete)))
+			Delete();
+		else if (!IsReadOnly() && !ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Backspace)))
+			Backspace();
+		else if (!ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Insert)))
+			mOverwrite ^= true;
+		else if (ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Insert)))
+			Copy();
+		else if (ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_C)))
+			Copy();
+		else if (!IsReadOnly() && !ctrl && shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Insert)))
+			Paste();
+		else if (!IsReadOnly() && ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_V)))
+			Paste();
+		else if (ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_X)))
+			Cut();
+		else if (!ctrl && shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Delete)))
+			Cut();
+		else if (ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_A)))
+			SelectAll();
+		else if (!IsReadOnly() && !ctrl && !shift && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Enter)))
+			EnterCharacter('\n', false);
+		else if (!IsReadOnly() && !ctrl && !alt && ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Tab)))
+			EnterCharacter('\t', shift);
+
+		if (!IsReadOnly() && !io.InputQueueCharacters.empty())
+		{
+			for (int i = 0; i < io.InputQueueCharacters.Size; i++)
+			{
+				auto c = io.InputQueueCharacters[i];
+				if (c != 0 && (c == '\n' || c >= 32))
+					EnterCharacter(c, shift);
+			}
+			io.InputQueueCharacters.resize(0);
+		}
+	}
+}
+
+void TextEditor::HandleMouseInputs()
+{
+	ImGuiIO& io = ImGui::GetIO();
+	auto shift = io.KeyShift;
+	auto ctrl = io.ConfigMacOSXBehaviors ? io.KeySuper : io.KeyCtrl;
+	auto alt = io.ConfigMacOSXBehaviors ? io.KeyCtrl : io.KeyAlt;
+
+	if (ImGui::IsWindowHovered())
+	{
+		if (!shift && !alt)
+		{
+			auto click = ImGui::IsMouseClicked(0);
+			auto doubleClick = ImGui::IsMouseDoubleClicked(0);
+			auto t = ImGui::GetTime();
+			auto tripleClick = click && !doubleClick && (mLastClick != -1.0f && (t - mLastClick) < io.MouseDoubleClickTime);
+
+			/*
+			Left mouse button triple click
+			*/
+
+			if (tripleClick)
+			{
+				if (!ctrl)
+				{
+					mState.mCursorPosition = mInteractiveStart = mInteractiveEnd = ScreenPosToCoordinates(ImGui::GetMousePos());
+					mSelectionMode = SelectionMode::Line;
+					SetSelection(mInteractiveStart, mInteractiveEnd, mSelectionMode);
+				}
+
+				mLastClick = -1.0f;
+			}
+
+			/*
+			Left mouse button double click
+			*/
+
+			else if (doubleClick)
+			{
+				if (!ctrl)
+				{
+					mState.mCursorPosition = mInteractiveStart = mInteractiveEnd = ScreenPosToCoordinates(ImGui::GetMousePos());
+					if (mSelectionMode == SelectionMode::Line)
+						mSelectionMode = SelectionMode::Normal;
+					else
+						mSelectionMode = SelectionMode::Word;
+					SetSelection(mInteractiveStart, mInteractiveEnd, mSelectionMode);
+				}
+
+				mLastClick = (float)ImGui::GetTime();
+			}
+
+			/*
+			Left mouse button click
+			*/
+			else if (click)
+			{
+				mState.mCursorPosition = mInteractiveStart = mInteractiveEnd = ScreenPosToCoordinates(ImGui::GetMousePos());
+				if (ctrl)
+					mSelectionMode = SelectionMode::Word;
+				else
+					mSelectionMode = SelectionMode::Normal;
+				SetSelection(mInteractiveStart, mInteractiveEnd, mSelectionMode);
+
+				mLastClick = (float)ImGui::GetTime();
+			}
+			// Mouse left button dragging (=> update selection)
+			else if (ImGui::IsMouseDragging(0) && ImGui::IsMouseDown(0))
+			{
+				io.WantCaptureMouse = true;
+				mState.mCursorPosition = mInteractiveEnd = ScreenPosToCoordinates(ImGui::GetMousePos());
+				SetSelection(mInteractiveStart, mInteractiveEnd, mSelectionMode);
+			}
+		}
+	}
+}
+
+// The number of characters of the lines out of view measured in a frame, see Render().
+static const int MeasuredBytes = 1 << 20;
+
+void TextEditor::Render()
+{
+	/* Compute mCharAdvance regarding to scaled font size (Ctrl + mouse wheel)*/
+	auto& advances = GetAdvances();
+	const float fontSize = advances.Get('#');
+	mCharAdvance = ImVec2(fontSize, ImGui::GetTextLineHeightWithSpacing() * mLineSpacing);
+
+	/* Update palette with the current alpha from style, only when it changed (or the palette did) */
+	if (ImGui::GetStyle().Alpha != mPaletteAlpha)
+	{
+		mPaletteAlpha = ImGui::GetStyle().Alpha;
+		for (int i = 0; i < (int)PaletteIndex::Max; ++i)
+		{
+			auto color = ImGui::ColorConvertU32ToFloat4(mPaletteBase[i]);
+			color.w *= mPaletteAlpha;
+			mPalette[i] = ImGui::ColorConvertFloat4ToU32(color);
+		}
+
+		/* The colors of the spans, the ones in preprocessor lines blended with the preprocessor color */
+		/* (all of them the default color while the colorizer is disabled) */
+		auto spanPalette = mSpanPalette;
+		const auto ppcolor = mPalette[(int)PaletteIndex::Preprocessor];
+		for (int i = 0; i < (int)PaletteIndex::Max; ++i)
+		{
+			const auto color = mPalette[mColorizerEnabled ? i : (int)PaletteIndex::Default];
+			const int c0 = ((ppcolor & 0xff) + (color & 0xff)) / 2;
+			const int c1 = (((ppcolor >> 8) & 0xff) + ((color >> 8) & 0xff)) / 2;
+			const int c2 = (((ppcolor >> 16) & 0xff) + ((color >> 16) & 0xff)) / 2;
+			const int c3 = (((ppcolor >> 24) & 0xff) + ((color >> 24) & 0xff)) / 2;
+			spanPalette[i] = color;
+			spanPalette[Line::PreprocessorColor + i] = mColorizerEnabled ? ImU32(c0 | (c1 << 8) | (c2 << 16) | (c3 << 24)) : color;
+		}
+		if (spanPalette != mSpanPalette)
+		{
+			mSpanPalette = spanPalette;
+			++mPaletteVersion;
+		}
+	}
+
+	auto contentSize = ImGui::GetWindowContentRegionMax();
+	auto drawList = ImGui::GetWindowDrawList();
+	if (mScrollToTop)
+	{
+		mScrollToTop = false;
+		ImGui::SetScrollY(0.f);
+	}
+
+	ImVec2 cursorScreenPos = ImGui::GetCursorScreenPos();
+	auto scrollX = ImGui::GetScrollX();
+	auto scrollY = ImGui::GetScrollY();
+
+	auto lineNo = (int)floor(scrollY / mCharAdvance.y);
+	auto globalLineMax = (int)mLines.size();
+	auto lineMax = std::max(0, std::min((int)mLines.size() - 1, lineNo + (int)floor((scrollY + contentSize.y) / mCharAdvance.y)));
+
+	// The lines which went out of view drop their text runs (the lines of a mapped file are dropped from its cache anyway)
+	if (!mLines.IsMapped())
+	{
+		for (int i = mDrawnLineMin; i < std::min(mDrawnLineMax, globalLineMax); ++i)
+		{
+			if (i < lineNo || i > lineMax)
+				mLines[i].SetTextRuns(nullptr);
+		}
+	}
+	mDrawnLineMin = lineNo;
+	mDrawnLineMax = lineMax + 1;
+
+	// The gutter and the widths of the lines are measured again when the font or the tab size changes
+	if (ImGui::GetFont() != mLayoutFont || ImGui::GetFontSize() != mLayoutFontSize || mTabSize != mLayoutTabSize || mMonospace != mLayoutMonospace)
+	{
+		mLayoutFont = ImGui::GetFont();
+		mLayoutFontSize = ImGui::GetFontSize();
+		mLayoutTabSize = mTabSize;
+		mLayoutMonospace = mMonospace;
+		mTextStartLines = -1;
+		mLines.ClearWidths();
+	}
+
+	// Deduce mTextStart by evaluating mLines size (global lineMax) plus two spaces as text width
+	char buf[16];
+	if (globalLineMax != mTextStartLines)
+	{
+		mTextStartLines = globalLineMax;
+		snprintf(buf, 16, " %d ", globalLineMax);
+		mTextStart = advances.GetWidth((const Char*)buf, (const Char*)buf + strlen(buf)) + mLeftMargin;
+	}
+
+	// The content is as wide as the widest line. The lines in view are measured right away, the others
+	// over the next frames, MeasuredBytes of them in each.
+	for (int i = lineNo; i <= lineMax && i < globalLineMax; ++i)
+	{
+		if (!mLines.HasWidth(i))
+			mLines.SetWidth(i, GetLineWidth(mLines[i]));
+	}
+	for (int measured = 0; measured < MeasuredBytes; )
+	{
+		auto i = mLines.NextUnmeasured();
+		if (i >= globalLineMax)
+			break;
+		auto& line = mLines[i];
+		mLines.SetWidth(i, GetLineWidth(line));
+		measured += line.size() + 1;
+	}
+	const float longest = mTextStart + mLines.GetMaxWidth();
+	mBlinking = false;
+
+	if (!mLines.empty())
+	{
+		float spaceSize = advances.Get(' ');
+
+		// the multiline comments of a mapped file are only followed within a line
+		if (mLines.IsMapped() && mColorizerEnabled)
+		{
+			for (int i = lineNo; i <= lineMax; ++i)
+			{
+				if (!mLines.IsColorized(i))
+				{
+					ColorizeComments(i, i + 1, i + 1);
+					ColorizeRange(i, i + 1);
+					mLines.SetColorized(i);
+				}
+			}
+		}
+
+		while (lineNo <= lineMax)
+		{
+			ImVec2 lineStartScreenPos = ImVec2(cursorScreenPos.x, cursorScreenPos.y + lineNo * mCharAdvance.y);
+			ImVec2 textScreenPos = ImVec2(lineStartScreenPos.x + mTextStart, lineStartScreenPos.y);
+
+			auto& line = mLines[lineNo];
+			Coordinates lineStartCoord(lineNo, 0);
+			Coordinates lineEndCoord(lineNo, GetLineMaxColumn(lineNo));
+
+			// Draw selection for the current line
+			float sstart = -1.0f;
+			float ssend = -1.0f;
+
+			assert(mState.mSelectionStart <= mState.mSelectionEnd);
 			if (mState.mSelectionStart <= lineEndCoord)
 				sstart = mState.mSelectionStart > lineStartCoord ? TextDistanceToLineStart(mState.mSelectionStart) : 0.0f;
 			if (mState.mSelectionEnd > lineStartCoord)
 				ssend = TextDistanceToLineStart(mState.mSelectionEnd < lineEndCoord ? mState.mSelectionEnd : lineEndCoord);
 
-			if (mState.mSelectionEnd.mLine > lineNo)
-				ssend += mCharAdvance.x;
+			if (mState.mSelectionEnd.mLine > lineNo)
+				ssend += mCharAdvance.x;
+
+			if (sstart != -1 && ssend != -1 && sstart < ssend)
+			{
+				ImVec2 vstart(lineStartScreenPos.x + mTextStart + sstart, lineStartScreenPos.y);
+				ImVec2 vend(lineStartScreenPos.x + mTextStart + ssend, lineStartScreenPos.y + mCharAdvance.y);
+				drawList->AddRectFilled(vstart, vend, mPalette[(int)PaletteIndex::Selection]);
+			}
+
+			// Draw breakpoints
+			auto start = ImVec2(lineStartScreenPos.x + scrollX, lineStartScreenPos.y);
+
+			if (mBreakpoints.count(lineNo + 1) != 0)
+			{
+				auto end = ImVec2(lineStartScreenPos.x + contentSize.x + 2.0f * scrollX, lineStartScreenPos.y + mCharAdvance.y);
+				drawList->AddRectFilled(start, end, mPalette[(int)PaletteIndex::Breakpoint]);
+			}
+
+			// Draw error markers
+			auto errorIt = mErrorMarkers.find(lineNo + 1);
+			if (errorIt != mErrorMarkers.end())
+			{
+				auto end = ImVec2(lineStartScreenPos.x + contentSize.x + 2.0f * scrollX, lineStartScreenPos.y + mCharAdvance.y);
+				drawList->AddRectFilled(start, end, mPalette[(int)PaletteIndex::ErrorMarker]);
+
+				if (ImGui::IsMouseHoveringRect(lineStartScreenPos, end))
+				{
+					ImGui::BeginTooltip();
+					ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.2f, 0.2f, 1.0f));
+					ImGui::Text("Error at line %d:", errorIt->first);
+					ImGui::PopStyleColor();
+					ImGui::Separator();
+					ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 1.0f, 0.2f, 1.0f));
+					ImGui::Text("%s", errorIt->second.c_str());
+					ImGui::PopStyleColor();
+					ImGui::EndTooltip();
+				}
+			}
+
+			// Draw line number (right aligned)
+			snprintf(buf, 16, "%d  ", lineNo + 1);
+
+			auto lineNoWidth = advances.GetWidth((const Char*)buf, (const Char*)buf + strlen(buf));
+			drawList->AddText(ImVec2(lineStartScreenPos.x + mTextStart - lineNoWidth, lineStartScreenPos.y), mPalette[(int)PaletteIndex::LineNumber], buf);
+
+			if (mState.mCursorPosition.mLine == lineNo)
+			{
+				auto focused = ImGui::IsWindowFocused();
+
+				// Highlight the current line (where the cursor is)
+				if (!HasSelection())
+				{
+					auto end = ImVec2(start.x + contentSize.x + scrollX, start.y + mCharAdvance.y);
+					drawList->AddRectFilled(start, end, mPalette[(int)(focused ? PaletteIndex::CurrentLineFill : PaletteIndex::CurrentLineFillInactive)]);
+					drawList->AddRect(start, end, mPalette[(int)PaletteIndex::CurrentLineEdge], 1.0f);
+				}
+
+				// Render the cursor, it blinks: hidden for 400 ms, then shown for 400 ms
+				if (focused)
+				{
+					auto time = ImGui::GetTime();
+					if (time - mStartTime >= 0.8)
+						mStartTime = time;
+					mBlinking = true;
+					if (time - mStartTime >= 0.4)
+					{
+						float width = 1.0f;
+						auto cindex = GetCharacterIndex(mState.mCursorPosition);
+						float cx = TextDistanceToLineStart(mState.mCursorPosition);
+
+						if (mOverwrite && cindex < (int)line.size())
+						{
+							auto c = line[cindex];
+							if (c == '\t')
+							{
+								auto x = (1.0f + std::floor((1.0f + cx) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
+								width = x - cx;
+							}
+							else
+								width = advances.Get(line.data() + cindex, std::min(UTF8CharLength(c), (int)line.size() - cindex));
+						}
+						ImVec2 cstart(textScreenPos.x + cx, lineStartScreenPos.y);
+						ImVec2 cend(textScreenPos.x + cx + width, lineStartScreenPos.y + mCharAdvance.y);
+						drawList->AddRectFilled(cstart, cend, mPalette[(int)PaletteIndex::Cursor]);
+					}
+				}
+			}
+
+			// Render colorized text, replaying the text runs of the line. A long line is laid out again in each
+			// frame, only the part between the checkpoints around the view (in a monospace font, an ASCII line
+			// is laid out by columns, without measuring the checkpoints).
+			auto lineText = (const char*)line.data();
+			const float columnAdvance = GetColumnAdvance(line);
+			auto runs = GetTextRuns(line, columnAdvance);
+			if (runs == nullptr)
+			{
+				int from = 0;
+				int to = line.size();
+				float x = 0.0f;
+				auto pointX = [&](const Line::Checkpoint& aPoint) { return columnAdvance != 0.0f ? aPoint.mColumn * columnAdvance : aPoint.mX; };
+				auto checkpoints = GetCheckpoints(line, columnAdvance == 0.0f);
+				if (checkpoints != nullptr)
+				{
+					auto& first = FindCheckpoint(*checkpoints, [&](const Line::Checkpoint& aPoint) { return mTextStart + pointX(aPoint) <= scrollX; });
+					from = first.mIndex;
+					x = pointX(first);
+
+					auto& last = FindCheckpoint(*checkpoints, [&](const Line::Checkpoint& aPoint) { return pointX(aPoint) <= scrollX + contentSize.x; });
+					if (&last + 1 != checkpoints->mPoints.data() + checkpoints->mPoints.size())
+						to = (&last + 1)->mIndex;
+				}
+
+				mTextRunBuffer.clear();
+				MakeTextRuns(line, from, to, x, columnAdvance, mTextRunBuffer);
+				runs = &mTextRunBuffer;
+			}
+
+			for (auto& run : *runs)
+			{
+				if (run.mStart < run.mEnd)
+				{
+					const ImVec2 newOffset(textScreenPos.x + run.mX, textScreenPos.y);
+					drawList->AddText(newOffset, run.mColor, lineText + run.mStart, lineText + run.mEnd);
+				}
+				else if (mShowWhitespaces)
+				{
+					const auto s = ImGui::GetFontSize();
+					const auto y = textScreenPos.y + s * 0.5f;
+					if (line[run.mStart] == '\t')
+					{
+						const auto x1 = textScreenPos.x + run.mX + 1.0f;
+						const auto x2 = textScreenPos.x + run.mEndX - 1.0f;
+						const ImVec2 p1(x1, y);
+						const ImVec2 p2(x2, y);
+						const ImVec2 p3(x2 - s * 0.2f, y - s * 0.2f);
+						const ImVec2 p4(x2 - s * 0.2f, y + s * 0.2f);
+						drawList->AddLine(p1, p2, 0x90909090);
+						drawList->AddLine(p2, p3, 0x90909090);
+						drawList->AddLine(p2, p4, 0x90909090);
+					}
+					else
+					{
+						const auto x = textScreenPos.x + run.mX + spaceSize * 0.5f;
+						drawList->AddCircleFilled(ImVec2(x, y), 1.5f, 0x80808080, 4);
+					}
+				}
+			}
+
+			++lineNo;
+		}
+
+		// Draw a tooltip on known identifiers/preprocessor symbols
+		if (ImGui::IsMousePosValid())
+		{
+			auto id = GetWordAt(ScreenPosToCoordinates(ImGui::GetMousePos()));
+			if (!id.empty())
+			{
+				auto it = mLanguageDefinition.mIdentifiers.find(id);
+				if (it != mLanguageDefinition.mIdentifiers.end())
+				{
+					ImGui::BeginTooltip();
+					ImGui::TextUnformatted(it->second.mDeclaration.c_str());
+					ImGui::EndTooltip();
+				}
+				else
+				{
+					auto pi = mLanguageDefinition.mPreprocIdentifiers.find(id);
+					if (pi != mLanguageDefinition.mPreprocIdentifiers.end())
+					{
+						ImGui::BeginTooltip();
+						ImGui::TextUnformatted(pi->second.mDeclaration.c_str());
+						ImGui::EndTooltip();
+					}
+				}
+			}
+		}
+	}
+
+
+	ImGui::Dummy(ImVec2((longest + 2), mLines.size() * mCharAdvance.y));
+
+	if (mScrollToCursor)
+	{
+		EnsureCursorVisible();
+		ImGui::SetWindowFocus();
+		mScrollToCursor = false;
+	}
+
+	mDrawnState = mState;
+	mRedrawNeeded = false;
+}
+
+void TextEditor::Render(const char* aTitle, const ImVec2& aSize, bool aBorder)
+{
+	mWithinRender = true;
+	mTextChanged = false;
+	mCursorPositionChanged = false;
+
+	auto loading = mLines.IsLoading();
+	mLines.Update();
+	if (loading && !mLines.IsLoading())
+		Colorize();
+
+	ImGui::PushStyleColor(ImGuiCol_ChildBg, ImGui::ColorConvertU32ToFloat4(mPalette[(int)PaletteIndex::Background]));
+	ImGui::PushStyleVar(ImGuiStyleVar_ItemSpacing, ImVec2(0.0f, 0.0f));
+	if (!mIgnoreImGuiChild)
+		ImGui::BeginChild(aTitle, aSize, aBorder, ImGuiWindowFlags_HorizontalScrollbar | ImGuiWindowFlags_AlwaysHorizontalScrollbar | ImGuiWindowFlags_NoMove);
+
+	if (mHandleKeyboardInputs)
+	{
+		HandleKeyboardInputs();
+		ImGui::PushAllowKeyboardFocus(true);
+	}
+
+	if (mHandleMouseInputs)
+		HandleMouseInputs();
+
+	ColorizeInternal();
+	Render();
+
+	if (mHandleKeyboardInputs)
+		ImGui::PopAllowKeyboardFocus();
+
+	if (!mIgnoreImGuiChild)
+		ImGui::EndChild();
+
+	ImGui::PopStyleVar();
+	ImGui::PopStyleColor();
+
+	mWithinRender = false;
+}
+
+bool TextEditor::IsRedrawNeeded() const
+{
+	// a change made while drawing the last frame (by the inputs) may need another one, to scroll to the cursor
+	return mRedrawNeeded || mTextChanged || mCursorPositionChanged || mScrollToCursor || mScrollToTop ||
+		mState.mCursorPosition != mDrawnState.mCursorPosition ||
+		mState.mSelectionStart != mDrawnState.mSelectionStart ||
+		mState.mSelectionEnd != mDrawnState.mSelectionEnd;
+}
+
+double TextEditor::GetNextRedrawTime() const
+{
+	auto time = ImGui::GetTime();
+	if (IsRedrawNeeded() || mLines.IsLoading() || mLines.IsIndexing())
+		return time;
+
+	// the lines out of view are measured over the next frames, for the content width (see Render())
+	if (!mLines.IsMapped() && mLines.NextUnmeasured() < (int)mLines.size())
+		return time;
+
+	// the colorizer goes on in the next frames (a mapped file is colorized as it is drawn)
+	if (mColorizerEnabled && !mLines.IsMapped())
+	{
+		if (mCommentRangeMin != std::numeric_limits<int>::max() || mColorRangeMin < std::min(mColorRangeMax, (int)mLines.size()))
+			return time;
+		if (mColorizer && mColorizer->mBusy)
+			return time;
+	}
+
+	if (mBlinking)
+		return mStartTime + (time - mStartTime < 0.4 ? 0.4 : 0.8);
+	return std::numeric_limits<double>::infinity();
+}
+
+void TextEditor::SetText(const std::string & aText)
+{
+	SetText(std::string(aText));
+}
+
+void TextEditor::SetText(std::string && aText)
+{
+	auto text = std::make_shared<std::string>(std::move(aText));
+	LoadText((const Char*)text->data(), text->size(), text);
+}
+
+#ifdef TEXTEDITOR_STRING_VIEW
+void TextEditor::SetTextView(std::string_view aText)
+{
+	LoadText((const Char*)aText.data(), aText.size(), nullptr);
+}
+#endif
+
+void TextEditor::LoadText(const Char* aText, size_t aSize, std::shared_ptr<const void> aOwner)
+{
+	if (mColorizer)
+		mColorizer->Cancel();
+	mLines.clear();
+	mLoadedText = std::move(aOwner);
+
+	auto end = aText + aSize;
+	mLines.reserve(CountNewLines(aText, end) + 1);
+
+	// carriage returns are rare, so the lines only have to be checked for them if the text has any
+	auto carriageReturns = aSize > 0 && memchr(aText, '\r', aSize) != nullptr;
+	auto begin = aText;
+	auto addLine = [&](const Char* aLineEnd)
+	{
+		if (carriageReturns)
+			mLines.push_back(MakeLoadedLine(begin, aLineEnd));
+		else
+			mLines.emplace_back(begin, (int)(aLineEnd - begin));
+		begin = aLineEnd + 1;
+	};
+	ForEachNewLine(aText, end, addLine);
+	addLine(end);
+
+	mTextChanged = true;
+	mScrollToTop = true;
+
+	mUndoBuffer.clear();
+	mUndoIndex = 0;
+
+	Colorize();
+}
+
+void TextEditor::SetTextAsync(std::string && aText)
+{
+	auto text = std::make_shared<std::string>(std::move(aText));
+
+	if (mColorizer)
+		mColorizer->Cancel();
+	mLines.clear();
+	mLoadedText = text;
+	mLines.Load((const Char*)text->data(), text->size(), text);
+
+	mTextChanged = true;
+	mScrollToTop = true;
+
+	mUndoBuffer.clear();
+	mUndoIndex = 0;
+
+	Colorize();
+}
+
+void TextEditor::CancelLoading()
+{
+	if (!mLines.IsLoading())
+		return;
+
+	mLines.CancelLoad();
+	Colorize();
+}
+
+bool TextEditor::OpenMapped(const char* aPath)
+{
+	if (mColorizer)
+		mColorizer->Cancel();
+	if (!mLines.Map(aPath))
+		return false;
+
+	mLoadedText.reset();
+
+	mTextChanged = true;
+	mScrollToTop = true;
+
+	mUndoBuffer.clear();
+	mUndoIndex = 0;
+
+	Colorize();
+	return true;
+}
+
+void TextEditor::SetTextLines(const std::vector<std::string> & aLines)
+{
+	if (mColorizer)
+		mColorizer->Cancel();
+	mLines.clear();
+	mLoadedText.reset();
+
+	if (aLines.empty())
+	{
+		mLines.push_back(Line());
+	}
+	else
+	{
+		auto text = std::make_shared<std::string>();
+		size_t size = 0;
+		for (auto& line : aLines)
+			size += line.size();
+		text->reserve(size);
+		for (auto& line : aLines)
+			text->append(line);
+		mLoadedText = text;
+
+		mLines.reserve(aLines.size());
+		auto piece = (const Char*)text->data();
+		for (auto& line : aLines)
+		{
+			mLines.emplace_back(piece, (int)line.size());
+			piece += line.size();
+		}
+	}
+
+	mTextChanged = true;
+	mScrollToTop = true;
+
+	mUndoBuffer.clear();
+	mUndoIndex = 0;
+
+	Colorize();
+}
+
+void TextEditor::SetTextLines(std::vector<std::string> && aLines)
+{
+	if (aLines.empty())
+	{
+		SetTextLines(aLines);
+		return;
+	}
+
+	if (mColorizer)
+		mColorizer->Cancel();
+	mLines.clear();
+
+	// the lines are pieces of the strings they are moved into
+	auto lines = std::make_shared<std::vector<std::string>>(std::move(aLines));
+	mLoadedText = lines;
+
+	mLines.reserve(lines->size());
+	for (auto& line : *lines)
+		mLines.emplace_back((const Char*)line.data(), (int)line.size());
+
+	mTextChanged = true;
+	mScrollToTop = true;
+
+	mUndoBuffer.clear();
+	mUndoIndex = 0;
+
+	Colorize();
+}
+
+void TextEditor::EnterCharacter(ImWchar aChar, bool aShift)
+{
+	assert(!IsReadOnly());
+
+	UndoRecord u;
+
+	u.mBefore = mState;
+
+	if (HasSelection())
+	{
+		if (aChar == '\t' && mState.mSelectionStart.mLine != mState.mSelectionEnd.mLine)
+		{
+
+			auto start = mState.mSelectionStart;
+			auto end = mState.mSelectionEnd;
+			auto originalEnd = end;
+
+			if (start > end)
+				std::swap(start, end);
+			start.mColumn = 0;
+			//			end.mColumn = end.mLine < mLines.size() ? mLines[end.mLine].size() : 0;
+			if (end.mColumn == 0 && end.mLine > 0)
+				--end.mLine;
+			if (end.mLine >= (int)mLines.size())
+				end.mLine = mLines.empty() ? 0 : (int)mLines.size() - 1;
+			end.mColumn = GetLineMaxColumn(end.mLine);
+
+			//if (end.mColumn >= GetLineMaxColumn(end.mLine))
+			//	end.mColumn = GetLineMaxColumn(end.mLine) - 1;
+
+			u.mRemovedStart = start;
+			u.mRemovedEnd = end;
+			u.mRemoved = GetText(start, end);
+
+			bool modified = false;
+
+			for (int i = start.mLine; i <= end.mLine; i++)
+			{
+				auto& line = mLines[i];
+				if (aShift)
+				{
+					if (!line.empty())
+					{
+						if (line[0] == '\t')
+						{
+							line.Erase(0, 1);
+							modified = true;
+						}
+						else
+						{
+							for (int j = 0; j < mTabSize && !line.empty() && line[0] == ' '; j++)
+							{
+								line.Erase(0, 1);
+								modified = true;
+							}
+						}
+					}
+				}
+				else
+				{
+					line.Insert(0, '\t');
+					modified = true;
+				}
+				mLines.Resized(i);
+			}
+
+			if (modified)
+			{
+				start = Coordinates(start.mLine, GetCharacterColumn(start.mLine, 0));
+				Coordinates rangeEnd;
+				if (originalEnd.mColumn != 0)
+				{
+					end = Coordinates(end.mLine, GetLineMaxColumn(end.mLine));
+					rangeEnd = end;
+					u.mAdded = GetText(start, end);
+				}
+				else
+				{
+					end = Coordinates(originalEnd.mLine, 0);
+					rangeEnd = Coordinates(end.mLine - 1, GetLineMaxColumn(end.mLine - 1));
+					u.mAdded = GetText(start, rangeEnd);
+				}
+
+				u.mAddedStart = start;
+				u.mAddedEnd = rangeEnd;
+				u.mAfter = mState;
+
+				mState.mSelectionStart = start;
+				mState.mSelectionEnd = end;
+				AddUndo(u);
+
+				mTextChanged = true;
+
+				EnsureCursorVisible();
+			}
+
+			return;
+		} // c == '\t'
+		else
+		{
+			u.mRemoved = GetSelectedText();
+			u.mRemovedStart = mState.mSelectionStart;
+			u.mRemovedEnd = mState.mSelectionEnd;
+			DeleteSelection();
+		}
+	} // HasSelection
+
+	auto coord = GetActualCursorCoordinates();
+	u.mAddedStart = coord;
+
+	assert(!mLines.empty());
+
+	if (aChar == '\n')
+	{
+		InsertLine(coord.mLine + 1);
+		auto& line = mLines[coord.mLine];
+		auto& newLine = mLines[coord.mLine + 1];
+
+		if (mLanguageDefinition.mAutoIndentation)
+			for (size_t it = 0; it < line.size() && isascii(line[it]) && isblank(line[it]); ++it)
+				newLine.Insert(newLine.size(), line, (int)it, (int)it + 1);
+
+		const size_t whitespaceSize = newLine.size();
+		auto cindex = GetCharacterIndex(coord);
+		newLine.Insert(newLine.size(), line, cindex, line.size());
+		line.Erase(cindex, line.size());
+		mLines.Resized(coord.mLine);
+		mLines.Resized(coord.mLine + 1);
+		SetCursorPosition(Coordinates(coord.mLine + 1, GetCharacterColumn(coord.mLine + 1, (int)whitespaceSize)));
+		u.mAdded = (char)aChar;
+	}
+	else
+	{
+		char buf[7];
+		int e = ImTextCharToUtf8(buf, 7, aChar);
+		if (e > 0)
+		{
+			buf[e] = '\0';
+			auto& line = mLines[coord.mLine];
+			auto cindex = GetCharacterIndex(coord);
+
+			if (mOverwrite && cindex < (int)line.size())
+			{
+				auto d = UTF8CharLength(line[cindex]);
+
+				u.mRemovedStart = mState.mCursorPosition;
+				u.mRemovedEnd = Coordinates(coord.mLine, GetCharacterColumn(coord.mLine, cindex + d));
+
+				while (d-- > 0 && cindex < (int)line.size())
+				{
+					u.mRemoved += line[cindex];
+					line.Erase(cindex, cindex + 1);
+				}
+			}
+
+			for (auto p = buf; *p != '\0'; p++, ++cindex)
+				line.Insert(cindex, *p);
+			mLines.Resized(coord.mLine);
+			u.mAdded = buf;
+
+			SetCursorPosition(Coordinates(coord.mLine, GetCharacterColumn(coord.mLine, cindex)));
+		}
+		else
+			return;
+	}
+
+	mTextChanged = true;
+
+	u.mAddedEnd = GetActualCursorCoordinates();
+	u.mAfter = mState;
+
+	AddUndo(u);
+
+	Colorize(coord.mLine - 1, 3);
+	EnsureCursorVisible();
+}
+
+void TextEditor::SetReadOnly(bool aValue)
+{
+	mReadOnly = aValue;
+}
+
+void TextEditor::SetColorizerThreaded(bool aValue)
+{
+	// the lines of a job in progress are left to be colorized again
+	if (aValue != (mColorizer != nullptr))
+		mColorizer = aValue ? std::make_shared<Colorizer>() : nullptr;
+}
+
+void TextEditor::SetTokenCache(std::shared_ptr<TokenCache> aValue)
+{
+	mTokenCache = std::move(aValue);
+	if (mColorizer)
+		mColorizer->mLanguage.reset();
+}
+
+void TextEditor::SetColorizerEnable(bool aValue)
+{
+	// the colors of the spans are made again, see Render()
+	mColorizerEnabled = aValue;
+	mPaletteAlpha = -1.0f;
+	mRedrawNeeded = true;
+}
+
+void TextEditor::SetCursorPosition(const Coordinates & aPosition)
+{
+	if (mState.mCursorPosition != aPosition)
+	{
+		mState.mCursorPosition = aPosition;
+		mCursorPositionChanged = true;
+		EnsureCursorVisible();
+	}
+}
+
+void TextEditor::SetSelectionStart(const Coordinates & aPosition)
+{
+	mState.mSelectionStart = SanitizeCoordinates(aPosition);
+	if (mState.mSelectionStart > mState.mSelectionEnd)
+		std::swap(mState.mSelectionStart, mState.mSelectionEnd);
+}
+
+void TextEditor::SetSelectionEnd(const Coordinates & aPosition)
+{
+	mState.mSelectionEnd = SanitizeCoordinates(aPosition);
+	if (mState.mSelectionStart > mState.mSelectionEnd)
+		std::swap(mState.mSelectionStart, mState.mSelectionEnd);
+}
+
+void TextEditor::SetSelection(const Coordinates & aStart, const Coordinates & aEnd, SelectionMode aMode)
+{
+	auto oldSelStart = mState.mSelectionStart;
+	auto oldSelEnd = mState.mSelectionEnd;
+
+	mState.mSelectionStart = SanitizeCoordinates(aStart);
+	mState.mSelectionEnd = SanitizeCoordinates(aEnd);
+	if (mState.mSelectionStart > mState.mSelectionEnd)
+		std::swap(mState.mSelectionStart, mState.mSelectionEnd);
+
+	switch (aMode)
+	{
+	case TextEditor::SelectionMode::Normal:
+		break;
+	case TextEditor::SelectionMode::Word:
+	{
+		mState.mSelectionStart = FindWordStart(mState.mSelectionStart);
+		if (!IsOnWordBoundary(mState.mSelectionEnd))
+			mState.mSelectionEnd = FindWordEnd(FindWordStart(mState.mSelectionEnd));
+		break;
+	}
+	case TextEditor::SelectionMode::Line:
+	{
+		const auto lineNo = mState.mSelectionEnd.mLine;
+		const auto lineSize = (size_t)lineNo < mLines.size() ? mLines[lineNo].size() : 0;
+		mState.mSelectionStart = Coordinates(mState.mSelectionStart.mLine, 0);
+		mState.mSelectionEnd = Coordinates(lineNo, GetLineMaxColumn(lineNo));
+		break;
+	}
+	default:
+		break;
+	}
+
+	if (mState.mSelectionStart != oldSelStart ||
+		mState.mSelectionEnd != oldSelEnd)
+		mCursorPositionChanged = true;
+}
+
+void TextEditor::SetTabSize(int aValue)
+{
+	mTabSize = std::max(0, std::min(32, aValue));
+	mRedrawNeeded = true;
+}
+
+void TextEditor::InsertText(const std::string & aValue)
+{
+	InsertText(aValue.c_str());
+}
+
+void TextEditor::InsertText(const char * aValue)
+{
+	if (aValue == nullptr)
+		return;
+
+	auto pos = GetActualCursorCoordinates();
+	auto start = std::min(pos, mState.mSelectionStart);
+	int totalLines = pos.mLine - start.mLine;
+
+	totalLines += InsertTextAt(pos, aValue);
+
+	SetSelection(pos, pos);
+	SetCursorPosition(pos);
+	Colorize(start.mLine - 1, totalLines + 2);
+}
+
+void TextEditor::DeleteSelection()
+{
+	assert(mState.mSelectionEnd >= mState.mSelectionStart);
+
+	if (mState.mSelectionEnd == mState.mSelectionStart)
+		return;
+
+	DeleteRange(mState.mSelectionStart, mState.mSelectionEnd);
+
+	SetSelection(mState.mSelectionStart, mState.mSelectionStart);
+	SetCursorPosition(mState.mSelectionStart);
+	Colorize(mState.mSelectionStart.mLine, 1);
+}
+
+void TextEditor::MoveUp(int aAmount, bool aSelect)
+{
+	auto oldPos = mState.mCursorPosition;
+	mState.mCursorPosition.mLine = std::max(0, mState.mCursorPosition.mLine - aAmount);
+	if (oldPos != mState.mCursorPosition)
+	{
+		if (aSelect)
+		{
+			if (oldPos == mInteractiveStart)
+				mInteractiveStart = mState.mCursorPosition;
+			else if (oldPos == mInteractiveEnd)
+				mInteractiveEnd = mState.mCursorPosition;
+			else
+			{
+				mInteractiveStart = mState.mCursorPosition;
+				mInteractiveEnd = oldPos;
+			}
+		}
+		else
+			mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
+		SetSelection(mInteractiveStart, mInteractiveEnd);
+
+		EnsureCursorVisible();
+	}
+}
+
+void TextEditor::MoveDown(int aAmount, bool aSelect)
+{
+	assert(mState.mCursorPosition.mColumn >= 0);
+	auto oldPos = mState.mCursorPosition;
+	mState.mCursorPosition.mLine = std::max(0, std::min((int)mLines.size() - 1, mState.mCursorPosition.mLine + aAmount));
+
+	if (mState.mCursorPosition != oldPos)
+	{
+		if (aSelect)
+		{
+			if (oldPos == mInteractiveEnd)
+				mInteractiveEnd = mState.mCursorPosition;
+			else if (oldPos == mInteractiveStart)
+				mInteractiveStart = mState.mCursorPosition;
+			else
+			{
+				mInteractiveStart = oldPos;
+				mInteractiveEnd = mState.mCursorPosition;
+			}
+		}
+		else
+			mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
+		SetSelection(mInteractiveStart, mInteractiveEnd);
+
+		EnsureCursorVisible();
+	}
+}
+
+static bool IsUTFSequence(char c)
+{
+	return (c & 0xC0) == 0x80;
+}
+
+void TextEditor::MoveLeft(int aAmount, bool aSelect, bool aWordMode)
+{
+	if (mLines.empty())
+		return;
+
+	auto oldPos = mState.mCursorPosition;
+	mState.mCursorPosition = GetActualCursorCoordinates();
+	auto line = mState.mCursorPosition.mLine;
+	auto cindex = GetCharacterIndex(mState.mCursorPosition);
+
+	while (aAmount-- > 0)
+	{
+		if (cindex == 0)
+		{
+			if (line > 0)
+			{
+				--line;
+				if ((int)mLines.size() > line)
+					cindex = (int)mLines[line].size();
+				else
+					cindex = 0;
+			}
+		}
+		else
+		{
+			--cindex;
+			if (cindex > 0)
+			{
+				if ((int)mLines.size() > line)
+				{
+					while (cindex > 0 && IsUTFSequence(mLines[line][cindex]))
+						--cindex;
+				}
+			}
+		}
+
+		mState.mCursorPosition = Coordinates(line, GetCharacterColumn(line, cindex));
+		if (aWordMode)
+		{
+			mState.mCursorPosition = FindWordStart(mState.mCursorPosition);
+			cindex = GetCharacterIndex(mState.mCursorPosition);
+		}
+	}
+
+	mState.mCursorPosition = Coordinates(line, GetCharacterColumn(line, cindex));
+
+	assert(mState.mCursorPosition.mColumn >= 0);
+	if (aSelect)
+	{
+		if (oldPos == mInteractiveStart)
+			mInteractiveStart = mState.mCursorPosition;
+		else if (oldPos == mInteractiveEnd)
+			mInteractiveEnd = mState.mCursorPosition;
+		else
+		{
+			mInteractiveStart = mState.mCursorPosition;
+			mInteractiveEnd = oldPos;
+		}
+	}
+	else
+		mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
+	SetSelection(mInteractiveStart, mInteractiveEnd, aSelect && aWordMode ? SelectionMode::Word : SelectionMode::Normal);
+
+	EnsureCursorVisible();
+}
+
+void TextEditor::MoveRight(int aAmount, bool aSelect, bool aWordMode)
+{
+	auto oldPos = mState.mCursorPosition;
+
+	if (mLines.empty() || oldPos.mLine >= mLines.size())
+		return;
+
+	auto cindex = GetCharacterIndex(mState.mCursorPosition);
+	while (aAmount-- > 0)
+	{
+		auto lindex = mState.mCursorPosition.mLine;
+		auto& line = mLines[lindex];
+
+		if (cindex >= line.size())
+		{
+			if (mState.mCursorPosition.mLine < mLines.size() - 1)
+			{
+				mState.mCursorPosition.mLine = std::max(0, std::min((int)mLines.size() - 1, mState.mCursorPosition.mLine + 1));
+				mState.mCursorPosition.mColumn = 0;
+			}
+			else
+				return;
+		}
+		else
+		{
+			cindex += UTF8CharLength(line[cindex]);
+			mState.mCursorPosition = Coordinates(lindex, GetCharacterColumn(lindex, cindex));
+			if (aWordMode)
+				mState.mCursorPosition = FindNextWord(mState.mCursorPosition);
+		}
+	}
+
+	if (aSelect)
+	{
+		if (oldPos == mInteractiveEnd)
+			mInteractiveEnd = SanitizeCoordinates(mState.mCursorPosition);
+		else if (oldPos == mInteractiveStart)
+			mInteractiveStart = mState.mCursorPosition;
+		else
+		{
+			mInteractiveStart = oldPos;
+			mInteractiveEnd = mState.mCursorPosition;
+		}
+	}
+	else
+		mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
+	SetSelection(mInteractiveStart, mInteractiveEnd, aSelect && aWordMode ? SelectionMode::Word : SelectionMode::Normal);
+
+	EnsureCursorVisible();
+}
+
+void TextEditor::MoveTop(bool aSelect)
+{
+	auto oldPos = mState.mCursorPosition;
+	SetCursorPosition(Coordinates(0, 0));
+
+	if (mState.mCursorPosition != oldPos)
+	{
+		if (aSelect)
+		{
+			mInteractiveEnd = oldPos;
+			mInteractiveStart = mState.mCursorPosition;
+		}
+		else
+			mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
+		SetSelection(mInteractiveStart, mInteractiveEnd);
+	}
+}
+
+void TextEditor::TextEditor::MoveBottom(bool aSelect)
+{
+	auto oldPos = GetCursorPosition();
+	auto newPos = Coordinates((int)mLines.size() - 1, 0);
+	SetCursorPosition(newPos);
+	if (aSelect)
+	{
+		mInteractiveStart = oldPos;
+		mInteractiveEnd = newPos;
+	}
+	else
+		mInteractiveStart = mInteractiveEnd = newPos;
+	SetSelection(mInteractiveStart, mInteractiveEnd);
+}
+
+void TextEditor::MoveHome(bool aSelect)
+{
+	auto oldPos = mState.mCursorPosition;
+	SetCursorPosition(Coordinates(mState.mCursorPosition.mLine, 0));
+
+	if (mState.mCursorPosition != oldPos)
+	{
+		if (aSelect)
+		{
+			if (oldPos == mInteractiveStart)
+				mInteractiveStart = mState.mCursorPosition;
+			else if (oldPos == mInteractiveEnd)
+				mInteractiveEnd = mState.mCursorPosition;
+			else
+			{
+				mInteractiveStart = mState.mCursorPosition;
+				mInteractiveEnd = oldPos;
+			}
+		}
+		else
+			mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
+		SetSelection(mInteractiveStart, mInteractiveEnd);
+	}
+}
+
+void TextEditor::MoveEnd(bool aSelect)
+{
+	auto oldPos = mState.mCursorPosition;
+	SetCursorPosition(Coordinates(mState.mCursorPosition.mLine, GetLineMaxColumn(oldPos.mLine)));
+
+	if (mState.mCursorPosition != oldPos)
+	{
+		if (aSelect)
+		{
+			if (oldPos == mInteractiveEnd)
+				mInteractiveEnd = mState.mCursorPosition;
+			else if (oldPos == mInteractiveStart)
+				mInteractiveStart = mState.mCursorPosition;
+			else
+			{
+				mInteractiveStart = oldPos;
+				mInteractiveEnd = mState.mCursorPosition;
+			}
+		}
+		else
+			mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
+		SetSelection(mInteractiveStart, mInteractiveEnd);
+	}
+}
+
+void TextEditor::Delete()
+{
+	assert(!IsReadOnly());
 
-			if (sstart != -1 && ssend != -1 && sstart < ssend)
-			{
-				ImVec2 vstart(lineStartScreenPos.x + mTextStart + sstart, lineStartScreenPos.y);
-				ImVec2 vend(lineStartScreenPos.x + mTextStart + ssend, lineStartScreenPos.y + mCharAdvance.y);
-				drawList->AddRectFilled(vstart, vend, mPalette[(int)PaletteIndex::Selection]);
-			}
+	if (mLines.empty())
+		return;
 
-			// Draw breakpoints
-			auto start = ImVec2(lineStartScreenPos.x + scrollX, lineStartScreenPos.y);
+	UndoRecord u;
+	u.mBefore = mState;
 
-			if (mBreakpoints.count(lineNo + 1) != 0)
-			{
-				auto end = ImVec2(lineStartScreenPos.x + contentSize.x + 2.0f * scrollX, lineStartScreenPos.y + mCharAdvance.y);
-				drawList->AddRectFilled(start, end, mPalette[(int)PaletteIndex::Breakpoint]);
-			}
+	if (HasSelection())
+	{
+		u.mRemoved = GetSelectedText();
+		u.mRemovedStart = mState.mSelectionStart;
+		u.mRemovedEnd = mState.mSelectionEnd;
 
-			// Draw error markers
-			auto errorIt = mErrorMarkers.find(lineNo + 1);
-			if (errorIt != mErrorMarkers.end())
-			{
-				auto end = ImVec2(lineStartScreenPos.x + contentSize.x + 2.0f * scrollX, lineStartScreenPos.y + mCharAdvance.y);
-				drawList->AddRectFilled(start, end, mPalette[(int)PaletteIndex::ErrorMarker]);
+		DeleteSelection();
+	}
+	else
+	{
+		auto pos = GetActualCursorCoordinates();
+		SetCursorPosition(pos);
+		auto& line = mLines[pos.mLine];
 
-				if (ImGui::IsMouseHoveringRect(lineStartScreenPos, end))
-				{
-					ImGui::BeginTooltip();
-					ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.2f, 0.2f, 1.0f));
-					ImGui::Text("Error at line %d:", errorIt->first);
-					ImGui::PopStyleColor();
-					ImGui::Separator();
-					ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 1.0f, 0.2f, 1.0f));
-					ImGui::Text("%s", errorIt->second.c_str());
-					ImGui::PopStyleColor();
-					ImGui::EndTooltip();
-				}
-			}
+		if (pos.mColumn == GetLineMaxColumn(pos.mLine))
+		{
+			if (pos.mLine == (int)mLines.size() - 1)
+				return;
 
-			// Draw line number (right aligned)
-			snprintf(buf, 16, "%d  ", lineNo + 1);
+			u.mRemoved = '\n';
+			u.mRemovedStart = u.mRemovedEnd = GetActualCursorCoordinates();
+			Advance(u.mRemovedEnd);
 
-			auto lineNoWidth = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, buf, nullptr, nullptr).x;
-			drawList->AddText(ImVec2(lineStartScreenPos.x + mTextStart - lineNoWidth, lineStartScreenPos.y), mPalette[(int)PaletteIndex::LineNumber], buf);
+			auto& nextLine = mLines[pos.mLine + 1];
+			line.Insert(line.size(), nextLine, 0, nextLine.size());
+			mLines.Resized(pos.mLine);
+			RemoveLine(pos.mLine + 1);
+		}
+		else
+		{
+			auto cindex = GetCharacterIndex(pos);
+			u.mRemovedStart = u.mRemovedEnd = GetActualCursorCoordinates();
+			u.mRemovedEnd.mColumn++;
+			u.mRemoved = GetText(u.mRemovedStart, u.mRemovedEnd);
 
-			if (mState.mCursorPosition.mLine == lineNo)
-			{
-				auto focused = ImGui::IsWindowFocused();
+			auto d = UTF8CharLength(line[cindex]);
+			while (d-- > 0 && cindex < (int)line.size())
+				line.Erase(cindex, cindex + 1);
+			mLines.Resized(pos.mLine);
+		}
 
-				// Highlight the current line (where the cursor is)
-				if (!HasSelection())
-				{
-					auto end = ImVec2(start.x + contentSize.x + scrollX, start.y + mCharAdvance.y);
-					drawList->AddRectFilled(start, end, mPalette[(int)(focused ? PaletteIndex::CurrentLineFill : PaletteIndex::CurrentLineFillInactive)]);
-					drawList->AddRect(start, end, mPalette[(int)PaletteIndex::CurrentLineEdge], 1.0f);
-				}
+		mTextChanged = true;
 
-				// Render the cursor
-				if (focused)
-				{
-					auto timeEnd = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-					auto elapsed = timeEnd - mStartTime;
-					if (elapsed > 400)
-					{
-						float width = 1.0f;
-						auto cindex = GetCharacterIndex(mState.mCursorPosition);
-						float cx = TextDistanceToLineStart(mState.mCursorPosition);
+		Colorize(pos.mLine, 1);
+	}
 
-						if (mOverwrite && cindex < (int)line.size())
-						{
-							auto c = line[cindex].mChar;
-							if (c == '\t')
-							{
-								auto x = (1.0f + std::floor((1.0f + cx) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
-								width = x - cx;
-							}
-							else
-							{
-								char buf2[2];
-								buf2[0] = line[cindex].mChar;
-								buf2[1] = '\0';
-								width = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, buf2).x;
-							}
-						}
-						ImVec2 cstart(textScreenPos.x + cx, lineStartScreenPos.y);
-						ImVec2 cend(textScreenPos.x + cx + width, lineStartScreenPos.y + mCharAdvance.y);
-						drawList->AddRectFilled(cstart, cend, mPalette[(int)PaletteIndex::Cursor]);
-						if (elapsed > 800)
-							mStartTime = timeEnd;
-					}
-				}
-			}
+	u.mAfter = mState;
+	AddUndo(u);
+}
 
-			// Render colorized text
-			auto prevColor = line.empty() ? mPalette[(int)PaletteIndex::Default] : GetGlyphColor(line[0]);
-			ImVec2 bufferOffset;
+void TextEditor::Backspace()
+{
+	assert(!IsReadOnly());
 
-			for (int i = 0; i < line.size();)
-			{
-				auto& glyph = line[i];
-				auto color = GetGlyphColor(glyph);
+	if (mLines.empty())
+		return;
 
-				if ((color != prevColor || glyph.mChar == '\t' || glyph.mChar == ' ') && !mLineBuffer.empty())
-				{
-					const ImVec2 newOffset(textScreenPos.x + bufferOffset.x, textScreenPos.y + bufferOffset.y);
-					drawList->AddText(newOffset, prevColor, mLineBuffer.c_str());
-					auto textSize = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, mLineBuffer.c_str(), nullptr, nullptr);
-					bufferOffset.x += textSize.x;
-					mLineBuffer.clear();
-				}
-				prevColor = color;
+	UndoRecord u;
+	u.mBefore = mState;
 
-				if (glyph.mChar == '\t')
-				{
-					auto oldX = bufferOffset.x;
-					bufferOffset.x = (1.0f + std::floor((1.0f + bufferOffset.x) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
-					++i;
+	if (HasSelection())
+	{
+		u.mRemoved = GetSelectedText();
+		u.mRemovedStart = mState.mSelectionStart;
+		u.mRemovedEnd = mState.mSelectionEnd;
 
-					if (mShowWhitespaces)
-					{
-						const auto s = ImGui::GetFontSize();
-						const auto x1 = textScreenPos.x + oldX + 1.0f;
-						const auto x2 = textScreenPos.x + bufferOffset.x - 1.0f;
-						const auto y = textScreenPos.y + bufferOffset.y + s * 0.5f;
-						const ImVec2 p1(x1, y);
-						const ImVec2 p2(x2, y);
-						const ImVec2 p3(x2 - s * 0.2f, y - s * 0.2f);
-						const ImVec2 p4(x2 - s * 0.2f, y + s * 0.2f);
-						drawList->AddLine(p1, p2, 0x90909090);
-						drawList->AddLine(p2, p3, 0x90909090);
-						drawList->AddLine(p2, p4, 0x90909090);
-					}
-				}
-				else if (glyph.mChar == ' ')
-				{
-					if (mShowWhitespaces)
-					{
-						const auto s = ImGui::GetFontSize();
-						const auto x = textScreenPos.x + bufferOffset.x + spaceSize * 0.5f;
-						const auto y = textScreenPos.y + bufferOffset.y + s * 0.5f;
-						drawList->AddCircleFilled(ImVec2(x, y), 1.5f, 0x80808080, 4);
-					}
-					bufferOffset.x += spaceSize;
-					i++;
-				}
-				else
-				{
-					auto l = UTF8CharLength(glyph.mChar);
-					while (l-- > 0)
-						mLineBuffer.push_back(line[i++].mChar);
-				}
-				++columnNo;
-			}
+		DeleteSelection();
+	}
+	else
+	{
+		auto pos = GetActualCursorCoordinates();
+		SetCursorPosition(pos);
 
-			if (!mLineBuffer.empty())
-			{
-				const ImVec2 newOffset(textScreenPos.x + bufferOffset.x, textScreenPos.y + bufferOffset.y);
-				drawList->AddText(newOffset, prevColor, mLineBuffer.c_str());
-				mLineBuffer.clear();
-			}
+		if (mState.mCursorPosition.mColumn == 0)
+		{
+			if (mState.mCursorPosition.mLine == 0)
+				return;
 
-			++lineNo;
-		}
+			u.mRemoved = '\n';
+			u.mRemovedStart = u.mRemovedEnd = Coordinates(pos.mLine - 1, GetLineMaxColumn(pos.mLine - 1));
+			Advance(u.mRemovedEnd);
 
-		// Draw a tooltip on known identifiers/preprocessor symbols
-		if (ImGui::IsMousePosValid())
+			auto& line = mLines[mState.mCursorPosition.mLine];
+			auto& prevLine = mLines[mState.mCursorPosition.mLine - 1];
+			auto prevSize = GetLineMaxColumn(mState.mCursorPosition.mLine - 1);
+			prevLine.Insert(prevLine.size(), line, 0, line.size());
+			mLines.Resized(mState.mCursorPosition.mLine - 1);
+
+			ErrorMarkers etmp;
+			for (auto& i : mErrorMarkers)
+				etmp.insert(ErrorMarkers::value_type(i.first - 1 == mState.mCursorPosition.mLine ? i.first - 1 : i.first, i.second));
+			mErrorMarkers = std::move(etmp);
+
+			RemoveLine(mState.mCursorPosition.mLine);
+			--mState.mCursorPosition.mLine;
+			mState.mCursorPosition.mColumn = prevSize;
+		}
+		else
 		{
-			auto id = GetWordAt(ScreenPosToCoordinates(ImGui::GetMousePos()));
-			if (!id.empty())
+			auto& line = mLines[mState.mCursorPosition.mLine];
+			auto cindex = GetCharacterIndex(pos) - 1;
+			auto cend = cindex + 1;
+			while (cindex > 0 && IsUTFSequence(line[cindex]))
+				--cindex;
+
+			//if (cindex > 0 && UTF8CharLength(line[cindex]) > 1)
+			//	--cindex;
+
+			u.mRemovedStart = u.mRemovedEnd = GetActualCursorCoordinates();
+			--u.mRemovedStart.mColumn;
+			--mState.mCursorPosition.mColumn;
+
+			while (cindex < line.size() && cend-- > cindex)
 			{
-				auto it = mLanguageDefinition.mIdentifiers.find(id);
-				if (it != mLanguageDefinition.mIdentifiers.end())
-				{
-					ImGui::BeginTooltip();
-					ImGui::TextUnformatted(it->second.mDeclaration.c_str());
-					ImGui::EndTooltip();
-				}
-				else
-				{
-					auto pi = mLanguageDefinition.mPreprocIdentifiers.find(id);
-					if (pi != mLanguageDefinition.mPreprocIdentifiers.end())
-					{
-						ImGui::BeginTooltip();
-						ImGui::TextUnformatted(pi->second.mDeclaration.c_str());
-						ImGui::EndTooltip();
-					}
-				}
+				u.mRemoved += line[cindex];
+				line.Erase(cindex, cindex + 1);
 			}
+			mLines.Resized(mState.mCursorPosition.mLine);
 		}
-	}
 
+		mTextChanged = true;
 
-	ImGui::Dummy(ImVec2((longest + 2), mLines.size() * mCharAdvance.y));
-
-	if (mScrollToCursor)
-	{
 		EnsureCursorVisible();
-		ImGui::SetWindowFocus();
-		mScrollToCursor = false;
+		Colorize(mState.mCursorPosition.mLine, 1);
 	}
+
+	u.mAfter = mState;
+	AddUndo(u);
 }
 
-void TextEditor::Render(const char* aTitle, const ImVec2& aSize, bool aBorder)
+void TextEditor::SelectWordUnderCursor()
 {
-	mWithinRender = true;
-	mTextChanged = false;
-	mCursorPositionChanged = false;
-
-	ImGui::PushStyleColor(ImGuiCol_ChildBg, ImGui::ColorConvertU32ToFloat4(mPalette[(int)PaletteIndex::Background]));
-	ImGui::PushStyleVar(ImGuiStyleVar_ItemSpacing, ImVec2(0.0f, 0.0f));
-	if (!mIgnoreImGuiChild)
-		ImGui::BeginChild(aTitle, aSize, aBorder, ImGuiWindowFlags_HorizontalScrollbar | ImGuiWindowFlags_AlwaysHorizontalScrollbar | ImGuiWindowFlags_NoMove);
-
-	if (mHandleKeyboardInputs)
-	{
-		HandleKeyboardInputs();
-		ImGui::PushAllowKeyboardFocus(true);
-	}
-
-	if (mHandleMouseInputs)
-		HandleMouseInputs();
-
-	ColorizeInternal();
-	Render();
-
-	if (mHandleKeyboardInputs)
-		ImGui::PopAllowKeyboardFocus();
-
-	if (!mIgnoreImGuiChild)
-		ImGui::EndChild();
+	auto c = GetCursorPosition();
+	SetSelection(FindWordStart(c), FindWordEnd(c));
+}
 
-	ImGui::PopStyleVar();
-	ImGui::PopStyleColor();
+void TextEditor::SelectAll()
+{
+	SetSelection(Coordinates(0, 0), Coordinates((int)mLines.size(), 0));
+}
 
-	mWithinRender = false;
+bool TextEditor::HasSelection() const
+{
+	return mState.mSelectionEnd > mState.mSelectionStart;
 }
 
-void TextEditor::SetText(const std::string & aText)
+void TextEditor::Copy()
 {
-	mLines.clear();
-	mLines.emplace_back(Line());
-	for (auto chr : aText)
+	if (HasSelection())
 	{
-		if (chr == '\r')
-		{
-			// ignore the carriage return character
-		}
-		else if (chr == '\n')
-			mLines.emplace_back(Line());
-		else
+		ImGui::SetClipboardText(GetSelectedText().c_str());
+	}
+	else
+	{
+		if (!mLines.empty())
 		{
-			mLines.back().emplace_back(Glyph(chr, PaletteIndex::Default));
+			std::string str;
+			auto& line = mLines[GetActualCursorCoordinates().mLine];
+			for (int i = 0; i < line.size(); ++i)
+				str.push_back(line[i]);
+			ImGui::SetClipboardText(str.c_str());
 		}
 	}
-
-	mTextChanged = true;
-	mScrollToTop = true;
-
-	mUndoBuffer.clear();
-	mUndoIndex = 0;
-
-	Colorize();
 }
 
-void TextEditor::SetTextLines(const std::vector<std::string> & aLines)
+void TextEditor::Cut()
 {
-	mLines.clear();
-
-	if (aLines.empty())
+	if (IsReadOnly())
 	{
-		mLines.emplace_back(Line());
+		Copy();
 	}
 	else
 	{
-		mLines.resize(aLines.size());
-
-		for (size_t i = 0; i < aLines.size(); ++i)
+		if (HasSelection())
 		{
-			const std::string & aLine = aLines[i];
+			UndoRecord u;
+			u.mBefore = mState;
+			u.mRemoved = GetSelectedText();
+			u.mRemovedStart = mState.mSelectionStart;
+			u.mRemovedEnd = mState.mSelectionEnd;
+
+			Copy();
+			DeleteSelection();
 
-			mLines[i].reserve(aLine.size());
-			for (size_t j = 0; j < aLine.size(); ++j)
-				mLines[i].emplace_back(Glyph(aLine[j], PaletteIndex::Default));
+			u.mAfter = mState;
+			AddUndo(u);
 		}
 	}
-
-	mTextChanged = true;
-	mScrollToTop = true;
-
-	mUndoBuffer.clear();
-	mUndoIndex = 0;
-
-	Colorize();
 }
 
-void TextEditor::EnterCharacter(ImWchar aChar, bool aShift)
+void TextEditor::Paste()
 {
-	assert(!mReadOnly);
-
-	UndoRecord u;
-
-	u.mBefore = mState;
+	if (IsReadOnly())
+		return;
 
-	if (HasSelection())
+	auto clipText = ImGui::GetClipboardText();
+	if (clipText != nullptr && strlen(clipText) > 0)
 	{
-		if (aChar == '\t' && mState.mSelectionStart.mLine != mState.mSelectionEnd.mLine)
+		UndoRecord u;
+		u.mBefore = mState;
+
+		if (HasSelection())
 		{
+			u.mRemoved = GetSelectedText();
+			u.mRemovedStart = mState.mSelectionStart;
+			u.mRemovedEnd = mState.mSelectionEnd;
+			DeleteSelection();
+		}
 
-			auto start = mState.mSelectionStart;
-			auto end = mState.mSelectionEnd;
-			auto originalEnd = end;
+		u.mAdded = clipText;
+		u.mAddedStart = GetActualCursorCoordinates();
 
-			if (start > end)
-				std::swap(start, end);
-			start.mColumn = 0;
-			//			end.mColumn = end.mLine < mLines.size() ? mLines[end.mLine].size() : 0;
-			if (end.mColumn == 0 && end.mLine > 0)
-				--end.mLine;
-			if (end.mLine >= (int)mLines.size())
-				end.mLine = mLines.empty() ? 0 : (int)mLines.size() - 1;
-			end.mColumn = GetLineMaxColumn(end.mLine);
+		InsertText(clipText);
 
-			//if (end.mColumn >= GetLineMaxColumn(end.mLine))
-			//	end.mColumn = GetLineMaxColumn(end.mLine) - 1;
+		u.mAddedEnd = GetActualCursorCoordinates();
+		u.mAfter = mState;
+		AddUndo(u);
+	}
+}
 
-			u.mRemovedStart = start;
-			u.mRemovedEnd = end;
-			u.mRemoved = GetText(start, end);
+bool TextEditor::CanUndo() const
+{
+	return !IsReadOnly() && mUndoIndex > 0;
+}
 
-			bool modified = false;
+bool TextEditor::CanRedo() const
+{
+	return !IsReadOnly() && mUndoIndex < (int)mUndoBuffer.size();
+}
 
-			for (int i = start.mLine; i <= end.mLine; i++)
-			{
-				auto& line = mLines[i];
-				if (aShift)
-				{
-					if (!line.empty())
-					{
-						if (line.front().mChar == '\t')
-						{
-							line.erase(line.begin());
-							modified = true;
-						}
-						else
-						{
-							for (int j = 0; j < mTabSize && !line.empty() && line.front().mChar == ' '; j++)
-							{
-								line.erase(line.begin());
-								modified = true;
-							}
-						}
-					}
-				}
-				else
-				{
-					line.insert(line.begin(), Glyph('\t', TextEditor::PaletteIndex::Background));
-					modified = true;
-				}
-			}
+void TextEditor::Undo(int aSteps)
+{
+	while (CanUndo() && aSteps-- > 0)
+		mUndoBuffer[--mUndoIndex].Undo(this);
+}
 
-			if (modified)
-			{
-				start = Coordinates(start.mLine, GetCharacterColumn(start.mLine, 0));
-				Coordinates rangeEnd;
-				if (originalEnd.mColumn != 0)
-				{
-					end = Coordinates(end.mLine, GetLineMaxColumn(end.mLine));
-					rangeEnd = end;
-					u.mAdded = GetText(start, end);
-				}
-				else
-				{
-					end = Coordinates(originalEnd.mLine, 0);
-					rangeEnd = Coordinates(end.mLine - 1, GetLineMaxColumn(end.mLine - 1));
-					u.mAdded = GetText(start, rangeEnd);
-				}
+void TextEditor::Redo(int aSteps)
+{
+	while (CanRedo() && aSteps-- > 0)
+		mUndoBuffer[mUndoIndex++].Redo(this);
+}
 
-				u.mAddedStart = start;
-				u.mAddedEnd = rangeEnd;
-				u.mAfter = mState;
+const TextEditor::Palette & TextEditor::GetDarkPalette()
+{
+	const static Palette p = { {
+			0xff7f7f7f,	// Default
+			0xffd69c56,	// Keyword	
+			0xff00ff00,	// Number
+			0xff7070e0,	// String
+			0xff70a0e0, // Char literal
+			0xffffffff, // Punctuation
+			0xff408080,	// Preprocessor
+			0xffaaaaaa, // Identifier
+			0xff9bc64d, // Known identifier
+			0xffc040a0, // Preproc identifier
+			0xff206020, // Comment (single line)
+			0xff406020, // Comment (multi line)
+			0xff101010, // Background
+			0xffe0e0e0, // Cursor
+			0x80a06020, // Selection
+			0x800020ff, // ErrorMarker
+			0x40f08000, // Breakpoint
+			0xff707000, // Line number
+			0x40000000, // Current line fill
+			0x40808080, // Current line fill (inactive)
+			0x40a0a0a0, // Current line edge
+		} };
+	return p;
+}
 
-				mState.mSelectionStart = start;
-				mState.mSelectionEnd = end;
-				AddUndo(u);
+const TextEditor::Palette & TextEditor::GetLightPalette()
+{
+	const static Palette p = { {
+			0xff7f7f7f,	// None
+			0xffff0c06,	// Keyword	
+			0xff008000,	// Number
+			0xff2020a0,	// String
+			0xff304070, // Char literal
+			0xff000000, // Punctuation
+			0xff406060,	// Preprocessor
+			0xff404040, // Identifier
+			0xff606010, // Known identifier
+			0xffc040a0, // Preproc identifier
+			0xff205020, // Comment (single line)
+			0xff405020, // Comment (multi line)
+			0xffffffff, // Background
+			0xff000000, // Cursor
+			0x80600000, // Selection
+			0xa00010ff, // ErrorMarker
+			0x80f08000, // Breakpoint
+			0xff505000, // Line number
+			0x40000000, // Current line fill
+			0x40808080, // Current line fill (inactive)
+			0x40000000, // Current line edge
+		} };
+	return p;
+}
 
-				mTextChanged = true;
+const TextEditor::Palette & TextEditor::GetRetroBluePalette()
+{
+	const static Palette p = { {
+			0xff00ffff,	// None
+			0xffffff00,	// Keyword	
+			0xff00ff00,	// Number
+			0xff808000,	// String
+			0xff808000, // Char literal
+			0xffffffff, // Punctuation
+			0xff008000,	// Preprocessor
+			0xff00ffff, // Identifier
+			0xffffffff, // Known identifier
+			0xffff00ff, // Preproc identifier
+			0xff808080, // Comment (single line)
+			0xff404040, // Comment (multi line)
+			0xff800000, // Background
+			0xff0080ff, // Cursor
+			0x80ffff00, // Selection
+			0xa00000ff, // ErrorMarker
+			0x80ff8000, // Breakpoint
+			0xff808000, // Line number
+			0x40000000, // Current line fill
+			0x40808080, // Current line fill (inactive)
+			0x40000000, // Current line edge
+		} };
+	return p;
+}
 
-				EnsureCursorVisible();
-			}
 
-			return;
-		} // c == '\t'
-		else
-		{
-			u.mRemoved = GetSelectedText();
-			u.mRemovedStart = mState.mSelectionStart;
-			u.mRemovedEnd = mState.mSelectionEnd;
-			DeleteSelection();
-		}
-	} // HasSelection
+size_t TextEditor::CoordinatesToOffset(const Coordinates& aCoordinates) const
+{
+	auto coords = SanitizeCoordinates(aCoordinates);
+	return mLines.GetOffset(coords.mLine) + GetCharacterIndex(coords);
+}
+
+TextEditor::Coordinates TextEditor::OffsetToCoordinates(size_t aOffset) const
+{
+	auto line = mLines.FindOffset(aOffset);
+	auto index = (int)std::min(aOffset - mLines.GetOffset(line), (size_t)mLines[line].size());
+	return Coordinates(line, GetCharacterColumn(line, index));
+}
+
+std::string TextEditor::GetText() const
+{
+	return GetText(Coordinates(), Coordinates((int)mLines.size(), 0));
+}
 
-	auto coord = GetActualCursorCoordinates();
-	u.mAddedStart = coord;
+std::vector<std::string> TextEditor::GetTextLines() const
+{
+	std::vector<std::string> result;
 
-	assert(!mLines.empty());
+	result.reserve(mLines.size());
 
-	if (aChar == '\n')
+	for (size_t lineNo = 0; lineNo < mLines.size(); ++lineNo)
 	{
-		InsertLine(coord.mLine + 1);
-		auto& line = mLines[coord.mLine];
-		auto& newLine = mLines[coord.mLine + 1];
+		auto& line = mLines[lineNo];
+		result.emplace_back((const char*)line.data(), (size_t)line.size());
+	}
 
-		if (mLanguageDefinition.mAutoIndentation)
-			for (size_t it = 0; it < line.size() && isascii(line[it].mChar) && isblank(line[it].mChar); ++it)
-				newLine.push_back(line[it]);
+	return result;
+}
 
-		const size_t whitespaceSize = newLine.size();
-		auto cindex = GetCharacterIndex(coord);
-		newLine.insert(newLine.end(), line.begin() + cindex, line.end());
-		line.erase(line.begin() + cindex, line.begin() + line.size());
-		SetCursorPosition(Coordinates(coord.mLine + 1, GetCharacterColumn(coord.mLine + 1, (int)whitespaceSize)));
-		u.mAdded = (char)aChar;
-	}
-	else
+void TextEditor::ForEachChunk(const ChunkCallback& aFunc) const
+{
+	// the lines made for a mapped file take turns, as the last one may still be part of the current chunk
+	Line scratch[2];
+	const char* chunk = nullptr;
+	size_t chunkSize = 0;
+	bool chunkIsPiece = false;
+	for (size_t i = 0; i < mLines.size(); ++i)
 	{
-		char buf[7];
-		int e = ImTextCharToUtf8(buf, 7, aChar);
-		if (e > 0)
-		{
-			buf[e] = '\0';
-			auto& line = mLines[coord.mLine];
-			auto cindex = GetCharacterIndex(coord);
+		auto& line = mLines.Get(i, scratch[i % 2]);
+		auto text = (const char*)line.data();
 
-			if (mOverwrite && cindex < (int)line.size())
+		if (i > 0)
+		{
+			// pieces of the same text, only a newline apart
+			if (chunkIsPiece && line.IsPiece() && chunk + chunkSize + 1 == text && chunk[chunkSize] == '\n')
 			{
-				auto d = UTF8CharLength(line[cindex].mChar);
-
-				u.mRemovedStart = mState.mCursorPosition;
-				u.mRemovedEnd = Coordinates(coord.mLine, GetCharacterColumn(coord.mLine, cindex + d));
-
-				while (d-- > 0 && cindex < (int)line.size())
-				{
-					u.mRemoved += line[cindex].mChar;
-					line.erase(line.begin() + cindex);
-				}
+				chunkSize += 1 + line.size();
+				continue;
 			}
 
-			for (auto p = buf; *p != '\0'; p++, ++cindex)
-				line.insert(line.begin() + cindex, Glyph(*p, PaletteIndex::Default));
-			u.mAdded = buf;
-
-			SetCursorPosition(Coordinates(coord.mLine, GetCharacterColumn(coord.mLine, cindex)));
+			if (chunkSize > 0)
+				aFunc(chunk, chunkSize);
+			aFunc("\n", 1);
 		}
-		else
-			return;
-	}
-
-	mTextChanged = true;
-
-	u.mAddedEnd = GetActualCursorCoordinates();
-	u.mAfter = mState;
 
-	AddUndo(u);
+		chunk = text;
+		chunkSize = line.size();
+		chunkIsPiece = line.IsPiece();
+	}
 
-	Colorize(coord.mLine - 1, 3);
-	EnsureCursorVisible();
+	if (chunkSize > 0)
+		aFunc(chunk, chunkSize);
 }
 
-void TextEditor::SetReadOnly(bool aValue)
+std::string TextEditor::GetSelectedText() const
 {
-	mReadOnly = aValue;
+	return GetText(mState.mSelectionStart, mState.mSelectionEnd);
 }
 
-void TextEditor::SetColorizerEnable(bool aValue)
+std::string TextEditor::GetCurrentLineText()const
 {
-	mColorizerEnabled = aValue;
+	auto lineLength = GetLineMaxColumn(mState.mCursorPosition.mLine);
+	return GetText(
+		Coordinates(mState.mCursorPosition.mLine, 0),
+		Coordinates(mState.mCursorPosition.mLine, lineLength));
 }
 
-void TextEditor::SetCursorPosition(const Coordinates & aPosition)
+void TextEditor::ProcessInputs()
 {
-	if (mState.mCursorPosition != aPosition)
-	{
-		mState.mCursorPosition = aPosition;
-		mCursorPositionChanged = true;
-		EnsureCursorVisible();
-	}
 }
 
-void TextEditor::SetSelectionStart(const Coordinates & aPosition)
+void TextEditor::Colorize(int aFromLine, int aLines)
 {
-	mState.mSelectionStart = SanitizeCoordinates(aPosition);
-	if (mState.mSelectionStart > mState.mSelectionEnd)
-		std::swap(mState.mSelectionStart, mState.mSelectionEnd);
+	int toLine = aLines == -1 ? (int)mLines.size() : std::min((int)mLines.size(), aFromLine + aLines);
+	mLines.ResetColorized(std::max(0, aFromLine), toLine);
+
+	// the lines of a mapped file are colorized when they are drawn
+	if (mLines.IsMapped())
+		return;
+
+	mColorRangeMin = std::min(mColorRangeMin, aFromLine);
+	mColorRangeMax = std::max(mColorRangeMax, toLine);
+	mColorRangeMin = std::max(0, mColorRangeMin);
+	mColorRangeMax = std::max(mColorRangeMin, mColorRangeMax);
+	mCommentRangeMin = std::min(mCommentRangeMin, std::max(0, aFromLine));
+	mCommentRangeTail = std::min(mCommentRangeTail, (int)mLines.size() - toLine);
 }
 
-void TextEditor::SetSelectionEnd(const Coordinates & aPosition)
+void TextEditor::ColorizeRange(int aFromLine, int aToLine)
 {
-	mState.mSelectionEnd = SanitizeCoordinates(aPosition);
-	if (mState.mSelectionStart > mState.mSelectionEnd)
-		std::swap(mState.mSelectionStart, mState.mSelectionEnd);
+	if (mLines.empty() || aFromLine >= aToLine)
+		return;
+
+	int endLine = std::max(0, std::min((int)mLines.size(), aToLine));
+	for (int i = aFromLine; i < endLine; ++i)
+		ColorizeLine(mLines[i], mLanguageDefinition, mTokenDFA, mRegexList, mIdentifierClassifier, mTokenCache.get(), mLanguageKey);
 }
 
-void TextEditor::SetSelection(const Coordinates & aStart, const Coordinates & aEnd, SelectionMode aMode)
+// Only reads the language and the line, so that it can be called by the colorizer thread as well.
+void TextEditor::ColorizeLine(Line& aLine, const LanguageDefinition& aLanguage, const TokenDFA& aTokenDFA, const RegexList& aRegexList, const IdentifierClassifier& aClassifier, TokenCache* aTokenCache, uint64_t aLanguageKey)
 {
-	auto oldSelStart = mState.mSelectionStart;
-	auto oldSelEnd = mState.mSelectionEnd;
+	if (aLine.empty())
+		return;
 
-	mState.mSelectionStart = SanitizeCoordinates(aStart);
-	mState.mSelectionEnd = SanitizeCoordinates(aEnd);
-	if (mState.mSelectionStart > mState.mSelectionEnd)
-		std::swap(mState.mSelectionStart, mState.mSelectionEnd);
+	uint64_t key = 0;
+	if (aTokenCache != nullptr && aTokenCache->Find(aLine, aLanguageKey, key))
+		return;
 
-	switch (aMode)
+	std::cmatch results;
+
+	aLine.ClearSpans();
+
+	// tokenize straight from the characters of the line, adding the spans doesn't touch them
+	const char * bufferBegin = (const char*)aLine.data();
+	const char * bufferEnd = bufferBegin + aLine.size();
+
+	auto last = bufferEnd;
+	auto uncolored = bufferBegin;	// the characters from here are not in a span yet
+
+	for (auto first = bufferBegin; first != last; )
 	{
-	case TextEditor::SelectionMode::Normal:
-		break;
-	case TextEditor::SelectionMode::Word:
+		const char * token_begin = nullptr;
+		const char * token_end = nullptr;
+		PaletteIndex token_color = PaletteIndex::Default;
+
+		bool hasTokenizeResult = false;
+
+		if (aLanguage.mTokenize != nullptr)
+		{
+			if (aLanguage.mTokenize(first, last, token_begin, token_end, token_color))
+				hasTokenizeResult = true;
+		}
+
+		if (hasTokenizeResult == false)
+			hasTokenizeResult = aTokenDFA.Match(first, last, token_begin, token_end, token_color);
+
+		if (hasTokenizeResult == false)
+		{
+			// todo : remove
+			//printf("using regex for %.*s\n", first + 10 < last ? 10 : int(last - first), first);
+
+			for (auto& p : aRegexList)
+			{
+				if (std::regex_search(first, last, results, p.first, std::regex_constants::match_continuous))
+				{
+					hasTokenizeResult = true;
+
+					auto& v = *results.begin();
+					token_begin = v.first;
+					token_end = v.second;
+					token_color = p.second;
+					break;
+				}
+			}
+		}
+
+		if (hasTokenizeResult == false)
+		{
+			first++;
+		}
+		else
+		{
+			if (token_color == PaletteIndex::Identifier)
+				token_color = aClassifier.Classify(token_begin, token_end, aLine.IsPreprocessor((int)(first - bufferBegin)));
+
+			aLine.AddSpan((int)(uncolored - bufferBegin), (int)(token_begin - bufferBegin), PaletteIndex::Default);
+			aLine.AddSpan((int)(token_begin - bufferBegin), (int)(token_end - bufferBegin), token_color);
+
+			first = uncolored = token_end;
+		}
+	}
+	aLine.AddSpan((int)(uncolored - bufferBegin), (int)(last - bufferBegin), PaletteIndex::Default);
+
+	if (aTokenCache != nullptr)
+		aTokenCache->Store(aLine, aLanguageKey, key);
+}
+
+// The bits of the state of the comment scanner stored in the lines
+static const uint8_t ScannedState = 0x01;
+static const uint8_t WithinStringState = 0x02;
+static const uint8_t WithinCommentState = 0x04;
+static const uint8_t ConcatenateState = 0x08;
+static const uint8_t WithinSingleLineCommentState = 0x10;
+static const uint8_t WithinPreprocState = 0x20;
+static const uint8_t FirstCharState = 0x40;
+static const uint8_t WithinLongStringState = 0x80;
+static const int LongStringLevelShift = 8;		// the number of '=' of the long string is in the bits above
+
+// The number of '=' between the two brackets of a long string start ("[==[") or end ("]==]") at aIndex, -1
+// if there is none there (or it has too many to be kept in the scan state).
+static int LongBracketLevel(const TextEditor::Line& aLine, int aIndex, TextEditor::Char aBracket)
+{
+	if (aLine[aIndex] != aBracket)
+		return -1;
+	int i = aIndex + 1;
+	while (i < aLine.size() && aLine[i] == '=')
+		++i;
+	const int level = i - aIndex - 1;
+	return i < aLine.size() && aLine[i] == aBracket && level <= 0xff ? level : -1;
+}
+
+// The characters the comment scanner has to look at one by one, as they may change its state: quotes, escapes,
+// the ones comments and long strings start or end with, and the non-ASCII ones (which are skipped as a whole).
+// It doesn't need to stop at the others, once it knows the line doesn't start with the preprocessor character,
+// so it gives a run of them the flags of the state at once.
+class CommentScanStops
+{
+public:
+	CommentScanStops(const TextEditor::LanguageDefinition& aLanguage)
+		: mCount(0)
+		, mEnabled(!aLanguage.mCommentStart.empty() && !aLanguage.mCommentEnd.empty() && !aLanguage.mSingleLineComment.empty())
 	{
-		mState.mSelectionStart = FindWordStart(mState.mSelectionStart);
-		if (!IsOnWordBoundary(mState.mSelectionEnd))
-			mState.mSelectionEnd = FindWordEnd(FindWordStart(mState.mSelectionEnd));
-		break;
+		// the first two are the ones within strings
+		Add('"');
+		Add('\\');
+		if (mEnabled)
+		{
+			Add(aLanguage.mCommentStart[0]);
+			Add(aLanguage.mCommentEnd[aLanguage.mCommentEnd.size() - 1]);
+			Add(aLanguage.mSingleLineComment[0]);
+			if (aLanguage.mLongStrings)
+				Add('[');
+		}
 	}
-	case TextEditor::SelectionMode::Line:
+
+	// The first character in [aFrom, aTo) of aText the scanner has to stop at. Within a long string, only
+	// the brackets which may end it matter.
+	int Find(const TextEditor::Char* aText, int aFrom, int aTo, bool aWithinString, bool aWithinLongString) const
 	{
-		const auto lineNo = mState.mSelectionEnd.mLine;
-		const auto lineSize = (size_t)lineNo < mLines.size() ? mLines[lineNo].size() : 0;
-		mState.mSelectionStart = Coordinates(mState.mSelectionStart.mLine, 0);
-		mState.mSelectionEnd = Coordinates(lineNo, GetLineMaxColumn(lineNo));
-		break;
+		if (!mEnabled)
+			return aFrom;
+		if (aWithinLongString)
+		{
+			auto end = (const TextEditor::Char*)memchr(aText + aFrom, ']', aTo - aFrom);
+			return end != nullptr ? (int)(end - aText) : aTo;
+		}
+
+		const int count = aWithinString ? 2 : mCount;
+		auto p = aFrom;
+#ifdef TEXTEDITOR_SSE2
+		for (; aTo - p >= 16; p += 16)
+		{
+			auto chars = _mm_loadu_si128((const __m128i*)(aText + p));
+			auto found = chars;		// the high bit of the non-ASCII ones
+			for (int i = 0; i < count; ++i)
+				found = _mm_or_si128(found, _mm_cmpeq_epi8(chars, _mm_set1_epi8((char)mChars[i])));
+			auto mask = (unsigned)_mm_movemask_epi8(found);
+			if (mask != 0)
+				return p + CountTrailingZeros(mask);
+		}
+#endif
+		for (; p < aTo; ++p)
+		{
+			auto c = aText[p];
+			if (c >= 0x80)
+				return p;
+			for (int i = 0; i < count; ++i)
+			{
+				if (c == mChars[i])
+					return p;
+			}
+		}
+		return aTo;
 	}
-	default:
-		break;
+
+private:
+	void Add(char aChar)
+	{
+		for (int i = 0; i < mCount; ++i)
+		{
+			if (mChars[i] == (TextEditor::Char)aChar)
+				return;
+		}
+		mChars[mCount++] = (TextEditor::Char)aChar;
 	}
 
-	if (mState.mSelectionStart != oldSelStart ||
-		mState.mSelectionEnd != oldSelEnd)
-		mCursorPositionChanged = true;
-}
+	TextEditor::Char mChars[6];
+	int mCount;
+	bool mEnabled;
+};
 
-void TextEditor::SetTabSize(int aValue)
+// Scans the lines from aFromLine, starting in the state stored in that line. From aStableFrom on, the scan
+// stops at the first line which already starts in the same state, as the lines after it are up to date.
+// Returns the line it stopped at. The lines whose state changed have to be colorized again.
+int TextEditor::ColorizeComments(int aFromLine, int aToLine, int aStableFrom)
 {
-	mTabSize = std::max(0, std::min(32, aValue));
-}
+	auto endLine = aToLine;
+	auto endIndex = 0;
+	auto commentStartLine = endLine;
+	auto commentStartIndex = endIndex;
+	auto withinString = false;
+	auto withinLongString = false;
+	auto longStringLevel = 0;
+	auto withinSingleLineComment = false;
+	auto withinPreproc = false;
+	auto firstChar = true;			// there is no other non-whitespace characters in the line before
+	auto concatenate = false;		// '\' on the very end of the line
+	auto currentLine = aFromLine;
+	auto currentIndex = 0;
+	const CommentScanStops stops(mLanguageDefinition);
+
+	uint16_t state = aFromLine > 0 && aFromLine < endLine ? mLines[aFromLine].GetScanState() : 0;
+	if (state != 0)
+	{
+		withinString = (state & WithinStringState) != 0;
+		withinLongString = (state & WithinLongStringState) != 0;
+		longStringLevel = state >> LongStringLevelShift;
+		if (state & WithinCommentState)
+		{
+			commentStartLine = aFromLine - 1;
+			commentStartIndex = 0;
+		}
+		concatenate = (state & ConcatenateState) != 0;
+		withinSingleLineComment = (state & WithinSingleLineCommentState) != 0;
+		withinPreproc = (state & WithinPreprocState) != 0;
+		firstChar = (state & FirstCharState) != 0;
+	}
 
-void TextEditor::InsertText(const std::string & aValue)
-{
-	InsertText(aValue.c_str());
-}
+	while (currentLine < endLine || currentIndex < endIndex)
+	{
+		auto& line = mLines[currentLine];
+
+		if (currentIndex == 0)
+		{
+			state = ScannedState;
+			if (withinString)
+				state |= WithinStringState;
+			if (withinLongString)
+				state |= WithinLongStringState | (longStringLevel << LongStringLevelShift);
+			if (commentStartLine < currentLine)
+				state |= WithinCommentState;
+			if (concatenate)
+			{
+				state |= ConcatenateState;
+				if (withinSingleLineComment)
+					state |= WithinSingleLineCommentState;
+				if (withinPreproc)
+					state |= WithinPreprocState;
+				if (firstChar)
+					state |= FirstCharState;
+			}
+
+			if (currentLine > aFromLine && currentLine >= aStableFrom && line.GetScanState() == state)
+				break;
+			// the colors depend on the preprocessor flags, which may change with the state
+			if (line.GetScanState() != state)
+				line.SetColorized(false);
+			line.SetScanState(state);
+
+			// not every character is given each flag below (the ones in strings, or skipped by an escape), so
+			// that they don't keep what an earlier scan found
+			line.ResetScanFlags();
+		}
+
+		if (currentIndex == 0 && !concatenate)
+		{
+			withinSingleLineComment = false;
+			withinPreproc = false;
+			firstChar = true;
+		}
+
+		concatenate = false;
+
+		if (!line.empty() && !firstChar)
+		{
+			// the flags of the characters before the next one which matters stay the same
+			auto next = stops.Find(line.data(), currentIndex, line.size(), withinString, withinLongString);
+			if (next > currentIndex)
+			{
+				bool inComment = (commentStartLine < currentLine || (commentStartLine == currentLine && commentStartIndex <= currentIndex));
+				line.SetScanFlags(currentIndex, next, !withinString && withinSingleLineComment, inComment, withinPreproc, withinLongString);
+				currentIndex = next;
+				if (currentIndex >= (int)line.size())
+				{
+					currentIndex = 0;
+					++currentLine;
+					continue;
+				}
+			}
+		}
+
+		if (!line.empty())
+		{
+			auto c = line[currentIndex];
+
+			if (c != mLanguageDefinition.mPreprocChar && !isspace(c))
+				firstChar = false;
+
+			if (currentIndex == (int)line.size() - 1 && line[line.size() - 1] == '\\')
+				concatenate = true;
+
+			bool inComment = (commentStartLine < currentLine || (commentStartLine == currentLine && commentStartIndex <= currentIndex));
+
+			if (withinLongString)
+			{
+				// the brackets which end it are a part of it too
+				auto end = currentIndex + 1;
+				if (LongBracketLevel(line, currentIndex, ']') == longStringLevel)
+				{
+					end = currentIndex + longStringLevel + 2;
+					withinLongString = false;
+				}
+				line.SetScanFlags(currentIndex, end, false, false, withinPreproc, true);
+				currentIndex = end - 1;
+			}
+			else if (withinString)
+			{
+				line.SetMultiLineComment(currentIndex, inComment);
+
+				if (c == '\"')
+				{
+					if (currentIndex + 1 < (int)line.size() && line[currentIndex + 1] == '\"')
+					{
+						currentIndex += 1;
+						if (currentIndex < (int)line.size())
+							line.SetMultiLineComment(currentIndex, inComment);
+					}
+					else
+						withinString = false;
+				}
+				else if (c == '\\')
+				{
+					currentIndex += 1;
+					if (currentIndex < (int)line.size())
+						line.SetMultiLineComment(currentIndex, inComment);
+				}
+			}
+			else
+			{
+				if (firstChar && c == mLanguageDefinition.mPreprocChar)
+					withinPreproc = true;
+
+				int level;
+				if (c == '\"')
+				{
+					withinString = true;
+					line.SetMultiLineComment(currentIndex, inComment);
+				}
+				else if (mLanguageDefinition.mLongStrings && !inComment && !withinSingleLineComment && (level = LongBracketLevel(line, currentIndex, '[')) >= 0)
+				{
+					withinLongString = true;
+					longStringLevel = level;
+					line.SetScanFlags(currentIndex, currentIndex + level + 2, false, false, withinPreproc, true);
+					currentIndex += level + 1;
+				}
+				else
+				{
+					auto& startStr = mLanguageDefinition.mCommentStart;
+					auto& singleStartStr = mLanguageDefinition.mSingleLineComment;
 
-void TextEditor::InsertText(const char * aValue)
-{
-	if (aValue == nullptr)
-		return;
+					// a comment may start with the start of a single line comment, like Lua's "--[[" does with "--"
+					if (!withinSingleLineComment && startStr.size() > 0 && currentIndex + startStr.size() <= line.size() &&
+						equals(line, currentIndex, startStr))
+					{
+						commentStartLine = currentLine;
+						commentStartIndex = currentIndex;
+					}
+					else if (singleStartStr.size() > 0 &&
+						currentIndex + singleStartStr.size() <= line.size() &&
+						equals(line, currentIndex, singleStartStr))
+					{
+						withinSingleLineComment = true;
+					}
 
-	auto pos = GetActualCursorCoordinates();
-	auto start = std::min(pos, mState.mSelectionStart);
-	int totalLines = pos.mLine - start.mLine;
+					inComment = inComment = (commentStartLine < currentLine || (commentStartLine == currentLine && commentStartIndex <= currentIndex));
 
-	totalLines += InsertTextAt(pos, aValue);
+					line.SetMultiLineComment(currentIndex, inComment);
+					line.SetComment(currentIndex, withinSingleLineComment);
 
-	SetSelection(pos, pos);
-	SetCursorPosition(pos);
-	Colorize(start.mLine - 1, totalLines + 2);
+					auto& endStr = mLanguageDefinition.mCommentEnd;
+					if (currentIndex + 1 >= (int)endStr.size() &&
+						equals(line, currentIndex + 1 - (int)endStr.size(), endStr))
+					{
+						commentStartIndex = endIndex;
+						commentStartLine = endLine;
+					}
+				}
+			}
+			// an escape at the end of the line in a string skips past it
+			if (currentIndex < (int)line.size())
+				line.SetPreprocessor(currentIndex, withinPreproc);
+			currentIndex += UTF8CharLength(c);
+			if (currentIndex >= (int)line.size())
+			{
+				currentIndex = 0;
+				++currentLine;
+			}
+		}
+		else
+		{
+			currentIndex = 0;
+			++currentLine;
+		}
+	}
+	return currentLine;
 }
 
-void TextEditor::DeleteSelection()
-{
-	assert(mState.mSelectionEnd >= mState.mSelectionStart);
+// The comment scan checks the time after each slice of this many lines.
+static const int CommentScanLines = 1024;
 
-	if (mState.mSelectionEnd == mState.mSelectionStart)
-		return;
+// Below this many lines the colorizer doesn't split its work between threads. The comment scan gives each
+// thread a slice of ParallelScanLines lines, the lines to colorize are handed out in chunks of ParallelChunkLines.
+static const int ParallelLines = 16384;
+static const int ParallelScanLines = 8192;
+static const int ParallelChunkLines = 256;
 
-	DeleteRange(mState.mSelectionStart, mState.mSelectionEnd);
+// The threads the colorizer splits a large amount of work between: one for each core but the calling thread's,
+// shared by all the editors. They are started the first time there is such work, and wait for more in between.
+class WorkerPool
+{
+public:
+	// The number of threads the work is split between, the calling one included.
+	static int GetWorkerCount()
+	{
+		static const int count = std::max(1, (int)std::thread::hardware_concurrency());
+		return count;
+	}
 
-	SetSelection(mState.mSelectionStart, mState.mSelectionStart);
-	SetCursorPosition(mState.mSelectionStart);
-	Colorize(mState.mSelectionStart.mLine, 1);
-}
+	static WorkerPool& Get()
+	{
+		static WorkerPool pool(GetWorkerCount() - 1);
+		return pool;
+	}
 
-void TextEditor::MoveUp(int aAmount, bool aSelect)
-{
-	auto oldPos = mState.mCursorPosition;
-	mState.mCursorPosition.mLine = std::max(0, mState.mCursorPosition.mLine - aAmount);
-	if (oldPos != mState.mCursorPosition)
+	// Calls aFunc with each number in [0, aCount), on the pool threads and the calling one, and returns once
+	// all the calls returned.
+	void ForEach(int aCount, const std::function<void(int)>& aFunc)
 	{
-		if (aSelect)
+		std::lock_guard<std::mutex> use(mUseMutex);
 		{
-			if (oldPos == mInteractiveStart)
-				mInteractiveStart = mState.mCursorPosition;
-			else if (oldPos == mInteractiveEnd)
-				mInteractiveEnd = mState.mCursorPosition;
-			else
-			{
-				mInteractiveStart = mState.mCursorPosition;
-				mInteractiveEnd = oldPos;
-			}
+			std::lock_guard<std::mutex> lock(mMutex);
+			mFunc = &aFunc;
+			mNext = 0;
+			mCount = mPending = aCount;
 		}
-		else
-			mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
-		SetSelection(mInteractiveStart, mInteractiveEnd);
+		mCondition.notify_all();
 
-		EnsureCursorVisible();
+		Work();
+		std::unique_lock<std::mutex> lock(mMutex);
+		mDoneCondition.wait(lock, [this] { return mPending == 0; });
+		mFunc = nullptr;
 	}
-}
 
-void TextEditor::MoveDown(int aAmount, bool aSelect)
-{
-	assert(mState.mCursorPosition.mColumn >= 0);
-	auto oldPos = mState.mCursorPosition;
-	mState.mCursorPosition.mLine = std::max(0, std::min((int)mLines.size() - 1, mState.mCursorPosition.mLine + aAmount));
+private:
+	explicit WorkerPool(int aThreads)
+		: mFunc(nullptr)
+		, mNext(0)
+		, mCount(0)
+		, mPending(0)
+		, mQuit(false)
+	{
+		for (int i = 0; i < aThreads; ++i)
+			mThreads.emplace_back(&WorkerPool::Run, this);
+	}
 
-	if (mState.mCursorPosition != oldPos)
+	~WorkerPool()
 	{
-		if (aSelect)
 		{
-			if (oldPos == mInteractiveEnd)
-				mInteractiveEnd = mState.mCursorPosition;
-			else if (oldPos == mInteractiveStart)
-				mInteractiveStart = mState.mCursorPosition;
-			else
-			{
-				mInteractiveStart = oldPos;
-				mInteractiveEnd = mState.mCursorPosition;
-			}
+			std::lock_guard<std::mutex> lock(mMutex);
+			mQuit = true;
 		}
-		else
-			mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
-		SetSelection(mInteractiveStart, mInteractiveEnd);
+		mCondition.notify_all();
+		for (auto& thread : mThreads)
+			thread.join();
+	}
 
-		EnsureCursorVisible();
+	void Run()
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		for (;;)
+		{
+			mCondition.wait(lock, [this] { return mQuit || mNext < mCount; });
+			if (mQuit)
+				return;
+			lock.unlock();
+			Work();
+			lock.lock();
+		}
 	}
-}
 
-static bool IsUTFSequence(char c)
+	// Takes the numbers one at a time, until they are all taken.
+	void Work()
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		while (mNext < mCount)
+		{
+			auto& func = *mFunc;
+			auto i = mNext++;
+			lock.unlock();
+			func(i);
+			lock.lock();
+			if (--mPending == 0)
+				mDoneCondition.notify_all();
+		}
+	}
+
+	std::mutex mUseMutex;	// one ForEach() at a time
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::condition_variable mDoneCondition;
+	const std::function<void(int)>* mFunc;
+	int mNext, mCount, mPending;
+	bool mQuit;
+	std::vector<std::thread> mThreads;
+};
+
+// The same as ColorizeComments() over [aFromLine, aToLine), with the lines split into a slice for each thread. Each
+// slice is scanned from the state its first line has (whatever it was before), then the scan is followed over
+// each slice boundary in order, which usually stops at the first line of the slice as the states agree.
+void TextEditor::ColorizeCommentsParallel(int aFromLine, int aToLine)
 {
-	return (c & 0xC0) == 0x80;
+	const int slices = (aToLine - aFromLine + ParallelScanLines - 1) / ParallelScanLines;
+	WorkerPool::Get().ForEach(slices, [&](int aSlice)
+	{
+		const int from = aFromLine + aSlice * ParallelScanLines;
+		const int to = std::min(from + ParallelScanLines, aToLine);
+		ColorizeComments(from, to, to);
+	});
+
+	for (int from = aFromLine + ParallelScanLines; from < aToLine; from += ParallelScanLines)
+		ColorizeComments(from - 1, aToLine, from);
 }
 
-void TextEditor::MoveLeft(int aAmount, bool aSelect, bool aWordMode)
+void TextEditor::ColorizeInternal()
 {
-	if (mLines.empty())
+	if (mLines.empty() || !mColorizerEnabled || mLines.IsMapped())
 		return;
 
-	auto oldPos = mState.mCursorPosition;
-	mState.mCursorPosition = GetActualCursorCoordinates();
-	auto line = mState.mCursorPosition.mLine;
-	auto cindex = GetCharacterIndex(mState.mCursorPosition);
+	// the comments are scanned first, then the lines are colorized (the visible ones regardless of the time)
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(mColorizerBudget);
 
-	while (aAmount-- > 0)
+	if (mCommentRangeMin != std::numeric_limits<int>::max())
 	{
-		if (cindex == 0)
+		// the line before the first changed one is unchanged, and so is the state it starts in,
+		// unless it was never scanned
+		const int size = (int)mLines.size();
+		int from = std::max(0, std::min(mCommentRangeMin, size) - 1);
+		while (from > 0 && mLines[from].GetScanState() == 0)
+			--from;
+
+		// once the time is up, the scan goes on in the next frame from the last line it went through
+		const int stableFrom = size - std::min(mCommentRangeTail, size);
+		const int workers = WorkerPool::GetWorkerCount();
+		for (;;)
 		{
-			if (line > 0)
+			// the lines before the unchanged ones are all scanned, a large number of them on all the cores
+			int end, to;
+			if (workers > 1 && stableFrom - from >= ParallelLines)
 			{
-				--line;
-				if ((int)mLines.size() > line)
-					cindex = (int)mLines[line].size();
-				else
-					cindex = 0;
+				end = std::min(stableFrom, from + workers * ParallelScanLines);
+				ColorizeCommentsParallel(from, end);
+				to = end;
 			}
-		}
-		else
-		{
-			--cindex;
-			if (cindex > 0)
+			else
 			{
-				if ((int)mLines.size() > line)
-				{
-					while (cindex > 0 && IsUTFSequence(mLines[line][cindex].mChar))
-						--cindex;
-				}
+				end = std::min(size, from + CommentScanLines);
+				to = ColorizeComments(from, end, stableFrom);
 			}
-		}
 
-		mState.mCursorPosition = Coordinates(line, GetCharacterColumn(line, cindex));
-		if (aWordMode)
-		{
-			mState.mCursorPosition = FindWordStart(mState.mCursorPosition);
-			cindex = GetCharacterIndex(mState.mCursorPosition);
+			// the lines the scan went through are checked for a changed state
+			if (from < to)
+			{
+				mColorRangeMin = std::min(mColorRangeMin, from);
+				mColorRangeMax = std::max(mColorRangeMax, to);
+			}
+
+			if (to < end || to == size)
+			{
+				mCommentRangeMin = std::numeric_limits<int>::max();
+				mCommentRangeTail = std::numeric_limits<int>::max();
+				break;
+			}
+			if (std::chrono::steady_clock::now() >= deadline)
+			{
+				mCommentRangeMin = to;
+				break;
+			}
+			from = to - 1;
 		}
 	}
 
-	mState.mCursorPosition = Coordinates(line, GetCharacterColumn(line, cindex));
+	const int size = (int)mLines.size();
+	while (mColorRangeMin < mColorRangeMax && mColorRangeMin < size && mLines[mColorRangeMin].IsColorized())
+		++mColorRangeMin;
 
-	assert(mState.mCursorPosition.mColumn >= 0);
-	if (aSelect)
+	// The lines are taken in the order they are needed: the visible ones, then a page ahead in the
+	// direction of scrolling, then the rest of the range from its start. The ones colorized since the
+	// range was extended are skipped.
+	const float lineHeight = ImGui::GetTextLineHeightWithSpacing() * mLineSpacing;
+	const float scrollY = ImGui::GetScrollY();
+	if (scrollY != mLastScrollY)
 	{
-		if (oldPos == mInteractiveStart)
-			mInteractiveStart = mState.mCursorPosition;
-		else if (oldPos == mInteractiveEnd)
-			mInteractiveEnd = mState.mCursorPosition;
-		else
+		mScrollDirection = scrollY < mLastScrollY ? -1 : 1;
+		mLastScrollY = scrollY;
+	}
+	const int firstVisible = (int)floor(scrollY / lineHeight);
+	const int page = (int)ceil(ImGui::GetWindowHeight() / lineHeight) + 1;
+	const int ahead = mScrollDirection > 0 ? firstVisible + page : firstVisible - page;
+	const int order[3][2] = {
+		{ firstVisible, firstVisible + page },
+		{ ahead, ahead + page },
+		{ mColorRangeMin, mColorRangeMax } };
+	const int rangeEnd = std::min(mColorRangeMax, size);
+
+	if (mColorizer)
+	{
+		auto& colorizer = *mColorizer;
+		auto& job = colorizer.mJob;
+		std::unique_lock<std::mutex> lock(colorizer.mMutex);
+
+		if (colorizer.mBusy)
 		{
-			mInteractiveStart = mState.mCursorPosition;
-			mInteractiveEnd = oldPos;
+			// the colors of the lines the thread got through are applied as it goes, but those which went
+			// out of date since the lines were copied
+			const auto finished = colorizer.mFinished.load(std::memory_order_acquire);
+			for (; job.mApplied < finished; ++job.mApplied)
+			{
+				auto index = job.mIndices[job.mApplied];
+				if (index < 0 || !mLines[index].IsTaken())
+					continue;
+
+				auto& to = mLines[index];
+				to.SetSpans(job.mLines[job.mApplied].GetSpans());
+				to.SetColorized(true);
+				to.SetTaken(false);
+			}
+
+			if (colorizer.mDone)
+			{
+				// a job cut short leaves the rest of its lines to be taken again
+				for (auto i = job.mApplied; i < job.mIndices.size(); ++i)
+				{
+					if (job.mIndices[i] >= 0)
+						mLines[job.mIndices[i]].SetTaken(false);
+				}
+				job.mLines.clear();
+				job.mIndices.clear();
+				job.mText.reset();
+				job.mApplied = 0;
+				colorizer.mFinished = 0;
+				colorizer.mBusy = colorizer.mDone = false;
+				colorizer.mCancel = false;
+			}
+			else
+			{
+				// the job is cut short if a line in view or ahead (after scrolling or an edit) is not in it, so that
+				// the next one starts with them
+				for (int o = 0; o < 2 && !colorizer.mCancel; ++o)
+				{
+					for (int i = std::max(order[o][0], mColorRangeMin); i < std::min(order[o][1], rangeEnd); ++i)
+					{
+						if (!mLines[i].IsColorized() && !mLines[i].IsTaken())
+						{
+							colorizer.mCancel = true;
+							break;
+						}
+					}
+				}
+			}
 		}
-	}
-	else
-		mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
-	SetSelection(mInteractiveStart, mInteractiveEnd, aSelect && aWordMode ? SelectionMode::Word : SelectionMode::Normal);
 
-	EnsureCursorVisible();
-}
+		if (!colorizer.mBusy && mColorRangeMin < rangeEnd)
+		{
+			// the lines in view and ahead are copied regardless of the time, the rest until the time is up
+			bool inTime = true;
+			for (int o = 0; o < 3 && inTime; ++o)
+			{
+				for (int i = std::max(order[o][0], mColorRangeMin); i < std::min(order[o][1], rangeEnd) && inTime; ++i)
+				{
+					// the rest of the range has the lines taken before in it too
+					auto taken = o == 2 && ((i >= order[0][0] && i < order[0][1]) || (i >= order[1][0] && i < order[1][1]));
+					if (!taken && !mLines[i].IsColorized())
+					{
+						mLines[i].SetTaken(true);
+						job.mLines.push_back(mLines[i]);
+						job.mIndices.push_back(i);
+						inTime = o < 2 || (job.mLines.size() % 64 != 0 || std::chrono::steady_clock::now() < deadline);
+					}
+				}
+			}
 
-void TextEditor::MoveRight(int aAmount, bool aSelect, bool aWordMode)
-{
-	auto oldPos = mState.mCursorPosition;
+			if (!colorizer.mLanguage)
+			{
+				auto language = std::make_shared<Colorizer::Language>();
+				language->mDefinition = mLanguageDefinition;
+				language->mTokenDFA = mTokenDFA;
+				language->mRegexList = mRegexList;
+				language->mIdentifierClassifier = mIdentifierClassifier;
+				language->mTokenCache = mTokenCache;
+				language->mLanguageKey = mLanguageKey;
+				colorizer.mLanguage = language;
+			}
 
-	if (mLines.empty() || oldPos.mLine >= mLines.size())
+			job.mLanguage = colorizer.mLanguage;
+			job.mText = mLoadedText;
+			colorizer.mBusy = true;
+			lock.unlock();
+			colorizer.mCondition.notify_one();
+			return;
+		}
+
+		if (!colorizer.mBusy && mColorRangeMin >= rangeEnd)
+		{
+			mColorRangeMin = std::numeric_limits<int>::max();
+			mColorRangeMax = 0;
+		}
 		return;
+	}
 
-	auto cindex = GetCharacterIndex(mState.mCursorPosition);
-	while (aAmount-- > 0)
+	if (mColorRangeMin < rangeEnd)
 	{
-		auto lindex = mState.mCursorPosition.mLine;
-		auto& line = mLines[lindex];
-
-		if (cindex >= line.size())
+		bool inTime = true;
+		const int workers = rangeEnd - mColorRangeMin >= ParallelLines ? WorkerPool::GetWorkerCount() : 1;
+		// a range larger than the token cache would only replace the lines in it with ones unlikely to come back
+		auto tokenCache = mTokenCache && rangeEnd - mColorRangeMin <= mTokenCache->GetCapacity() ? mTokenCache.get() : nullptr;
+		for (int o = 0; o < (workers > 1 ? 2 : 3) && inTime; ++o)
 		{
-			if (mState.mCursorPosition.mLine < mLines.size() - 1)
+			for (int i = std::max(order[o][0], mColorRangeMin); i < std::min(order[o][1], rangeEnd) && inTime; ++i)
 			{
-				mState.mCursorPosition.mLine = std::max(0, std::min((int)mLines.size() - 1, mState.mCursorPosition.mLine + 1));
-				mState.mCursorPosition.mColumn = 0;
+				if (!mLines[i].IsColorized())
+				{
+					ColorizeLine(mLines[i], mLanguageDefinition, mTokenDFA, mRegexList, mIdentifierClassifier, tokenCache, mLanguageKey);
+					mLines[i].SetColorized(true);
+					inTime = o == 0 || std::chrono::steady_clock::now() < deadline;
+				}
 			}
-			else
-				return;
 		}
-		else
+
+		// a large range is handed out in chunks from its start to all the cores, until the time is up
+		if (workers > 1 && inTime)
 		{
-			cindex += UTF8CharLength(line[cindex].mChar);
-			mState.mCursorPosition = Coordinates(lindex, GetCharacterColumn(lindex, cindex));
-			if (aWordMode)
-				mState.mCursorPosition = FindNextWord(mState.mCursorPosition);
+			std::atomic<int> next(mColorRangeMin);
+			WorkerPool::Get().ForEach(workers, [&](int)
+			{
+				for (int from = next.fetch_add(ParallelChunkLines); from < rangeEnd; from = next.fetch_add(ParallelChunkLines))
+				{
+					for (int i = from; i < std::min(from + ParallelChunkLines, rangeEnd); ++i)
+					{
+						if (!mLines[i].IsColorized())
+						{
+							if (std::chrono::steady_clock::now() >= deadline)
+								return;
+							ColorizeLine(mLines[i], mLanguageDefinition, mTokenDFA, mRegexList, mIdentifierClassifier, tokenCache, mLanguageKey);
+							mLines[i].SetColorized(true);
+						}
+					}
+				}
+			});
 		}
+
+		while (mColorRangeMin < rangeEnd && mLines[mColorRangeMin].IsColorized())
+			++mColorRangeMin;
 	}
 
-	if (aSelect)
+	if (mColorRangeMin >= rangeEnd)
 	{
-		if (oldPos == mInteractiveEnd)
-			mInteractiveEnd = SanitizeCoordinates(mState.mCursorPosition);
-		else if (oldPos == mInteractiveStart)
-			mInteractiveStart = mState.mCursorPosition;
-		else
-		{
-			mInteractiveStart = oldPos;
-			mInteractiveEnd = mState.mCursorPosition;
-		}
+		mColorRangeMin = std::numeric_limits<int>::max();
+		mColorRangeMax = 0;
 	}
-	else
-		mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
-	SetSelection(mInteractiveStart, mInteractiveEnd, aSelect && aWordMode ? SelectionMode::Word : SelectionMode::Normal);
-
-	EnsureCursorVisible();
 }
 
-void TextEditor::MoveTop(bool aSelect)
+float TextEditor::TextDistanceToLineStart(const Coordinates& aFrom) const
 {
-	auto oldPos = mState.mCursorPosition;
-	SetCursorPosition(Coordinates(0, 0));
+	auto& line = mLines[aFrom.mLine];
+	int colIndex = GetCharacterIndex(aFrom);
 
-	if (mState.mCursorPosition != oldPos)
+	auto columnAdvance = GetColumnAdvance(line);
+	if (columnAdvance != 0.0f)
+		return GetCharacterColumn(aFrom.mLine, colIndex) * columnAdvance;
+
+	auto checkpoints = GetCheckpoints(line, true);
+	if (checkpoints == nullptr)
+		return TextDistance(line, 0, colIndex, 0.0f);
+
+	auto& checkpoint = FindCheckpoint(*checkpoints, [&](const Line::Checkpoint& aPoint) { return aPoint.mIndex <= colIndex; });
+	return TextDistance(line, checkpoint.mIndex, colIndex, checkpoint.mX);
+}
+
+// Adds the width of the characters of aLine from index aFrom to aTo to aDistance.
+float TextEditor::TextDistance(const Line& aLine, int aFrom, int aTo, float aDistance) const
+{
+	auto& advances = GetAdvances();
+	float distance = aDistance;
+	float spaceSize = advances.Get(' ');
+	const int end = std::min(aLine.size(), aTo);
+	for (int it = aFrom; it < end; )
 	{
-		if (aSelect)
-		{
-			mInteractiveEnd = oldPos;
-			mInteractiveStart = mState.mCursorPosition;
+		if (aLine[it] == '\t')
+		{
+			distance = (1.0f + std::floor((1.0f + distance) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
+			++it;
 		}
 		else
-			mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
-		SetSelection(mInteractiveStart, mInteractiveEnd);
+		{
+			auto d = std::min(UTF8CharLength(aLine[it]), aLine.size() - it);
+			distance += advances.Get(aLine.data() + it, d);
+			it += d;
+		}
 	}
+
+	return distance;
 }
 
-void TextEditor::TextEditor::MoveBottom(bool aSelect)
+// The widths of the characters in the current font, so it has to be called in a frame.
+const TextEditor::GlyphAdvances& TextEditor::GetAdvances() const
 {
-	auto oldPos = GetCursorPosition();
-	auto newPos = Coordinates((int)mLines.size() - 1, 0);
-	SetCursorPosition(newPos);
-	if (aSelect)
-	{
-		mInteractiveStart = oldPos;
-		mInteractiveEnd = newPos;
-	}
-	else
-		mInteractiveStart = mInteractiveEnd = newPos;
-	SetSelection(mInteractiveStart, mInteractiveEnd);
+	mAdvances.Update(ImGui::GetFont(), ImGui::GetFontSize());
+	return mAdvances;
 }
 
-void TextEditor::MoveHome(bool aSelect)
+// The width of a column of aLine if its x positions can be computed from the columns, 0 if they have to be measured.
+float TextEditor::GetColumnAdvance(const Line& aLine) const
 {
-	auto oldPos = mState.mCursorPosition;
-	SetCursorPosition(Coordinates(mState.mCursorPosition.mLine, 0));
+	auto& advances = GetAdvances();
+	if ((!mMonospace && !advances.IsMonospace()) || !aLine.IsAscii(mTabSize))
+		return 0.0f;
+	return advances.Get(' ');
+}
 
-	if (mState.mCursorPosition != oldPos)
+// The width of the line in pixels, as TextDistanceToLineStart() gives it for its end.
+float TextEditor::GetLineWidth(const Line& aLine) const
+{
+	const float columnAdvance = GetColumnAdvance(aLine);
+	if (columnAdvance != 0.0f)
+		return aLine.GetMaxColumn(mTabSize) * columnAdvance;
+
+	// a long line is measured from its last checkpoint, of which only the ones after an edit are measured again
+	auto checkpoints = GetCheckpoints(aLine, true);
+	if (checkpoints == nullptr)
+		return TextDistance(aLine, 0, aLine.size(), 0.0f);
+	auto& last = checkpoints->mPoints.back();
+	return TextDistance(aLine, last.mIndex, aLine.size(), last.mX);
+}
+
+// The text runs of a short line, made again when the line, the font, the tab size or the colors changed.
+// A long line has none, it is laid out in each frame around the view.
+const std::vector<TextEditor::Line::TextRun>* TextEditor::GetTextRuns(const Line& aLine, float aColumnAdvance) const
+{
+	if (aLine.size() > Line::CheckpointInterval)
+		return nullptr;
+
+	auto runs = aLine.GetTextRuns();
+	if (runs == nullptr || runs->mFont != ImGui::GetFont() || runs->mFontSize != ImGui::GetFontSize() ||
+		runs->mTabSize != mTabSize || runs->mColumnAdvance != aColumnAdvance || runs->mPaletteVersion != mPaletteVersion)
 	{
-		if (aSelect)
-		{
-			if (oldPos == mInteractiveStart)
-				mInteractiveStart = mState.mCursorPosition;
-			else if (oldPos == mInteractiveEnd)
-				mInteractiveEnd = mState.mCursorPosition;
-			else
-			{
-				mInteractiveStart = mState.mCursorPosition;
-				mInteractiveEnd = oldPos;
-			}
-		}
-		else
-			mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
-		SetSelection(mInteractiveStart, mInteractiveEnd);
+		auto made = std::make_shared<Line::TextRuns>();
+		made->mFont = ImGui::GetFont();
+		made->mFontSize = ImGui::GetFontSize();
+		made->mTabSize = mTabSize;
+		made->mColumnAdvance = aColumnAdvance;
+		made->mPaletteVersion = mPaletteVersion;
+		MakeTextRuns(aLine, 0, aLine.size(), 0.0f, aColumnAdvance, made->mRuns);
+
+		runs = made;
+		aLine.SetTextRuns(made);
 	}
+	return &runs->mRuns;
 }
 
-void TextEditor::MoveEnd(bool aSelect)
+// Lays out the characters of aLine in [aFrom, aTo), starting at aX: the glyphs of the same color are
+// drawn as one run, straight from the line's characters, and the tabs and spaces on their own.
+// With aColumnAdvance (see GetColumnAdvance()) the positions are computed from the columns.
+void TextEditor::MakeTextRuns(const Line& aLine, int aFrom, int aTo, float aX, float aColumnAdvance, std::vector<Line::TextRun>& aRuns) const
 {
-	auto oldPos = mState.mCursorPosition;
-	SetCursorPosition(Coordinates(mState.mCursorPosition.mLine, GetLineMaxColumn(oldPos.mLine)));
-
-	if (mState.mCursorPosition != oldPos)
+	auto& advances = GetAdvances();
+	const float spaceSize = advances.Get(' ');
+	const float tabSize = float(mTabSize) * spaceSize;
+
+	// the color changes only at the start of a span
+	auto& spans = aLine.GetSpans();
+	auto span = aLine.FindSpan(aFrom);
+	auto color = span < 0 ? mPalette[(int)PaletteIndex::Default] : mSpanPalette[spans[span].mColor];
+	int spanEnd = span < 0 ? aTo : spans[span].mStart + spans[span].mLength;
+	auto prevColor = color;
+	int runStart = aFrom;
+	float x = aX;
+
+	for (int i = aFrom; i < aTo;)
 	{
-		if (aSelect)
+		auto c = aLine[i];
+		if (i >= spanEnd)
 		{
-			if (oldPos == mInteractiveEnd)
-				mInteractiveEnd = mState.mCursorPosition;
-			else if (oldPos == mInteractiveStart)
-				mInteractiveStart = mState.mCursorPosition;
-			else
+			while (span + 1 < (int)spans.size() && spans[span].mStart + spans[span].mLength <= i)
+				++span;
+			color = mSpanPalette[spans[span].mColor];
+			spanEnd = spans[span].mStart + spans[span].mLength;
+		}
+
+		if (color != prevColor || c == '\t' || c == ' ')
+		{
+			if (runStart < i)
 			{
-				mInteractiveStart = oldPos;
-				mInteractiveEnd = mState.mCursorPosition;
+				Line::TextRun run = { x, x, runStart, i, prevColor };
+				aRuns.push_back(run);
+				x += aColumnAdvance != 0.0f ? (i - runStart) * aColumnAdvance : advances.GetWidth(aLine.data() + runStart, aLine.data() + i);
 			}
+			runStart = i;
+		}
+		prevColor = color;
+
+		if (c == '\t')
+		{
+			Line::TextRun run = { x, (1.0f + std::floor((1.0f + x) / tabSize)) * tabSize, i, i, color };
+			aRuns.push_back(run);
+			x = run.mEndX;
+			runStart = ++i;
+		}
+		else if (c == ' ')
+		{
+			Line::TextRun run = { x, x + spaceSize, i, i, color };
+			aRuns.push_back(run);
+			x += spaceSize;
+			runStart = ++i;
 		}
 		else
-			mInteractiveStart = mInteractiveEnd = mState.mCursorPosition;
-		SetSelection(mInteractiveStart, mInteractiveEnd);
+		{
+			i = std::min(i + UTF8CharLength(c), aTo);
+		}
+	}
+
+	if (runStart < aTo)
+	{
+		Line::TextRun run = { x, x, runStart, aTo, prevColor };
+		aRuns.push_back(run);
 	}
 }
 
-void TextEditor::Delete()
+TextEditor::GlyphAdvances::GlyphAdvances()
+	: mFont(nullptr)
+	, mFontSize(0.0f)
+	, mMonospace(false)
 {
-	assert(!mReadOnly);
+	std::fill(mAscii, mAscii + 128, 0.0f);
+}
 
-	if (mLines.empty())
+void TextEditor::GlyphAdvances::Update(const ImFont* aFont, float aFontSize)
+{
+	if (aFont == mFont && aFontSize == mFontSize)
 		return;
 
-	UndoRecord u;
-	u.mBefore = mState;
+	mFont = aFont;
+	mFontSize = aFontSize;
+	mOthers.clear();
 
-	if (HasSelection())
+	// the null character ended the strings the characters were measured in before, it has no width
+	mAscii[0] = 0.0f;
+	for (int i = 1; i < 128; ++i)
 	{
-		u.mRemoved = GetSelectedText();
-		u.mRemovedStart = mState.mSelectionStart;
-		u.mRemovedEnd = mState.mSelectionEnd;
-
-		DeleteSelection();
+		const char c = (char)i;
+		mAscii[i] = aFont->CalcTextSizeA(aFontSize, FLT_MAX, -1.0f, &c, &c + 1, nullptr).x;
 	}
-	else
+
+	mMonospace = mAscii[' '] > 0.0f;
+	for (int i = ' ' + 1; i < 0x7f && mMonospace; ++i)
+		mMonospace = mAscii[i] == mAscii[' '];
+}
+
+float TextEditor::GlyphAdvances::GetWidth(const Char* aBegin, const Char* aEnd) const
+{
+	// summed from 0 in order, as CalcTextSizeA() does, so that the result is the same
+	float width = 0.0f;
+	for (auto p = aBegin; p < aEnd; )
 	{
-		auto pos = GetActualCursorCoordinates();
-		SetCursorPosition(pos);
-		auto& line = mLines[pos.mLine];
+		auto d = std::min(UTF8CharLength(*p), (int)(aEnd - p));
+		width += Get(p, d);
+		p += d;
+	}
+	return width;
+}
 
-		if (pos.mColumn == GetLineMaxColumn(pos.mLine))
+float TextEditor::GlyphAdvances::GetOther(const Char* aChar, int aLength) const
+{
+	auto key = (uint64_t)aLength << 56;
+	for (int i = 0; i < aLength; ++i)
+		key |= (uint64_t)aChar[i] << (8 * i);
+
+	auto it = mOthers.find(key);
+	if (it != mOthers.end())
+		return it->second;
+
+	auto width = mFont->CalcTextSizeA(mFontSize, FLT_MAX, -1.0f, (const char*)aChar, (const char*)aChar + aLength, nullptr).x;
+	mOthers.emplace(key, width);
+	return width;
+}
+
+// Returns the checkpoints of a long line, nullptr for a short one. Their positions are only measured
+// (with the current font) if aMeasured is set, as that needs an ImGui frame. After an edit, the checkpoints
+// before it are kept and the line is scanned again from the last of them to the first one after the edit.
+// The ones from there on are moved by as many characters and columns as it moved, if no tab after the edit
+// makes their columns differ. Their positions are moved as well if there are no tabs after it at all.
+const TextEditor::Line::Checkpoints* TextEditor::GetCheckpoints(const Line& aLine, bool aMeasured) const
+{
+	if (aLine.size() <= Line::CheckpointInterval)
+		return nullptr;
+
+	std::shared_ptr<Line::Checkpoints> made;
+	auto checkpoints = aLine.GetCheckpoints();
+	auto& edit = aLine.GetEdit();
+	if (checkpoints == nullptr || checkpoints->mTabSize != mTabSize || edit.mStart >= 0)
+	{
+		made = std::make_shared<Line::Checkpoints>();
+		made->mTabSize = mTabSize;
+		made->mFont = nullptr;
+		made->mFontSize = 0.0f;
+		made->mMeasured = 0;
+		made->mMoved = -1;
+
+		int i = 0;
+		int col = 0;
+		int next = 0;
+		auto scan = [&](int aEnd)
 		{
-			if (pos.mLine == (int)mLines.size() - 1)
-				return;
+			for (; i < aEnd; )
+			{
+				if (i >= next)
+				{
+					Line::Checkpoint checkpoint = { i, col, 0.0f };
+					made->mPoints.push_back(checkpoint);
+					next = i + Line::CheckpointInterval;
+				}
 
-			u.mRemoved = '\n';
-			u.mRemovedStart = u.mRemovedEnd = GetActualCursorCoordinates();
-			Advance(u.mRemovedEnd);
+				auto c = aLine[i];
+				if (c == '\t')
+					col = (col / mTabSize) * mTabSize + mTabSize;
+				else
+					col++;
+				i += UTF8CharLength(c);
+			}
+		};
 
-			auto& nextLine = mLines[pos.mLine + 1];
-			line.insert(line.end(), nextLine.begin(), nextLine.end());
-			RemoveLine(pos.mLine + 1);
-		}
-		else
+		if (checkpoints != nullptr && checkpoints->mTabSize == mTabSize)
 		{
-			auto cindex = GetCharacterIndex(pos);
-			u.mRemovedStart = u.mRemovedEnd = GetActualCursorCoordinates();
-			u.mRemovedEnd.mColumn++;
-			u.mRemoved = GetText(u.mRemovedStart, u.mRemovedEnd);
+			auto& points = checkpoints->mPoints;
+			auto kept = std::partition_point(points.begin(), points.end(), [&](const Line::Checkpoint& aPoint) { return aPoint.mIndex < edit.mStart; });
+			auto moved = std::partition_point(kept, points.end(), [&](const Line::Checkpoint& aPoint) { return aPoint.mIndex < edit.mEnd - edit.mDelta; });
+			made->mFont = checkpoints->mFont;
+			made->mFontSize = checkpoints->mFontSize;
+			made->mMeasured = std::min(checkpoints->mMeasured, (int)(kept - points.begin()));
+			if (kept != points.begin())
+			{
+				made->mPoints.assign(points.begin(), kept);
+				i = made->mPoints.back().mIndex;
+				col = made->mPoints.back().mColumn;
+				next = i + Line::CheckpointInterval;
+			}
 
-			auto d = UTF8CharLength(line[cindex].mChar);
-			while (d-- > 0 && cindex < (int)line.size())
-				line.erase(line.begin() + cindex);
+			if (moved != points.end())
+			{
+				const int to = moved->mIndex + edit.mDelta;
+				scan(std::min(to, aLine.size()));
+				const int columns = col - moved->mColumn;
+				const bool tabs = i == to && memchr(aLine.data() + i, '\t', aLine.size() - i) != nullptr;
+				if (i == to && (!tabs || columns % mTabSize == 0))
+				{
+					if (!tabs && checkpoints->mFont != nullptr && checkpoints->mMeasured == (int)points.size())
+						made->mMoved = (int)made->mPoints.size();
+					for (auto point = moved; point != points.end(); ++point)
+					{
+						Line::Checkpoint checkpoint = { point->mIndex + edit.mDelta, point->mColumn + columns, point->mX };
+						made->mPoints.push_back(checkpoint);
+					}
+					i = aLine.size();
+				}
+			}
 		}
 
-		mTextChanged = true;
+		scan(aLine.size());
+		checkpoints = made;
+	}
 
-		Colorize(pos.mLine, 1);
+	if (aMeasured && (checkpoints->mFont != ImGui::GetFont() || checkpoints->mFontSize != ImGui::GetFontSize() || checkpoints->mMeasured < (int)checkpoints->mPoints.size()))
+	{
+		if (made == nullptr)
+			made = std::make_shared<Line::Checkpoints>(*checkpoints);
+		if (made->mFont != ImGui::GetFont() || made->mFontSize != ImGui::GetFontSize())
+		{
+			made->mFont = ImGui::GetFont();
+			made->mFontSize = ImGui::GetFontSize();
+			made->mMeasured = 1;
+			made->mMoved = -1;
+		}
+
+		auto& points = made->mPoints;
+		for (size_t i = std::max(made->mMeasured, 1); i < points.size(); ++i)
+		{
+			auto x = TextDistance(aLine, points[i - 1].mIndex, points[i].mIndex, points[i - 1].mX);
+			if ((int)i == made->mMoved)
+			{
+				const float moved = x - points[i].mX;
+				for (; i < points.size(); ++i)
+					points[i].mX += moved;
+				break;
+			}
+			points[i].mX = x;
+		}
+		made->mMeasured = (int)points.size();
+		made->mMoved = -1;
 	}
 
-	u.mAfter = mState;
-	AddUndo(u);
+	if (made == nullptr)
+		return checkpoints.get();
+	aLine.SetCheckpoints(made);
+	return made.get();
 }
 
-void TextEditor::Backspace()
+void TextEditor::EnsureCursorVisible()
 {
-	assert(!mReadOnly);
-
-	if (mLines.empty())
+	if (!mWithinRender)
+	{
+		mScrollToCursor = true;
 		return;
+	}
 
-	UndoRecord u;
-	u.mBefore = mState;
+	float scrollX = ImGui::GetScrollX();
+	float scrollY = ImGui::GetScrollY();
 
-	if (HasSelection())
-	{
-		u.mRemoved = GetSelectedText();
-		u.mRemovedStart = mState.mSelectionStart;
-		u.mRemovedEnd = mState.mSelectionEnd;
+	auto height = ImGui::GetWindowHeight();
+	auto width = ImGui::GetWindowWidth();
 
-		DeleteSelection();
-	}
-	else
-	{
-		auto pos = GetActualCursorCoordinates();
-		SetCursorPosition(pos);
+	auto top = 1 + (int)ceil(scrollY / mCharAdvance.y);
+	auto bottom = (int)ceil((scrollY + height) / mCharAdvance.y);
 
-		if (mState.mCursorPosition.mColumn == 0)
-		{
-			if (mState.mCursorPosition.mLine == 0)
-				return;
+	auto left = (int)ceil(scrollX / mCharAdvance.x);
+	auto right = (int)ceil((scrollX + width) / mCharAdvance.x);
 
-			u.mRemoved = '\n';
-			u.mRemovedStart = u.mRemovedEnd = Coordinates(pos.mLine - 1, GetLineMaxColumn(pos.mLine - 1));
-			Advance(u.mRemovedEnd);
+	auto pos = GetActualCursorCoordinates();
+	auto len = TextDistanceToLineStart(pos);
 
-			auto& line = mLines[mState.mCursorPosition.mLine];
-			auto& prevLine = mLines[mState.mCursorPosition.mLine - 1];
-			auto prevSize = GetLineMaxColumn(mState.mCursorPosition.mLine - 1);
-			prevLine.insert(prevLine.end(), line.begin(), line.end());
+	if (pos.mLine < top)
+		ImGui::SetScrollY(std::max(0.0f, (pos.mLine - 1) * mCharAdvance.y));
+	if (pos.mLine > bottom - 4)
+		ImGui::SetScrollY(std::max(0.0f, (pos.mLine + 4) * mCharAdvance.y - height));
+	if (len + mTextStart < left + 4)
+		ImGui::SetScrollX(std::max(0.0f, len + mTextStart - 4));
+	if (len + mTextStart > right - 4)
+		ImGui::SetScrollX(std::max(0.0f, len + mTextStart + 4 - width));
+}
 
-			ErrorMarkers etmp;
-			for (auto& i : mErrorMarkers)
-				etmp.insert(ErrorMarkers::value_type(i.first - 1 == mState.mCursorPosition.mLine ? i.first - 1 : i.first, i.second));
-			mErrorMarkers = std::move(etmp);
+int TextEditor::GetPageSize() const
+{
+	auto height = ImGui::GetWindowHeight() - 20.0f;
+	return (int)floor(height / mCharAdvance.y);
+}
 
-			RemoveLine(mState.mCursorPosition.mLine);
-			--mState.mCursorPosition.mLine;
-			mState.mCursorPosition.mColumn = prevSize;
-		}
-		else
-		{
-			auto& line = mLines[mState.mCursorPosition.mLine];
-			auto cindex = GetCharacterIndex(pos) - 1;
-			auto cend = cindex + 1;
-			while (cindex > 0 && IsUTFSequence(line[cindex].mChar))
-				--cindex;
+TextEditor::UndoRecord::UndoRecord(
+	const std::string& aAdded,
+	const TextEditor::Coordinates aAddedStart,
+	const TextEditor::Coordinates aAddedEnd,
+	const std::string& aRemoved,
+	const TextEditor::Coordinates aRemovedStart,
+	const TextEditor::Coordinates aRemovedEnd,
+	TextEditor::EditorState& aBefore,
+	TextEditor::EditorState& aAfter)
+	: mAdded(aAdded)
+	, mAddedStart(aAddedStart)
+	, mAddedEnd(aAddedEnd)
+	, mRemoved(aRemoved)
+	, mRemovedStart(aRemovedStart)
+	, mRemovedEnd(aRemovedEnd)
+	, mBefore(aBefore)
+	, mAfter(aAfter)
+{
+	assert(mAddedStart <= mAddedEnd);
+	assert(mRemovedStart <= mRemovedEnd);
+}
 
-			//if (cindex > 0 && UTF8CharLength(line[cindex].mChar) > 1)
-			//	--cindex;
+void TextEditor::UndoRecord::Undo(TextEditor * aEditor)
+{
+	if (!mAdded.empty())
+	{
+		aEditor->DeleteRange(mAddedStart, mAddedEnd);
+		aEditor->Colorize(mAddedStart.mLine - 1, mAddedEnd.mLine - mAddedStart.mLine + 2);
+	}
 
-			u.mRemovedStart = u.mRemovedEnd = GetActualCursorCoordinates();
-			--u.mRemovedStart.mColumn;
-			--mState.mCursorPosition.mColumn;
+	if (!mRemoved.empty())
+	{
+		auto start = mRemovedStart;
+		aEditor->InsertTextAt(start, mRemoved.c_str());
+		aEditor->Colorize(mRemovedStart.mLine - 1, mRemovedEnd.mLine - mRemovedStart.mLine + 2);
+	}
+
+	aEditor->mState = mBefore;
+	aEditor->EnsureCursorVisible();
 
-			while (cindex < line.size() && cend-- > cindex)
-			{
-				u.mRemoved += line[cindex].mChar;
-				line.erase(line.begin() + cindex);
-			}
-		}
+}
 
-		mTextChanged = true;
+void TextEditor::UndoRecord::Redo(TextEditor * aEditor)
+{
+	if (!mRemoved.empty())
+	{
+		aEditor->DeleteRange(mRemovedStart, mRemovedEnd);
+		aEditor->Colorize(mRemovedStart.mLine - 1, mRemovedEnd.mLine - mRemovedStart.mLine + 1);
+	}
 
-		EnsureCursorVisible();
-		Colorize(mState.mCursorPosition.mLine, 1);
+	if (!mAdded.empty())
+	{
+		auto start = mAddedStart;
+		aEditor->InsertTextAt(start, mAdded.c_str());
+		aEditor->Colorize(mAddedStart.mLine - 1, mAddedEnd.mLine - mAddedStart.mLine + 1);
 	}
 
-	u.mAfter = mState;
-	AddUndo(u);
+	aEditor->mState = mAfter;
+	aEditor->EnsureCursorVisible();
 }
 
-void TextEditor::SelectWordUnderCursor()
+// The NFA of the token regexes (Thompson's construction), built by a recursive descent parser.
+struct TextEditor::TokenDFA::Nfa
 {
-	auto c = GetCursorPosition();
-	SetSelection(FindWordStart(c), FindWordEnd(c));
-}
+	typedef std::bitset<256> Set;
 
-void TextEditor::SelectAll()
-{
-	SetSelection(Coordinates(0, 0), Coordinates((int)mLines.size(), 0));
-}
+	struct State
+	{
+		int mSet;	// the index of the set of characters the state consumes, -1 for an empty transition
+		int mOut;
+		int mOut2;	// a second empty transition, -1 if there is none
+		int mRule;	// the regex matched on reaching the state, -1 if none
+	};
+
+	// A part of the NFA, its end is an empty state whose mOut is still to be connected
+	struct Fragment
+	{
+		int mStart;
+		int mEnd;
+	};
 
-bool TextEditor::HasSelection() const
-{
-	return mState.mSelectionEnd > mState.mSelectionStart;
-}
+	std::vector<State> mStates;
+	std::vector<Set> mSets;
+	const char* mPos;
+	const char* mEnd;
 
-void TextEditor::Copy()
-{
-	if (HasSelection())
+	int AddState(int aSet, int aOut, int aOut2)
 	{
-		ImGui::SetClipboardText(GetSelectedText().c_str());
+		State state = { aSet, aOut, aOut2, -1 };
+		mStates.push_back(state);
+		return (int)mStates.size() - 1;
 	}
-	else
+
+	Fragment Empty()
 	{
-		if (!mLines.empty())
-		{
-			std::string str;
-			auto& line = mLines[GetActualCursorCoordinates().mLine];
-			for (auto& g : line)
-				str.push_back(g.mChar);
-			ImGui::SetClipboardText(str.c_str());
-		}
+		auto state = AddState(-1, -1, -1);
+		Fragment result = { state, state };
+		return result;
 	}
-}
 
-void TextEditor::Cut()
-{
-	if (IsReadOnly())
+	Fragment Characters(const Set& aSet)
 	{
-		Copy();
+		mSets.push_back(aSet);
+		auto end = AddState(-1, -1, -1);
+		Fragment result = { AddState((int)mSets.size() - 1, end, -1), end };
+		return result;
 	}
-	else
+
+	void Append(Fragment& aTo, const Fragment& aFragment)
 	{
-		if (HasSelection())
-		{
-			UndoRecord u;
-			u.mBefore = mState;
-			u.mRemoved = GetSelectedText();
-			u.mRemovedStart = mState.mSelectionStart;
-			u.mRemovedEnd = mState.mSelectionEnd;
+		mStates[aTo.mEnd].mOut = aFragment.mStart;
+		aTo.mEnd = aFragment.mEnd;
+	}
 
-			Copy();
-			DeleteSelection();
+	Fragment Optional(const Fragment& aFragment)
+	{
+		auto end = AddState(-1, -1, -1);
+		mStates[aFragment.mEnd].mOut = end;
+		Fragment result = { AddState(-1, aFragment.mStart, end), end };
+		return result;
+	}
 
-			u.mAfter = mState;
-			AddUndo(u);
-		}
+	Fragment Repeat(const Fragment& aFragment)
+	{
+		auto end = AddState(-1, -1, -1);
+		mStates[aFragment.mEnd].mOut = aFragment.mStart;
+		mStates[aFragment.mEnd].mOut2 = end;
+		Fragment result = { AddState(-1, aFragment.mStart, end), end };
+		return result;
 	}
-}
 
-void TextEditor::Paste()
+	bool ParseAlternatives(Fragment& aResult);
+	bool ParseSequence(Fragment& aResult);
+	bool ParseRepetition(Fragment& aResult);
+	bool ParseAtom(Fragment& aResult);
+	bool ParseClass(Set& aSet);
+	bool ParseClassAtom(int& aChar, Set& aSet);
+	bool ParseEscape(int& aChar, Set& aSet, bool aInClass);
+	bool ParseCount(int& aValue);
+};
+
+bool TextEditor::TokenDFA::Nfa::ParseAlternatives(Fragment& aResult)
 {
-	if (IsReadOnly())
-		return;
+	if (!ParseSequence(aResult))
+		return false;
 
-	auto clipText = ImGui::GetClipboardText();
-	if (clipText != nullptr && strlen(clipText) > 0)
+	while (mPos != mEnd && *mPos == '|')
 	{
-		UndoRecord u;
-		u.mBefore = mState;
-
-		if (HasSelection())
-		{
-			u.mRemoved = GetSelectedText();
-			u.mRemovedStart = mState.mSelectionStart;
-			u.mRemovedEnd = mState.mSelectionEnd;
-			DeleteSelection();
-		}
+		++mPos;
 
-		u.mAdded = clipText;
-		u.mAddedStart = GetActualCursorCoordinates();
-
-		InsertText(clipText);
+		Fragment other;
+		if (!ParseSequence(other))
+			return false;
 
-		u.mAddedEnd = GetActualCursorCoordinates();
-		u.mAfter = mState;
-		AddUndo(u);
+		auto end = AddState(-1, -1, -1);
+		mStates[aResult.mEnd].mOut = end;
+		mStates[other.mEnd].mOut = end;
+		aResult.mStart = AddState(-1, aResult.mStart, other.mStart);
+		aResult.mEnd = end;
 	}
+	return true;
 }
 
-bool TextEditor::CanUndo() const
+bool TextEditor::TokenDFA::Nfa::ParseSequence(Fragment& aResult)
 {
-	return !mReadOnly && mUndoIndex > 0;
+	aResult = Empty();
+	while (mPos != mEnd && *mPos != '|' && *mPos != ')')
+	{
+		Fragment next;
+		if (!ParseRepetition(next))
+			return false;
+		Append(aResult, next);
+	}
+	return true;
 }
 
-bool TextEditor::CanRedo() const
+bool TextEditor::TokenDFA::Nfa::ParseRepetition(Fragment& aResult)
 {
-	return !mReadOnly && mUndoIndex < (int)mUndoBuffer.size();
-}
+	auto atom = mPos;
+	if (!ParseAtom(aResult))
+		return false;
+	if (mPos == mEnd)
+		return true;
 
-void TextEditor::Undo(int aSteps)
-{
-	while (CanUndo() && aSteps-- > 0)
-		mUndoBuffer[--mUndoIndex].Undo(this);
-}
+	int minCount = 1, maxCount = 1;
+	switch (*mPos)
+	{
+	case '*': minCount = 0; maxCount = -1; ++mPos; break;
+	case '+': minCount = 1; maxCount = -1; ++mPos; break;
+	case '?': minCount = 0; maxCount = 1; ++mPos; break;
+	case '{':
+		++mPos;
+		if (!ParseCount(minCount))
+			return false;
+		maxCount = minCount;
+		if (mPos != mEnd && *mPos == ',')
+		{
+			++mPos;
+			maxCount = -1;
+			if (mPos != mEnd && *mPos != '}' && (!ParseCount(maxCount) || maxCount < minCount))
+				return false;
+		}
+		if (mPos == mEnd || *mPos != '}')
+			return false;
+		++mPos;
+		break;
+	default:
+		return true;
+	}
 
-void TextEditor::Redo(int aSteps)
-{
-	while (CanRedo() && aSteps-- > 0)
-		mUndoBuffer[mUndoIndex++].Redo(this);
+	// lazy repetitions don't match the longest text
+	if (mPos != mEnd && *mPos == '?')
+		return false;
+
+	// each repetition of the atom is a copy of it, made by parsing it again
+	auto after = mPos;
+	auto first = aResult;
+	auto count = 0;
+	auto copy = [&]() -> Fragment
+	{
+		if (count++ == 0)
+			return first;
+		mPos = atom;
+		Fragment result;
+		ParseAtom(result);
+		return result;
+	};
+
+	aResult = Empty();
+	for (int i = 0; i < minCount; ++i)
+		Append(aResult, copy());
+	if (maxCount == -1)
+		Append(aResult, Repeat(copy()));
+	for (int i = minCount; i < maxCount; ++i)
+		Append(aResult, Optional(copy()));
+	mPos = after;
+	return true;
 }
 
-const TextEditor::Palette & TextEditor::GetDarkPalette()
+bool TextEditor::TokenDFA::Nfa::ParseCount(int& aValue)
 {
-	const static Palette p = { {
-			0xff7f7f7f,	// Default
-			0xffd69c56,	// Keyword	
-			0xff00ff00,	// Number
-			0xff7070e0,	// String
-			0xff70a0e0, // Char literal
-			0xffffffff, // Punctuation
-			0xff408080,	// Preprocessor
-			0xffaaaaaa, // Identifier
-			0xff9bc64d, // Known identifier
-			0xffc040a0, // Preproc identifier
-			0xff206020, // Comment (single line)
-			0xff406020, // Comment (multi line)
-			0xff101010, // Background
-			0xffe0e0e0, // Cursor
-			0x80a06020, // Selection
-			0x800020ff, // ErrorMarker
-			0x40f08000, // Breakpoint
-			0xff707000, // Line number
-			0x40000000, // Current line fill
-			0x40808080, // Current line fill (inactive)
-			0x40a0a0a0, // Current line edge
-		} };
-	return p;
+	if (mPos == mEnd || !isdigit((uint8_t)*mPos))
+		return false;
+
+	aValue = 0;
+	while (mPos != mEnd && isdigit((uint8_t)*mPos))
+	{
+		aValue = aValue * 10 + (*mPos++ - '0');
+		if (aValue > 256)
+			return false;
+	}
+	return true;
 }
 
-const TextEditor::Palette & TextEditor::GetLightPalette()
+bool TextEditor::TokenDFA::Nfa::ParseAtom(Fragment& aResult)
 {
-	const static Palette p = { {
-			0xff7f7f7f,	// None
-			0xffff0c06,	// Keyword	
-			0xff008000,	// Number
-			0xff2020a0,	// String
-			0xff304070, // Char literal
-			0xff000000, // Punctuation
-			0xff406060,	// Preprocessor
-			0xff404040, // Identifier
-			0xff606010, // Known identifier
-			0xffc040a0, // Preproc identifier
-			0xff205020, // Comment (single line)
-			0xff405020, // Comment (multi line)
-			0xffffffff, // Background
-			0xff000000, // Cursor
-			0x80600000, // Selection
-			0xa00010ff, // ErrorMarker
-			0x80f08000, // Breakpoint
-			0xff505000, // Line number
-			0x40000000, // Current line fill
-			0x40808080, // Current line fill (inactive)
-			0x40000000, // Current line edge
-		} };
-	return p;
+	Set set;
+	int c = -1;
+
+	switch (*mPos)
+	{
+	case '(':
+		++mPos;
+		if (mPos != mEnd && *mPos == '?')
+		{
+			// only non-capturing groups, no lookaheads
+			if (mPos + 1 == mEnd || mPos[1] != ':')
+				return false;
+			mPos += 2;
+		}
+		if (!ParseAlternatives(aResult) || mPos == mEnd || *mPos != ')')
+			return false;
+		++mPos;
+		return true;
+	case '[':
+		++mPos;
+		if (!ParseClass(set))
+			return false;
+		break;
+	case '.':
+		++mPos;
+		set.set();
+		set.reset('\n');
+		set.reset('\r');
+		break;
+	case '\\':
+		++mPos;
+		if (!ParseEscape(c, set, false))
+			return false;
+		break;
+	case '^':
+	case '$':
+	case '*':
+	case '+':
+	case '?':
+	case '{':
+		return false;
+	default:
+		c = (uint8_t)*mPos++;
+		break;
+	}
+
+	if (c >= 0)
+		set.set(c);
+	aResult = Characters(set);
+	return true;
 }
 
-const TextEditor::Palette & TextEditor::GetRetroBluePalette()
+bool TextEditor::TokenDFA::Nfa::ParseClass(Set& aSet)
 {
-	const static Palette p = { {
-			0xff00ffff,	// None
-			0xffffff00,	// Keyword	
-			0xff00ff00,	// Number
-			0xff808000,	// String
-			0xff808000, // Char literal
-			0xffffffff, // Punctuation
-			0xff008000,	// Preprocessor
-			0xff00ffff, // Identifier
-			0xffffffff, // Known identifier
-			0xffff00ff, // Preproc identifier
-			0xff808080, // Comment (single line)
-			0xff404040, // Comment (multi line)
-			0xff800000, // Background
-			0xff0080ff, // Cursor
-			0x80ffff00, // Selection
-			0xa00000ff, // ErrorMarker
-			0x80ff8000, // Breakpoint
-			0xff808000, // Line number
-			0x40000000, // Current line fill
-			0x40808080, // Current line fill (inactive)
-			0x40000000, // Current line edge
-		} };
-	return p;
-}
+	auto negate = mPos != mEnd && *mPos == '^';
+	if (negate)
+		++mPos;
 
+	while (mPos != mEnd && *mPos != ']')
+	{
+		int from, to;
+		Set set;
+		if (!ParseClassAtom(from, set))
+			return false;
 
-std::string TextEditor::GetText() const
-{
-	return GetText(Coordinates(), Coordinates((int)mLines.size(), 0));
+		if (from >= 0 && mEnd - mPos >= 2 && *mPos == '-' && mPos[1] != ']')
+		{
+			++mPos;
+			if (!ParseClassAtom(to, set) || to < from)
+				return false;
+			for (int c = from; c <= to; ++c)
+				aSet.set(c);
+		}
+		else if (from >= 0)
+			aSet.set(from);
+		else
+			aSet |= set;
+	}
+
+	if (mPos == mEnd)
+		return false;
+	++mPos;
+
+	if (negate)
+		aSet.flip();
+	return true;
 }
 
-std::vector<std::string> TextEditor::GetTextLines() const
+bool TextEditor::TokenDFA::Nfa::ParseClassAtom(int& aChar, Set& aSet)
 {
-	std::vector<std::string> result;
-
-	result.reserve(mLines.size());
-
-	for (auto & line : mLines)
+	aChar = -1;
+	if (*mPos == '\\')
 	{
-		std::string text;
-
-		text.resize(line.size());
-
-		for (size_t i = 0; i < line.size(); ++i)
-			text[i] = line[i].mChar;
-
-		result.emplace_back(std::move(text));
+		++mPos;
+		return ParseEscape(aChar, aSet, true);
 	}
 
-	return result;
-}
+	// no POSIX classes
+	if (*mPos == '[' && mPos + 1 != mEnd && (mPos[1] == ':' || mPos[1] == '=' || mPos[1] == '.'))
+		return false;
 
-std::string TextEditor::GetSelectedText() const
-{
-	return GetText(mState.mSelectionStart, mState.mSelectionEnd);
+	aChar = (uint8_t)*mPos++;
+	return true;
 }
 
-std::string TextEditor::GetCurrentLineText()const
+// Parses the escape after a backslash, which is either a single character (aChar) or a set of them.
+bool TextEditor::TokenDFA::Nfa::ParseEscape(int& aChar, Set& aSet, bool aInClass)
 {
-	auto lineLength = GetLineMaxColumn(mState.mCursorPosition.mLine);
-	return GetText(
-		Coordinates(mState.mCursorPosition.mLine, 0),
-		Coordinates(mState.mCursorPosition.mLine, lineLength));
-}
+	if (mPos == mEnd)
+		return false;
 
-void TextEditor::ProcessInputs()
-{
+	aChar = -1;
+	auto c = (uint8_t)*mPos++;
+	switch (c)
+	{
+	case 'd':
+	case 'D':
+		for (int i = '0'; i <= '9'; ++i)
+			aSet.set(i);
+		break;
+	case 'w':
+	case 'W':
+		for (int i = 0; i < 128; ++i)
+			if (isalnum(i) || i == '_')
+				aSet.set(i);
+		break;
+	case 's':
+	case 'S':
+		for (auto i : { ' ', '\t', '\n', '\r', '\f', '\v' })
+			aSet.set(i);
+		break;
+	case 't': aChar = '\t'; return true;
+	case 'n': aChar = '\n'; return true;
+	case 'r': aChar = '\r'; return true;
+	case 'f': aChar = '\f'; return true;
+	case 'v': aChar = '\v'; return true;
+	case '0':
+		if (mPos != mEnd && isdigit((uint8_t)*mPos))
+			return false;
+		aChar = 0;
+		return true;
+	case 'x':
+		if (mEnd - mPos < 2 || !isxdigit((uint8_t)mPos[0]) || !isxdigit((uint8_t)mPos[1]))
+			return false;
+		aChar = (int)strtol(std::string(mPos, mPos + 2).c_str(), nullptr, 16);
+		mPos += 2;
+		return true;
+	case 'b':
+		// a backspace in a class, a word boundary (which is not supported) outside
+		aChar = '\b';
+		return aInClass;
+	default:
+		// no backreferences, control, unicode or other assertion escapes
+		if (isalnum(c))
+			return false;
+		aChar = c;
+		return true;
+	}
+
+	if (isupper(c))
+		aSet.flip();
+	return true;
 }
 
-void TextEditor::Colorize(int aFromLine, int aLines)
+void TextEditor::TokenDFA::clear()
 {
-	int toLine = aLines == -1 ? (int)mLines.size() : std::min((int)mLines.size(), aFromLine + aLines);
-	mColorRangeMin = std::min(mColorRangeMin, aFromLine);
-	mColorRangeMax = std::max(mColorRangeMax, toLine);
-	mColorRangeMin = std::max(0, mColorRangeMin);
-	mColorRangeMax = std::max(mColorRangeMin, mColorRangeMax);
-	mCheckComments = true;
+	mClassCount = 0;
+	mTransitions.clear();
+	mAccepting.clear();
+	mColors.clear();
 }
 
-void TextEditor::ColorizeRange(int aFromLine, int aToLine)
+bool TextEditor::TokenDFA::Compile(const LanguageDefinition::TokenRegexStrings& aRegexes)
 {
-	if (mLines.empty() || aFromLine >= aToLine)
-		return;
-
-	std::string buffer;
-	std::cmatch results;
-	std::string id;
+	clear();
+	if (aRegexes.size() > MaxRules)
+		return false;
 
-	int endLine = std::max(0, std::min((int)mLines.size(), aToLine));
-	for (int i = aFromLine; i < endLine; ++i)
+	Nfa nfa;
+	std::vector<int> starts;
+	for (auto& r : aRegexes)
 	{
-		auto& line = mLines[i];
-
-		if (line.empty())
-			continue;
-
-		buffer.resize(line.size());
-		for (size_t j = 0; j < line.size(); ++j)
+		Nfa::Fragment fragment;
+		nfa.mPos = r.first.data();
+		nfa.mEnd = nfa.mPos + r.first.size();
+		if (!nfa.ParseAlternatives(fragment) || nfa.mPos != nfa.mEnd)
 		{
-			auto& col = line[j];
-			buffer[j] = col.mChar;
-			col.mColorIndex = PaletteIndex::Default;
+			clear();
+			return false;
 		}
 
-		const char * bufferBegin = &buffer.front();
-		const char * bufferEnd = bufferBegin + buffer.size();
+		auto accept = nfa.AddState(-1, -1, -1);
+		nfa.mStates[accept].mRule = (int)mColors.size();
+		nfa.mStates[fragment.mEnd].mOut = accept;
+		starts.push_back(fragment.mStart);
+		mColors.push_back(r.second);
+	}
 
-		auto last = bufferEnd;
+	// characters in the same sets are in the same class
+	std::map<std::vector<bool>, int> classes;
+	std::vector<int> representatives;
+	for (int c = 0; c < 256; ++c)
+	{
+		std::vector<bool> key;
+		for (auto& set : nfa.mSets)
+			key.push_back(set.test(c));
+		auto it = classes.insert(std::make_pair(key, (int)classes.size())).first;
+		if (it->second == (int)representatives.size())
+			representatives.push_back(c);
+		mClasses[c] = (uint8_t)it->second;
+	}
+	mClassCount = (int)classes.size();
 
-		for (auto first = bufferBegin; first != last; )
+	// subset construction, a state of the DFA is the set of the NFA states which consume a character or accept
+	std::vector<int> marks(nfa.mStates.size(), -1);
+	int markGeneration = 0;
+	std::vector<int> stack;
+	auto closure = [&](std::vector<int>& aStates)
+	{
+		++markGeneration;
+		stack = aStates;
+		aStates.clear();
+		while (!stack.empty())
 		{
-			const char * token_begin = nullptr;
-			const char * token_end = nullptr;
-			PaletteIndex token_color = PaletteIndex::Default;
-
-			bool hasTokenizeResult = false;
-
-			if (mLanguageDefinition.mTokenize != nullptr)
+			auto index = stack.back();
+			stack.pop_back();
+			if (index < 0 || marks[index] == markGeneration)
+				continue;
+			marks[index] = markGeneration;
+
+			auto& state = nfa.mStates[index];
+			if (state.mSet >= 0 || state.mRule >= 0)
+				aStates.push_back(index);
+			if (state.mSet < 0)
 			{
-				if (mLanguageDefinition.mTokenize(first, last, token_begin, token_end, token_color))
-					hasTokenizeResult = true;
+				stack.push_back(state.mOut);
+				stack.push_back(state.mOut2);
 			}
+		}
+		std::sort(aStates.begin(), aStates.end());
+	};
 
-			if (hasTokenizeResult == false)
-			{
-				// todo : remove
-				//printf("using regex for %.*s\n", first + 10 < last ? 10 : int(last - first), first);
-
-				for (auto& p : mRegexList)
-				{
-					if (std::regex_search(first, last, results, p.first, std::regex_constants::match_continuous))
-					{
-						hasTokenizeResult = true;
+	std::map<std::vector<int>, int> ids;
+	std::vector<std::vector<int>> states;
+	states.push_back(starts);
+	closure(states.back());
+	ids[states.back()] = 0;
 
-						auto& v = *results.begin();
-						token_begin = v.first;
-						token_end = v.second;
-						token_color = p.second;
-						break;
-					}
-				}
-			}
+	for (size_t i = 0; i < states.size(); ++i)
+	{
+		uint32_t accepting = 0;
+		for (auto index : states[i])
+		{
+			if (nfa.mStates[index].mRule >= 0)
+				accepting |= 1u << nfa.mStates[index].mRule;
+		}
+		mAccepting.push_back(accepting);
 
-			if (hasTokenizeResult == false)
+		for (int k = 0; k < mClassCount; ++k)
+		{
+			std::vector<int> next;
+			for (auto index : states[i])
 			{
-				first++;
+				auto& state = nfa.mStates[index];
+				if (state.mSet >= 0 && nfa.mSets[state.mSet].test(representatives[k]))
+					next.push_back(state.mOut);
 			}
-			else
-			{
-				const size_t token_length = token_end - token_begin;
+			closure(next);
 
-				if (token_color == PaletteIndex::Identifier)
+			auto target = -1;
+			if (!next.empty())
+			{
+				auto it = ids.insert(std::make_pair(next, (int)states.size())).first;
+				if (it->second == (int)states.size())
 				{
-					id.assign(token_begin, token_end);
-
-					// todo : allmost all language definitions use lower case to specify keywords, so shouldn't this use ::tolower ?
-					if (!mLanguageDefinition.mCaseSensitive)
-						std::transform(id.begin(), id.end(), id.begin(), ::toupper);
-
-					if (!line[first - bufferBegin].mPreprocessor)
-					{
-						if (mLanguageDefinition.mKeywords.count(id) != 0)
-							token_color = PaletteIndex::Keyword;
-						else if (mLanguageDefinition.mIdentifiers.count(id) != 0)
-							token_color = PaletteIndex::KnownIdentifier;
-						else if (mLanguageDefinition.mPreprocIdentifiers.count(id) != 0)
-							token_color = PaletteIndex::PreprocIdentifier;
-					}
-					else
+					if (states.size() == MaxStates)
 					{
-						if (mLanguageDefinition.mPreprocIdentifiers.count(id) != 0)
-							token_color = PaletteIndex::PreprocIdentifier;
+						clear();
+						return false;
 					}
+					states.push_back(next);
 				}
-
-				for (size_t j = 0; j < token_length; ++j)
-					line[(token_begin - bufferBegin) + j].mColorIndex = token_color;
-
-				first = token_end;
+				target = it->second;
 			}
+			mTransitions.push_back(target);
 		}
 	}
+	return true;
 }
 
-void TextEditor::ColorizeInternal()
+bool TextEditor::TokenDFA::Match(const char* in_begin, const char* in_end, const char*& out_begin, const char*& out_end, PaletteIndex& paletteIndex) const
 {
-	if (mLines.empty() || !mColorizerEnabled)
-		return;
+	if (empty())
+		return false;
 
-	if (mCheckComments)
+	// the longest match of the first regex matching anything
+	int state = 0;
+	uint32_t first = 0;		// the bit of that regex
+	const char* end = nullptr;
+	for (auto p = in_begin; p != in_end; )
 	{
-		auto endLine = mLines.size();
-		auto endIndex = 0;
-		auto commentStartLine = endLine;
-		auto commentStartIndex = endIndex;
-		auto withinString = false;
-		auto withinSingleLineComment = false;
-		auto withinPreproc = false;
-		auto firstChar = true;			// there is no other non-whitespace characters in the line before
-		auto concatenate = false;		// '\' on the very end of the line
-		auto currentLine = 0;
-		auto currentIndex = 0;
-		while (currentLine < endLine || currentIndex < endIndex)
-		{
-			auto& line = mLines[currentLine];
+		state = mTransitions[state * mClassCount + mClasses[(uint8_t)*p]];
+		if (state < 0)
+			break;
+		++p;
 
-			if (currentIndex == 0 && !concatenate)
-			{
-				withinSingleLineComment = false;
-				withinPreproc = false;
-				firstChar = true;
-			}
+		auto before = mAccepting[state] & (first - 1);
+		if (before != 0)
+		{
+			first = before & (~before + 1);
+			end = p;
+		}
+		else if (mAccepting[state] & first)
+			end = p;
+	}
 
-			concatenate = false;
+	if (end == nullptr)
+		return false;
 
-			if (!line.empty())
-			{
-				auto& g = line[currentIndex];
-				auto c = g.mChar;
+	int rule = 0;
+	while ((first >> rule) != 1)
+		++rule;
 
-				if (c != mLanguageDefinition.mPreprocChar && !isspace(c))
-					firstChar = false;
+	out_begin = in_begin;
+	out_end = end;
+	paletteIndex = mColors[rule];
+	return true;
+}
 
-				if (currentIndex == (int)line.size() - 1 && line[line.size() - 1].mChar == '\\')
-					concatenate = true;
+// FNV-1a of the characters, upper-cased (as ::toupper does in the "C" locale) if the language is not case sensitive.
+uint64_t TextEditor::IdentifierClassifier::Hash(const char* aBegin, const char* aEnd) const
+{
+	uint64_t hash = 14695981039346656037ull ^ mSeed;
+	for (auto p = aBegin; p != aEnd; ++p)
+	{
+		auto c = (uint8_t)*p;
+		if (!mCaseSensitive && c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		hash = (hash ^ c) * 1099511628211ull;
+	}
+	return hash;
+}
 
-				bool inComment = (commentStartLine < currentLine || (commentStartLine == currentLine && commentStartIndex <= currentIndex));
+uint32_t TextEditor::IdentifierClassifier::Slot(uint64_t aHash) const
+{
+	// the bucket comes from the high bits, the two values the displacement combines from a mix of all of them
+	auto bucket = (uint32_t)(aHash >> 40) & mBucketMask;
+	auto mixed = (aHash ^ (aHash >> 31)) * 0xbf58476d1ce4e5b9ull;
+	mixed ^= mixed >> 29;
+	return ((uint32_t)mixed + mDisplacements[bucket] * ((uint32_t)(mixed >> 32) | 1)) & mMask;
+}
 
-				if (withinString)
-				{
-					line[currentIndex].mMultiLineComment = inComment;
+// The number of seeds tried for a perfect table before falling back to probing.
+static const int MaxSeeds = 64;
 
-					if (c == '\"')
-					{
-						if (currentIndex + 1 < (int)line.size() && line[currentIndex + 1].mChar == '\"')
-						{
-							currentIndex += 1;
-							if (currentIndex < (int)line.size())
-								line[currentIndex].mMultiLineComment = inComment;
-						}
-						else
-							withinString = false;
-					}
-					else if (c == '\\')
-					{
-						currentIndex += 1;
-						if (currentIndex < (int)line.size())
-							line[currentIndex].mMultiLineComment = inComment;
-					}
-				}
-				else
-				{
-					if (firstChar && c == mLanguageDefinition.mPreprocChar)
-						withinPreproc = true;
+void TextEditor::IdentifierClassifier::Build(const LanguageDefinition& aLanguage)
+{
+	// one entry for each name, colored as it would be by the first set it is found in. The names of a
+	// language which is not case sensitive are kept upper-cased, as they are hashed and compared.
+	std::vector<Entry> entries;
+	std::unordered_map<std::string, size_t> found;
+	mCaseSensitive = aLanguage.mCaseSensitive;
+	mCharacters.clear();
+	auto add = [&](const std::string& aName, PaletteIndex aColor, bool aPreproc)
+	{
+		if (aName.empty() || aName.size() > 0xffff)
+			return;
+		auto name = aName;
+		if (!mCaseSensitive)
+		{
+			for (auto& c : name)
+				if (c >= 'a' && c <= 'z')
+					c -= 'a' - 'A';
+		}
+		auto it = found.find(name);
+		if (it == found.end())
+		{
+			Entry entry = { (uint32_t)mCharacters.size(), (uint16_t)name.size(), aColor, aPreproc };
+			mCharacters += name;
+			found[name] = entries.size();
+			entries.push_back(entry);
+		}
+		else if (aPreproc)
+			entries[it->second].mPreprocIdentifier = true;
+	};
+	for (auto& k : aLanguage.mKeywords)
+		add(k, PaletteIndex::Keyword, false);
+	for (auto& k : aLanguage.mIdentifiers)
+		add(k.first, PaletteIndex::KnownIdentifier, false);
+	for (auto& k : aLanguage.mPreprocIdentifiers)
+		add(k.first, PaletteIndex::PreprocIdentifier, true);
+
+	mMinLength = std::numeric_limits<int>::max();
+	mMaxLength = 0;
+	for (auto& entry : entries)
+	{
+		mMinLength = std::min(mMinLength, (int)entry.mLength);
+		mMaxLength = std::max(mMaxLength, (int)entry.mLength);
+	}
 
-					if (c == '\"')
-					{
-						withinString = true;
-						line[currentIndex].mMultiLineComment = inComment;
-					}
-					else
-					{
-						auto pred = [](const char& a, const Glyph& b) { return a == b.mChar; };
-						auto from = line.begin() + currentIndex;
-						auto& startStr = mLanguageDefinition.mCommentStart;
-						auto& singleStartStr = mLanguageDefinition.mSingleLineComment;
-
-						if (singleStartStr.size() > 0 &&
-							currentIndex + singleStartStr.size() <= line.size() &&
-							equals(singleStartStr.begin(), singleStartStr.end(), from, from + singleStartStr.size(), pred))
-						{
-							withinSingleLineComment = true;
-						}
-						else if (!withinSingleLineComment && currentIndex + startStr.size() <= line.size() &&
-							equals(startStr.begin(), startStr.end(), from, from + startStr.size(), pred))
-						{
-							commentStartLine = currentLine;
-							commentStartIndex = currentIndex;
-						}
+	// about four names in a bucket, and a quarter more slots than names
+	uint32_t slots = 16, buckets = 4;
+	while (slots < entries.size() + entries.size() / 4)
+		slots *= 2;
+	while (buckets * 4 < entries.size())
+		buckets *= 2;
+	mMask = slots - 1;
+	mBucketMask = buckets - 1;
+
+	std::vector<uint64_t> hashes(entries.size());
+	std::vector<std::vector<int>> bucketEntries(buckets);
+	std::vector<uint32_t> order(buckets);
+	std::vector<uint32_t> placed;
+	for (uint64_t attempt = 0; attempt < MaxSeeds; ++attempt)
+	{
+		mSeed = attempt * 0x9e3779b97f4a7c15ull;
+		for (auto& b : bucketEntries)
+			b.clear();
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			auto begin = mCharacters.data() + entries[i].mOffset;
+			hashes[i] = Hash(begin, begin + entries[i].mLength);
+			bucketEntries[(uint32_t)(hashes[i] >> 40) & mBucketMask].push_back((int)i);
+		}
 
-						inComment = inComment = (commentStartLine < currentLine || (commentStartLine == currentLine && commentStartIndex <= currentIndex));
+		// the fullest buckets are placed first, while most slots are free
+		for (uint32_t b = 0; b < buckets; ++b)
+			order[b] = b;
+		std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return bucketEntries[a].size() > bucketEntries[b].size(); });
 
-						line[currentIndex].mMultiLineComment = inComment;
-						line[currentIndex].mComment = withinSingleLineComment;
+		mEntries.assign(slots, Entry());
+		mDisplacements.assign(buckets, 0);
+		bool perfect = true;
+		for (auto b : order)
+		{
+			auto& names = bucketEntries[b];
+			if (names.empty())
+				break;
 
-						auto& endStr = mLanguageDefinition.mCommentEnd;
-						if (currentIndex + 1 >= (int)endStr.size() &&
-							equals(endStr.begin(), endStr.end(), from + 1 - endStr.size(), from + 1, pred))
-						{
-							commentStartIndex = endIndex;
-							commentStartLine = endLine;
-						}
-					}
-				}
-				line[currentIndex].mPreprocessor = withinPreproc;
-				currentIndex += UTF8CharLength(c);
-				if (currentIndex >= (int)line.size())
+			bool fits = false;
+			for (uint32_t d = 0; d <= 0xffff && !fits; ++d)
+			{
+				mDisplacements[b] = (uint16_t)d;
+				placed.clear();
+				fits = true;
+				for (auto i : names)
 				{
-					currentIndex = 0;
-					++currentLine;
+					auto slot = Slot(hashes[i]);
+					if (mEntries[slot].mLength != 0 || std::find(placed.begin(), placed.end(), slot) != placed.end())
+					{
+						fits = false;
+						break;
+					}
+					placed.push_back(slot);
 				}
 			}
-			else
+			if (!fits)
 			{
-				currentIndex = 0;
-				++currentLine;
+				perfect = false;
+				break;
 			}
+			for (size_t k = 0; k < names.size(); ++k)
+				mEntries[placed[k]] = entries[names[k]];
 		}
-		mCheckComments = false;
+		if (perfect)
+			return;
 	}
 
-	if (mColorRangeMin < mColorRangeMax)
+	// no seed gave a perfect table: the names are looked up by probing from their hash instead
+	mSeed = 0;
+	mDisplacements.clear();
+	mEntries.assign(slots, Entry());
+	for (auto& entry : entries)
 	{
-		const int increment = (mLanguageDefinition.mTokenize == nullptr) ? 10 : 10000;
-		const int to = std::min(mColorRangeMin + increment, mColorRangeMax);
-		ColorizeRange(mColorRangeMin, to);
-		mColorRangeMin = to;
-
-		if (mColorRangeMax == mColorRangeMin)
-		{
-			mColorRangeMin = std::numeric_limits<int>::max();
-			mColorRangeMax = 0;
-		}
-		return;
+		auto begin = mCharacters.data() + entry.mOffset;
+		auto slot = (uint32_t)Hash(begin, begin + entry.mLength) & mMask;
+		while (mEntries[slot].mLength != 0)
+			slot = (slot + 1) & mMask;
+		mEntries[slot] = entry;
 	}
 }
 
-float TextEditor::TextDistanceToLineStart(const Coordinates& aFrom) const
+bool TextEditor::IdentifierClassifier::Equals(const Entry& aEntry, const char* aBegin, int aLength) const
 {
-	auto& line = mLines[aFrom.mLine];
-	float distance = 0.0f;
-	float spaceSize = ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, " ", nullptr, nullptr).x;
-	int colIndex = GetCharacterIndex(aFrom);
-	for (size_t it = 0u; it < line.size() && it < colIndex; )
-	{
-		if (line[it].mChar == '\t')
-		{
-			distance = (1.0f + std::floor((1.0f + distance) / (float(mTabSize) * spaceSize))) * (float(mTabSize) * spaceSize);
-			++it;
-		}
-		else
-		{
-			auto d = UTF8CharLength(line[it].mChar);
-			char tempCString[7];
-			int i = 0;
-			for (; i < 6 && d-- > 0 && it < (int)line.size(); i++, it++)
-				tempCString[i] = line[it].mChar;
+	if (aEntry.mLength != aLength)
+		return false;
 
-			tempCString[i] = '\0';
-			distance += ImGui::GetFont()->CalcTextSizeA(ImGui::GetFontSize(), FLT_MAX, -1.0f, tempCString, nullptr, nullptr).x;
-		}
+	auto name = mCharacters.data() + aEntry.mOffset;
+	for (int i = 0; i < aLength; ++i)
+	{
+		auto c = (uint8_t)aBegin[i];
+		if (!mCaseSensitive && c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		if (c != (uint8_t)name[i])
+			return false;
 	}
-
-	return distance;
+	return true;
 }
 
-void TextEditor::EnsureCursorVisible()
+TextEditor::PaletteIndex TextEditor::IdentifierClassifier::Classify(const char* aBegin, const char* aEnd, bool aPreprocessor) const
 {
-	if (!mWithinRender)
+	const int length = (int)(aEnd - aBegin);
+	if (length < mMinLength || length > mMaxLength)
+		return PaletteIndex::Identifier;
+
+	auto hash = Hash(aBegin, aEnd);
+	const Entry* entry = nullptr;
+	if (!mDisplacements.empty())
 	{
-		mScrollToCursor = true;
-		return;
+		auto& candidate = mEntries[Slot(hash)];
+		if (Equals(candidate, aBegin, length))
+			entry = &candidate;
+	}
+	else
+	{
+		for (auto slot = (uint32_t)hash & mMask; mEntries[slot].mLength != 0 && entry == nullptr; slot = (slot + 1) & mMask)
+		{
+			if (Equals(mEntries[slot], aBegin, length))
+				entry = &mEntries[slot];
+		}
 	}
 
-	float scrollX = ImGui::GetScrollX();
-	float scrollY = ImGui::GetScrollY();
-
-	auto height = ImGui::GetWindowHeight();
-	auto width = ImGui::GetWindowWidth();
-
-	auto top = 1 + (int)ceil(scrollY / mCharAdvance.y);
-	auto bottom = (int)ceil((scrollY + height) / mCharAdvance.y);
-
-	auto left = (int)ceil(scrollX / mCharAdvance.x);
-	auto right = (int)ceil((scrollX + width) / mCharAdvance.x);
+	if (entry == nullptr)
+		return PaletteIndex::Identifier;
+	if (aPreprocessor)
+		return entry->mPreprocIdentifier ? PaletteIndex::PreprocIdentifier : PaletteIndex::Identifier;
+	return entry->mColor;
+}
 
-	auto pos = GetActualCursorCoordinates();
-	auto len = TextDistanceToLineStart(pos);
+// The lines are spread over shards by their hash, each with a lock of its own, so that the threads colorizing
+// lines at the same time (see ColorizeInternal()) seldom wait for each other.
+static const int TokenCacheShards = 16;
 
-	if (pos.mLine < top)
-		ImGui::SetScrollY(std::max(0.0f, (pos.mLine - 1) * mCharAdvance.y));
-	if (pos.mLine > bottom - 4)
-		ImGui::SetScrollY(std::max(0.0f, (pos.mLine + 4) * mCharAdvance.y - height));
-	if (len + mTextStart < left + 4)
-		ImGui::SetScrollX(std::max(0.0f, len + mTextStart - 4));
-	if (len + mTextStart > right - 4)
-		ImGui::SetScrollX(std::max(0.0f, len + mTextStart + 4 - width));
+struct TextEditor::TokenCache::Shard
+{
+	struct Entry
+	{
+		Entry() : mKey(0), mLanguage(0), mState(0), mSize(0) {}
+
+		uint64_t mKey;
+		uint64_t mLanguage;
+		uint16_t mState;
+		int mSize;
+		std::vector<Char> mChars;
+		std::vector<Line::Span> mSpans;
+	};
+
+	std::mutex mMutex;
+	std::vector<Entry> mEntries;
+};
+
+TextEditor::TokenCache::TokenCache(int aCapacity)
+	: mShardSize(1)
+	, mShards(new Shard[TokenCacheShards])
+{
+	while (mShardSize * TokenCacheShards < aCapacity)
+		mShardSize *= 2;
+	for (int i = 0; i < TokenCacheShards; ++i)
+		mShards[i].mEntries.resize(mShardSize);
 }
 
-int TextEditor::GetPageSize() const
+TextEditor::TokenCache::~TokenCache()
 {
-	auto height = ImGui::GetWindowHeight() - 20.0f;
-	return (int)floor(height / mCharAdvance.y);
 }
 
-TextEditor::UndoRecord::UndoRecord(
-	const std::string& aAdded,
-	const TextEditor::Coordinates aAddedStart,
-	const TextEditor::Coordinates aAddedEnd,
-	const std::string& aRemoved,
-	const TextEditor::Coordinates aRemovedStart,
-	const TextEditor::Coordinates aRemovedEnd,
-	TextEditor::EditorState& aBefore,
-	TextEditor::EditorState& aAfter)
-	: mAdded(aAdded)
-	, mAddedStart(aAddedStart)
-	, mAddedEnd(aAddedEnd)
-	, mRemoved(aRemoved)
-	, mRemovedStart(aRemovedStart)
-	, mRemovedEnd(aRemovedEnd)
-	, mBefore(aBefore)
-	, mAfter(aAfter)
+int TextEditor::TokenCache::GetCapacity() const
 {
-	assert(mAddedStart <= mAddedEnd);
-	assert(mRemovedStart <= mRemovedEnd);
+	return mShardSize * TokenCacheShards;
 }
 
-void TextEditor::UndoRecord::Undo(TextEditor * aEditor)
+bool TextEditor::TokenCache::Find(Line& aLine, uint64_t aLanguage, uint64_t& aKey) const
 {
-	if (!mAdded.empty())
+	// the flags of a line, which the colors depend on, are set by the scan from the state it starts in
+	const auto state = aLine.GetScanState();
+	const int size = aLine.size();
+	if (state == 0 || size > MaxLineLength)
 	{
-		aEditor->DeleteRange(mAddedStart, mAddedEnd);
-		aEditor->Colorize(mAddedStart.mLine - 1, mAddedEnd.mLine - mAddedStart.mLine + 2);
+		aKey = 0;
+		return false;
 	}
 
-	if (!mRemoved.empty())
+	// FNV-1a, taking 8 characters at a time
+	uint64_t key = ((14695981039346656037ull ^ aLanguage) ^ state) * 1099511628211ull;
+	auto chars = aLine.data();
+	int i = 0;
+	for (; i + 8 <= size; i += 8)
 	{
-		auto start = mRemovedStart;
-		aEditor->InsertTextAt(start, mRemoved.c_str());
-		aEditor->Colorize(mRemovedStart.mLine - 1, mRemovedEnd.mLine - mRemovedStart.mLine + 2);
+		uint64_t word;
+		memcpy(&word, chars + i, sizeof(word));
+		key = (key ^ word) * 1099511628211ull;
+		key ^= key >> 29;
 	}
+	for (; i < size; ++i)
+		key = (key ^ chars[i]) * 1099511628211ull;
+	// the low bits pick the slot, and depend on the low bits of the characters only so far
+	key ^= key >> 32;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 32;
+	aKey = key;
+
+	auto& shard = mShards[key % TokenCacheShards];
+	std::lock_guard<std::mutex> lock(shard.mMutex);
+	auto& entry = shard.mEntries[(key / TokenCacheShards) & (mShardSize - 1)];
+	if (entry.mKey != key || entry.mLanguage != aLanguage || entry.mState != state || entry.mSize != size || memcmp(entry.mChars.data(), chars, size) != 0)
+		return false;
 
-	aEditor->mState = mBefore;
-	aEditor->EnsureCursorVisible();
-
+	aLine.SetSpans(entry.mSpans);
+	return true;
 }
 
-void TextEditor::UndoRecord::Redo(TextEditor * aEditor)
+void TextEditor::TokenCache::Store(const Line& aLine, uint64_t aLanguage, uint64_t aKey)
 {
-	if (!mRemoved.empty())
-	{
-		aEditor->DeleteRange(mRemovedStart, mRemovedEnd);
-		aEditor->Colorize(mRemovedStart.mLine - 1, mRemovedEnd.mLine - mRemovedStart.mLine + 1);
-	}
+	if (aKey == 0)
+		return;
 
-	if (!mAdded.empty())
+	auto& shard = mShards[aKey % TokenCacheShards];
+	std::lock_guard<std::mutex> lock(shard.mMutex);
+	auto& entry = shard.mEntries[(aKey / TokenCacheShards) & (mShardSize - 1)];
+	entry.mKey = aKey;
+	entry.mLanguage = aLanguage;
+	entry.mState = aLine.GetScanState();
+	entry.mSize = aLine.size();
+	entry.mChars.assign(aLine.data(), aLine.data() + entry.mSize);
+	entry.mSpans = aLine.GetSpans();
+}
+
+void TextEditor::TokenCache::clear()
+{
+	for (int i = 0; i < TokenCacheShards; ++i)
 	{
-		auto start = mAddedStart;
-		aEditor->InsertTextAt(start, mAdded.c_str());
-		aEditor->Colorize(mAddedStart.mLine - 1, mAddedEnd.mLine - mAddedStart.mLine + 1);
+		std::lock_guard<std::mutex> lock(mShards[i].mMutex);
+		for (auto& entry : mShards[i].mEntries)
+			entry = Shard::Entry();
 	}
-
-	aEditor->mState = mAfter;
-	aEditor->EnsureCursorVisible();
 }
 
 static bool TokenizeCStyleString(const char * in_begin, const char * in_end, const char *& out_begin, const char *& out_end)
@@ -2528,6 +6038,10 @@ static bool TokenizeCStyleString(const char * in_begin, const char * in_end, con
 
 		while (p < in_end)
 		{
+			p = FindEither(p, in_end, '"', '\\');
+			if (p == in_end)
+				break;
+
 			// handle end of string
 			if (*p == '"')
 			{
@@ -2537,7 +6051,7 @@ static bool TokenizeCStyleString(const char * in_begin, const char * in_end, con
 			}
 
 			// handle escape character for "
-			if (*p == '\\' && p + 1 < in_end && p[1] == '"')
+			if (p + 1 < in_end && p[1] == '"')
 				p++;
 
 			p++;
@@ -2580,10 +6094,7 @@ static bool TokenizeCStyleIdentifier(const char * in_begin, const char * in_end,
 
 	if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '_')
 	{
-		p++;
-
-		while ((p < in_end) && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_'))
-			p++;
+		p = SkipIdentifierCharacters(p + 1, in_end);
 
 		out_begin = in_begin;
 		out_end = p;
@@ -2604,14 +6115,9 @@ static bool TokenizeCStyleNumber(const char * in_begin, const char * in_end, con
 
 	p++;
 
-	bool hasNumber = startsWithNumber;
-
-	while (p < in_end && (*p >= '0' && *p <= '9'))
-	{
-		hasNumber = true;
-
-		p++;
-	}
+	auto digits = SkipDigits(p, in_end);
+	bool hasNumber = startsWithNumber || digits != p;
+	p = digits;
 
 	if (hasNumber == false)
 		return false;
@@ -2626,10 +6132,7 @@ static bool TokenizeCStyleNumber(const char * in_begin, const char * in_end, con
 		{
 			isFloat = true;
 
-			p++;
-
-			while (p < in_end && (*p >= '0' && *p <= '9'))
-				p++;
+			p = SkipDigits(p + 1, in_end);
 		}
 		else if (*p == 'x' || *p == 'X')
 		{
@@ -2637,10 +6140,7 @@ static bool TokenizeCStyleNumber(const char * in_begin, const char * in_end, con
 
 			isHex = true;
 
-			p++;
-
-			while (p < in_end && ((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f') || (*p >= 'A' && *p <= 'F')))
-				p++;
+			p = SkipHexDigits(p + 1, in_end);
 		}
 		else if (*p == 'b' || *p == 'B')
 		{
@@ -2667,17 +6167,10 @@ static bool TokenizeCStyleNumber(const char * in_begin, const char * in_end, con
 			if (p < in_end && (*p == '+' || *p == '-'))
 				p++;
 
-			bool hasDigits = false;
-
-			while (p < in_end && (*p >= '0' && *p <= '9'))
-			{
-				hasDigits = true;
-
-				p++;
-			}
-
-			if (hasDigits == false)
+			auto digits = SkipDigits(p, in_end);
+			if (digits == p)
 				return false;
+			p = digits;
 		}
 
 		// single precision floating point type
@@ -2735,6 +6228,140 @@ static bool TokenizeCStylePunctuation(const char * in_begin, const char * in_end
 	return false;
 }
 
+static bool TokenizeCStylePreprocessor(const char * in_begin, const char * in_end, const char *& out_begin, const char *& out_end)
+{
+	const char * p = in_begin;
+
+	if (*p == '#')
+	{
+		p++;
+
+		while (p < in_end && (*p == ' ' || *p == '\t'))
+			p++;
+
+		const char * name = p;
+
+		while (p < in_end && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '_'))
+			p++;
+
+		if (p != name)
+		{
+			out_begin = in_begin;
+			out_end = p;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool TokenizeSQLString(const char * in_begin, const char * in_end, const char *& out_begin, const char *& out_end)
+{
+	const char * p = in_begin;
+
+	if (*p == '\'')
+	{
+		p++;
+
+		while (p < in_end)
+		{
+			if (*p == '\'')
+			{
+				// a doubled quote stands for a quote in the string
+				if (p + 1 < in_end && p[1] == '\'')
+				{
+					p += 2;
+					continue;
+				}
+
+				out_begin = in_begin;
+				out_end = p + 1;
+				return true;
+			}
+
+			p++;
+		}
+	}
+
+	return false;
+}
+
+static bool TokenizeLuaString(const char * in_begin, const char * in_end, const char *& out_begin, const char *& out_end)
+{
+	const char * p = in_begin;
+
+	if (*p == '"' || *p == '\'')
+	{
+		const char quote = *p;
+
+		p++;
+
+		while (p < in_end)
+		{
+			if (*p == quote)
+			{
+				out_begin = in_begin;
+				out_end = p + 1;
+				return true;
+			}
+
+			// handle escape characters
+			if (*p == '\\' && p + 1 < in_end)
+				p++;
+
+			p++;
+		}
+	}
+
+	return false;
+}
+
+static bool TokenizeLuaLongString(const char * in_begin, const char * in_end, const char *& out_begin, const char *& out_end)
+{
+	const char * p = in_begin;
+
+	// [[...]], [=[...]=], [==[...]==] and so on, closed by a bracket with the same number of '='
+	if (*p != '[')
+		return false;
+
+	p++;
+
+	int level = 0;
+	while (p < in_end && *p == '=')
+	{
+		level++;
+		p++;
+	}
+
+	if (p == in_end || *p != '[')
+		return false;
+
+	p++;
+
+	for (; p < in_end; p++)
+	{
+		if (*p == ']')
+		{
+			const char * q = p + 1;
+			int closeLevel = 0;
+			while (q < in_end && *q == '=')
+			{
+				closeLevel++;
+				q++;
+			}
+
+			if (closeLevel == level && q < in_end && *q == ']')
+			{
+				out_begin = in_begin;
+				out_end = q + 1;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
 const TextEditor::LanguageDefinition& TextEditor::LanguageDefinition::CPlusPlus()
 {
 	static bool inited = false;
@@ -2767,8 +6394,7 @@ const TextEditor::LanguageDefinition& TextEditor::LanguageDefinition::CPlusPlus(
 		{
 			paletteIndex = PaletteIndex::Max;
 
-			while (in_begin < in_end && isascii(*in_begin) && isblank(*in_begin))
-				in_begin++;
+			in_begin = SkipBlanks(in_begin, in_end);
 
 			if (in_begin == in_end)
 			{
@@ -2852,15 +6478,33 @@ const TextEditor::LanguageDefinition& TextEditor::LanguageDefinition::HLSL()
 			langDef.mIdentifiers.insert(std::make_pair(std::string(k), id));
 		}
 
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[ \\t]*#[ \\t]*[a-zA-Z_]+", PaletteIndex::Preprocessor));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("L?\\\"(\\\\.|[^\\\"])*\\\"", PaletteIndex::String));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("\\'\\\\?[^\\']\\'", PaletteIndex::CharLiteral));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[+-]?([0-9]+([.][0-9]*)?|[.][0-9]+)([eE][+-]?[0-9]+)?[fF]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[+-]?[0-9]+[Uu]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("0[0-7]+[Uu]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("0[xX][0-9a-fA-F]+[uU]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[a-zA-Z_][a-zA-Z0-9_]*", PaletteIndex::Identifier));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[\\[\\]\\{\\}\\!\\%\\^\\&\\*\\(\\)\\-\\+\\=\\~\\|\\<\\>\\?\\/\\;\\,\\.]", PaletteIndex::Punctuation));
+		langDef.mTokenize = [](const char * in_begin, const char * in_end, const char *& out_begin, const char *& out_end, PaletteIndex & paletteIndex) -> bool
+		{
+			paletteIndex = PaletteIndex::Max;
+
+			in_begin = SkipBlanks(in_begin, in_end);
+
+			if (in_begin == in_end)
+			{
+				out_begin = in_end;
+				out_end = in_end;
+				paletteIndex = PaletteIndex::Default;
+			}
+			else if (TokenizeCStylePreprocessor(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Preprocessor;
+			else if (TokenizeCStyleString(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::String;
+			else if (TokenizeCStyleCharacterLiteral(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::CharLiteral;
+			else if (TokenizeCStyleIdentifier(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Identifier;
+			else if (TokenizeCStyleNumber(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Number;
+			else if (TokenizeCStylePunctuation(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Punctuation;
+
+			return paletteIndex != PaletteIndex::Max;
+		};
 
 		langDef.mCommentStart = "/*";
 		langDef.mCommentEnd = "*/";
@@ -2901,15 +6545,33 @@ const TextEditor::LanguageDefinition& TextEditor::LanguageDefinition::GLSL()
 			langDef.mIdentifiers.insert(std::make_pair(std::string(k), id));
 		}
 
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[ \\t]*#[ \\t]*[a-zA-Z_]+", PaletteIndex::Preprocessor));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("L?\\\"(\\\\.|[^\\\"])*\\\"", PaletteIndex::String));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("\\'\\\\?[^\\']\\'", PaletteIndex::CharLiteral));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[+-]?([0-9]+([.][0-9]*)?|[.][0-9]+)([eE][+-]?[0-9]+)?[fF]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[+-]?[0-9]+[Uu]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("0[0-7]+[Uu]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("0[xX][0-9a-fA-F]+[uU]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[a-zA-Z_][a-zA-Z0-9_]*", PaletteIndex::Identifier));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[\\[\\]\\{\\}\\!\\%\\^\\&\\*\\(\\)\\-\\+\\=\\~\\|\\<\\>\\?\\/\\;\\,\\.]", PaletteIndex::Punctuation));
+		langDef.mTokenize = [](const char * in_begin, const char * in_end, const char *& out_begin, const char *& out_end, PaletteIndex & paletteIndex) -> bool
+		{
+			paletteIndex = PaletteIndex::Max;
+
+			in_begin = SkipBlanks(in_begin, in_end);
+
+			if (in_begin == in_end)
+			{
+				out_begin = in_end;
+				out_end = in_end;
+				paletteIndex = PaletteIndex::Default;
+			}
+			else if (TokenizeCStylePreprocessor(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Preprocessor;
+			else if (TokenizeCStyleString(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::String;
+			else if (TokenizeCStyleCharacterLiteral(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::CharLiteral;
+			else if (TokenizeCStyleIdentifier(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Identifier;
+			else if (TokenizeCStyleNumber(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Number;
+			else if (TokenizeCStylePunctuation(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Punctuation;
+
+			return paletteIndex != PaletteIndex::Max;
+		};
 
 		langDef.mCommentStart = "/*";
 		langDef.mCommentEnd = "*/";
@@ -2954,8 +6616,7 @@ const TextEditor::LanguageDefinition& TextEditor::LanguageDefinition::C()
 		{
 			paletteIndex = PaletteIndex::Max;
 
-			while (in_begin < in_end && isascii(*in_begin) && isblank(*in_begin))
-				in_begin++;
+			in_begin = SkipBlanks(in_begin, in_end);
 
 			if (in_begin == in_end)
 			{
@@ -3032,14 +6693,31 @@ const TextEditor::LanguageDefinition& TextEditor::LanguageDefinition::SQL()
 			langDef.mIdentifiers.insert(std::make_pair(std::string(k), id));
 		}
 
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("L?\\\"(\\\\.|[^\\\"])*\\\"", PaletteIndex::String));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("\\\'[^\\\']*\\\'", PaletteIndex::String));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[+-]?([0-9]+([.][0-9]*)?|[.][0-9]+)([eE][+-]?[0-9]+)?[fF]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[+-]?[0-9]+[Uu]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("0[0-7]+[Uu]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("0[xX][0-9a-fA-F]+[uU]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[a-zA-Z_][a-zA-Z0-9_]*", PaletteIndex::Identifier));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[\\[\\]\\{\\}\\!\\%\\^\\&\\*\\(\\)\\-\\+\\=\\~\\|\\<\\>\\?\\/\\;\\,\\.]", PaletteIndex::Punctuation));
+		langDef.mTokenize = [](const char * in_begin, const char * in_end, const char *& out_begin, const char *& out_end, PaletteIndex & paletteIndex) -> bool
+		{
+			paletteIndex = PaletteIndex::Max;
+
+			in_begin = SkipBlanks(in_begin, in_end);
+
+			if (in_begin == in_end)
+			{
+				out_begin = in_end;
+				out_end = in_end;
+				paletteIndex = PaletteIndex::Default;
+			}
+			else if (TokenizeCStyleString(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::String;
+			else if (TokenizeSQLString(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::String;
+			else if (TokenizeCStyleIdentifier(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Identifier;
+			else if (TokenizeCStyleNumber(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Number;
+			else if (TokenizeCStylePunctuation(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Punctuation;
+
+			return paletteIndex != PaletteIndex::Max;
+		};
 
 		langDef.mCommentStart = "/*";
 		langDef.mCommentEnd = "*/";
@@ -3082,14 +6760,31 @@ const TextEditor::LanguageDefinition& TextEditor::LanguageDefinition::AngelScrip
 			langDef.mIdentifiers.insert(std::make_pair(std::string(k), id));
 		}
 
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("L?\\\"(\\\\.|[^\\\"])*\\\"", PaletteIndex::String));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("\\'\\\\?[^\\']\\'", PaletteIndex::String));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[+-]?([0-9]+([.][0-9]*)?|[.][0-9]+)([eE][+-]?[0-9]+)?[fF]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[+-]?[0-9]+[Uu]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("0[0-7]+[Uu]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("0[xX][0-9a-fA-F]+[uU]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[a-zA-Z_][a-zA-Z0-9_]*", PaletteIndex::Identifier));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[\\[\\]\\{\\}\\!\\%\\^\\&\\*\\(\\)\\-\\+\\=\\~\\|\\<\\>\\?\\/\\;\\,\\.]", PaletteIndex::Punctuation));
+		langDef.mTokenize = [](const char * in_begin, const char * in_end, const char *& out_begin, const char *& out_end, PaletteIndex & paletteIndex) -> bool
+		{
+			paletteIndex = PaletteIndex::Max;
+
+			in_begin = SkipBlanks(in_begin, in_end);
+
+			if (in_begin == in_end)
+			{
+				out_begin = in_end;
+				out_end = in_end;
+				paletteIndex = PaletteIndex::Default;
+			}
+			else if (TokenizeCStyleString(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::String;
+			else if (TokenizeCStyleCharacterLiteral(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::String;
+			else if (TokenizeCStyleIdentifier(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Identifier;
+			else if (TokenizeCStyleNumber(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Number;
+			else if (TokenizeCStylePunctuation(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Punctuation;
+
+			return paletteIndex != PaletteIndex::Max;
+		};
 
 		langDef.mCommentStart = "/*";
 		langDef.mCommentEnd = "*/";
@@ -3137,17 +6832,36 @@ const TextEditor::LanguageDefinition& TextEditor::LanguageDefinition::Lua()
 			langDef.mIdentifiers.insert(std::make_pair(std::string(k), id));
 		}
 
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("L?\\\"(\\\\.|[^\\\"])*\\\"", PaletteIndex::String));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("\\\'[^\\\']*\\\'", PaletteIndex::String));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("0[xX][0-9a-fA-F]+[uU]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[+-]?([0-9]+([.][0-9]*)?|[.][0-9]+)([eE][+-]?[0-9]+)?[fF]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[+-]?[0-9]+[Uu]?[lL]?[lL]?", PaletteIndex::Number));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[a-zA-Z_][a-zA-Z0-9_]*", PaletteIndex::Identifier));
-		langDef.mTokenRegexStrings.push_back(std::make_pair<std::string, PaletteIndex>("[\\[\\]\\{\\}\\!\\%\\^\\&\\*\\(\\)\\-\\+\\=\\~\\|\\<\\>\\?\\/\\;\\,\\.]", PaletteIndex::Punctuation));
+		langDef.mTokenize = [](const char * in_begin, const char * in_end, const char *& out_begin, const char *& out_end, PaletteIndex & paletteIndex) -> bool
+		{
+			paletteIndex = PaletteIndex::Max;
+
+			in_begin = SkipBlanks(in_begin, in_end);
+
+			if (in_begin == in_end)
+			{
+				out_begin = in_end;
+				out_end = in_end;
+				paletteIndex = PaletteIndex::Default;
+			}
+			else if (TokenizeLuaString(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::String;
+			else if (TokenizeLuaLongString(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::String;
+			else if (TokenizeCStyleIdentifier(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Identifier;
+			else if (TokenizeCStyleNumber(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Number;
+			else if (TokenizeCStylePunctuation(in_begin, in_end, out_begin, out_end))
+				paletteIndex = PaletteIndex::Punctuation;
+
+			return paletteIndex != PaletteIndex::Max;
+		};
 
 		langDef.mCommentStart = "--[[";
 		langDef.mCommentEnd = "]]";
 		langDef.mSingleLineComment = "--";
+		langDef.mLongStrings = true;
 
 		langDef.mCaseSensitive = true;
 		langDef.mAutoIndentation = false;
@@ -8,8 +8,14 @@
 #include <unordered_map>
 #include <map>
 #include <regex>
+#include <functional>
 #include "imgui.h"
 
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define TEXTEDITOR_STRING_VIEW
+#include <string_view>
+#endif
+
 class TextEditor
 {
 public:
@@ -133,20 +139,272 @@ public:
 	typedef std::array<ImU32, (unsigned)PaletteIndex::Max> Palette;
 	typedef uint8_t Char;
 
-	struct Glyph
+	// A line of the document. The document is kept as a line granular piece table: a line which has not
+	// been modified since the text was loaded is just a piece of the loaded text (see mLoadedText), and
+	// it only gets its own copy of its characters when it is edited. This way loading a document does
+	// not need to touch its characters one by one.
+	// The attributes of the glyphs (comment, long string and preprocessor flags) are packed into one
+	// byte per glyph, in an array separate from the characters, which is only allocated once the line
+	// gets a non-default attribute.
+	// The layout of the line (its width in columns and number of characters) is cached until the line
+	// or the tab size changes. A long line also gets checkpoints: the column and horizontal position of
+	// every CheckpointInterval-th character, so that only the part of the line in view has to be walked.
+	// A short line in view keeps the text runs it is drawn with (see Render()), until it is changed or
+	// the font, tab size or colors they were laid out for change.
+	class Line
 	{
-		Char mChar;
-		PaletteIndex mColorIndex = PaletteIndex::Default;
-		bool mComment : 1;
-		bool mMultiLineComment : 1;
-		bool mPreprocessor : 1;
-
-		Glyph(Char aChar, PaletteIndex aColorIndex) : mChar(aChar), mColorIndex(aColorIndex),
-			mComment(false), mMultiLineComment(false), mPreprocessor(false) {}
+	public:
+		static const int CheckpointInterval = 256;
+
+		struct Checkpoint
+		{
+			int mIndex;
+			int mColumn;
+			float mX;
+		};
+
+		struct Checkpoints
+		{
+			int mTabSize;
+			const ImFont* mFont;	// the font the positions were measured with, nullptr if they are not measured yet
+			float mFontSize;
+			int mMeasured;			// the number of points (from the first) whose position is measured
+			int mMoved;				// the first of the points moved over an edit, whose positions all move with it, -1 if none
+			std::vector<Checkpoint> mPoints;
+		};
+
+		// The characters changed since the checkpoints were made are in [mStart, mEnd), the ones after them
+		// were mDelta characters earlier before. mStart is -1 if none changed.
+		struct Edit
+		{
+			int mStart;
+			int mEnd;
+			int mDelta;
+		};
+
+		// The characters in [mStart, mEnd) drawn at mX in mColor, or if mStart == mEnd the whitespace
+		// at mStart, a tab ending at mEndX or a space.
+		struct TextRun
+		{
+			float mX;
+			float mEndX;
+			int mStart;
+			int mEnd;
+			ImU32 mColor;
+		};
+
+		struct TextRuns
+		{
+			const ImFont* mFont;
+			float mFontSize;
+			int mTabSize;
+			float mColumnAdvance;
+			unsigned mPaletteVersion;
+			std::vector<TextRun> mRuns;
+		};
+
+		// A run of characters of the same token color, drawn in the same color (see ColorizeLine()). The spans
+		// of a colorized line cover all its characters, a line without spans is drawn in the default color.
+		struct Span
+		{
+			int mStart;
+			int mLength;
+			uint8_t mColorIndex;	// the PaletteIndex of the token
+			uint8_t mColor;			// the one it is drawn with, see PreprocessorColor
+		};
+
+		// Span::mColor is a PaletteIndex, or PreprocessorColor plus the PaletteIndex blended with the preprocessor color.
+		static const uint8_t PreprocessorColor = (uint8_t)PaletteIndex::Max;
+
+		Line() : mPiece(nullptr), mPieceSize(0), mScanState(0), mColorized(false), mTaken(false), mLayoutTabSize(-1), mMaxColumn(0), mCharacterCount(0), mSimple(true), mAscii(true), mEdit{ -1, 0, 0 } {}
+		Line(const Char* aPiece, int aPieceSize) : mPiece(aPiece), mPieceSize(aPieceSize), mScanState(0), mColorized(false), mTaken(false), mLayoutTabSize(-1), mMaxColumn(0), mCharacterCount(0), mSimple(true), mAscii(true), mEdit{ -1, 0, 0 } {}
+
+		int size() const { return mPiece != nullptr ? mPieceSize : (int)mChars.size(); }
+		bool empty() const { return size() == 0; }
+		const Char* data() const { return mPiece != nullptr ? mPiece : mChars.data(); }
+		bool IsPiece() const { return mPiece != nullptr; }
+		Char operator[](int aIndex) const { return data()[aIndex]; }
+
+		PaletteIndex GetColorIndex(int aIndex) const;
+		bool IsComment(int aIndex) const { return (GetAttributes(aIndex) & CommentFlag) != 0; }
+		bool IsMultiLineComment(int aIndex) const { return (GetAttributes(aIndex) & MultiLineCommentFlag) != 0; }
+		bool IsPreprocessor(int aIndex) const { return (GetAttributes(aIndex) & PreprocessorFlag) != 0; }
+		bool IsLongString(int aIndex) const { return (GetAttributes(aIndex) & LongStringFlag) != 0; }
+
+		void SetComment(int aIndex, bool aValue) { SetAttributes(aIndex, CommentFlag, aValue ? CommentFlag : 0); }
+		void SetMultiLineComment(int aIndex, bool aValue) { SetAttributes(aIndex, MultiLineCommentFlag, aValue ? MultiLineCommentFlag : 0); }
+		void SetPreprocessor(int aIndex, bool aValue) { SetAttributes(aIndex, PreprocessorFlag, aValue ? PreprocessorFlag : 0); }
+		void ResetScanFlags() { for (auto& a : mAttributes) a = 0; }
+		void SetScanFlags(int aStart, int aEnd, bool aComment, bool aMultiLineComment, bool aPreprocessor, bool aLongString);
+
+		const std::vector<Span>& GetSpans() const { return mSpans; }
+		void SetSpans(const std::vector<Span>& aSpans) { mSpans = aSpans; mTextRuns.reset(); }
+		void ClearSpans() { mSpans.clear(); mTextRuns.reset(); }
+		// Appends the characters in [aStart, aEnd) in aColorIndex, split where the flags of the characters change
+		// the color they are drawn with. The spans are added in order.
+		void AddSpan(int aStart, int aEnd, PaletteIndex aColorIndex);
+		// The span the character at aIndex is in, -1 if the line has no spans.
+		int FindSpan(int aIndex) const;
+
+		// The state of the comment scanner at the start of the line (see ColorizeComments()), 0 if the line
+		// was changed since it was last scanned.
+		uint16_t GetScanState() const { return mScanState; }
+		void SetScanState(uint16_t aValue) { mScanState = aValue; }
+		// Whether the colors of the line are up to date, false once it is changed.
+		bool IsColorized() const { return mColorized; }
+		void SetColorized(bool aValue) { mColorized = aValue; mTaken = mTaken && aValue; }
+		// Whether the line was copied for the colorizer thread, and its colors did not go out of date since.
+		bool IsTaken() const { return mTaken; }
+		void SetTaken(bool aValue) { mTaken = aValue; }
+
+		int GetMaxColumn(int aTabSize) const { UpdateLayout(aTabSize); return mMaxColumn; }
+		int GetCharacterCount(int aTabSize) const { UpdateLayout(aTabSize); return mCharacterCount; }
+		// Whether each character of the line is a single byte, one column wide (so no tabs either).
+		bool IsSimple(int aTabSize) const { UpdateLayout(aTabSize); return mSimple; }
+		// Whether the line has only printable ASCII characters and tabs.
+		bool IsAscii(int aTabSize) const { UpdateLayout(aTabSize); return mAscii; }
+
+		// An edit leaves the checkpoints before it and moves the ones after it, see TextEditor::GetCheckpoints().
+		const std::shared_ptr<const Checkpoints>& GetCheckpoints() const { return mCheckpoints; }
+		const Edit& GetEdit() const { return mEdit; }
+		void SetCheckpoints(std::shared_ptr<const Checkpoints> aValue) const { mCheckpoints = std::move(aValue); mEdit.mStart = -1; }
+		const std::shared_ptr<const TextRuns>& GetTextRuns() const { return mTextRuns; }
+		void SetTextRuns(std::shared_ptr<const TextRuns> aValue) const { mTextRuns = std::move(aValue); }
+
+		void Insert(int aIndex, Char aChar);
+		void Insert(int aIndex, const Line& aFrom, int aFromStart, int aFromEnd);
+		void Insert(int aIndex, const Char* aBegin, const Char* aEnd);
+		void Erase(int aStart, int aEnd);
+
+	private:
+		static const uint8_t CommentFlag = 0x01;
+		static const uint8_t MultiLineCommentFlag = 0x02;
+		static const uint8_t PreprocessorFlag = 0x04;
+		static const uint8_t LongStringFlag = 0x08;
+
+		uint8_t GetAttributes(int aIndex) const { return mAttributes.empty() ? 0 : mAttributes[aIndex]; }
+		void SetAttributes(int aIndex, uint8_t aMask, uint8_t aValue);
+		void Materialize();
+		void Changed(int aIndex, const Char* aBegin, const Char* aEnd, bool aInserted);
+		void UpdateLayout(int aTabSize) const;
+		void ResizeSpans(int aIndex, int aCount);
+		static void CopySpans(std::vector<Span>& aTo, const Line& aFrom, int aStart, int aEnd, int aOffset);
+
+		const Char* mPiece;
+		int mPieceSize;
+		std::vector<Char> mChars;
+		std::vector<uint8_t> mAttributes;	// the comment scanner flags of each character, empty if they are all clear
+		std::vector<Span> mSpans;
+		uint16_t mScanState;
+		bool mColorized;
+		bool mTaken;
+
+		mutable int mLayoutTabSize;	// the tab size the layout was computed with, -1 if it has to be computed
+		mutable int mMaxColumn;
+		mutable int mCharacterCount;
+		mutable bool mSimple;
+		mutable bool mAscii;
+		mutable std::shared_ptr<const Checkpoints> mCheckpoints;
+		mutable Edit mEdit;
+		mutable std::shared_ptr<const TextRuns> mTextRuns;
 	};
 
-	typedef std::vector<Glyph> Line;
-	typedef std::vector<Line> Lines;
+	// The lines of the document. Normally these are just the lines in a vector, but a document opened
+	// with OpenMapped() is a read-only view of a memory mapped file: its line starts are found by a
+	// background thread, and a line is only made (and colorized) when it is accessed, then kept in a
+	// cache of the recently used lines. This way a multi-gigabyte file costs the lines on the screen.
+	// A text loaded with Load() is split into lines by a background thread as well, and its lines are
+	// appended to the vector between frames, as they are made.
+	// The offsets of the lines are kept in blocks of consecutive lines, with Fenwick trees of the line counts
+	// and sizes of the blocks. Adding, removing or resizing lines only updates the blocks they are in (a block
+	// which grew too long is split, an empty one dropped), so an offset is found in logarithmic time plus
+	// the lines of one block.
+	// The widths of the lines (in pixels) are kept in a counted multiset, so that the widest line is known
+	// while lines are edited, added and removed. A line which is added or changed has no width until the
+	// editor measures it again. Of a mapped file, only the widest line measured so far is kept.
+	class Lines
+	{
+	public:
+		Lines() : mUnmeasuredMin(0), mUnmeasuredMax(0), mMappedWidth(0.0f) {}
+
+		size_t size() const { return mMapping ? MappedSize() : mLines.size(); }
+		bool empty() const { return size() == 0; }
+		Line& operator[](size_t aIndex) { return mMapping ? GetMapped(aIndex) : mLines[aIndex]; }
+		const Line& operator[](size_t aIndex) const { return mMapping ? GetMapped(aIndex) : mLines[aIndex]; }
+		// Like operator[], but a mapped line which is not cached is made in aScratch instead of the cache.
+		const Line& Get(size_t aIndex, Line& aScratch) const;
+
+		void clear() { mMapping.reset(); mLoader.reset(); mLines.clear(); ClearOffsets(); ClearWidths(); }
+		void reserve(size_t aSize) { mLines.reserve(aSize); }
+		void push_back(Line&& aLine) { mLines.push_back(std::move(aLine)); AddOffsets((int)mLines.size() - 1, 1); AddWidths((int)mLines.size() - 1, 1); }
+		void emplace_back(const Char* aPiece, int aPieceSize) { mLines.emplace_back(aPiece, aPieceSize); AddOffsets((int)mLines.size() - 1, 1); AddWidths((int)mLines.size() - 1, 1); }
+		Line& Insert(int aIndex) { AddWidths(aIndex, 1); auto& line = *mLines.insert(mLines.begin() + aIndex, Line()); AddOffsets(aIndex, 1); return line; }
+		void Insert(int aIndex, std::vector<Line>&& aLines) { AddWidths(aIndex, (int)aLines.size()); mLines.insert(mLines.begin() + aIndex, std::make_move_iterator(aLines.begin()), std::make_move_iterator(aLines.end())); AddOffsets(aIndex, (int)aLines.size()); }
+		void Erase(int aStart, int aEnd) { RemoveWidths(aStart, aEnd); mLines.erase(mLines.begin() + aStart, mLines.begin() + aEnd); RemoveOffsets(aStart, aEnd); }
+
+		// Has to be called when a line changes, to keep the line offsets and widths up to date.
+		void Resized(int aIndex);
+		// The offset of the start of a line in the text, with a newline after each line.
+		size_t GetOffset(int aIndex) const;
+		// The line which contains the given offset.
+		int FindOffset(size_t aOffset) const;
+
+		bool Map(const char* aPath);
+		bool IsMapped() const { return mMapping != nullptr; }
+		void Load(const Char* aText, size_t aSize, std::shared_ptr<const void> aOwner);
+		bool IsLoading() const { return mLoader != nullptr; }
+		// Whether the only line is the start of a first line which is still being loaded (see Load()).
+		bool IsPartial() const;
+		// Whether the line starts of a mapped file are still being found.
+		bool IsIndexing() const;
+		float GetLoadProgress() const;
+		void CancelLoad() { mLoader.reset(); }
+		void Update();
+
+		bool IsColorized(int aIndex) const;
+		void SetColorized(int aIndex);
+		void ResetColorized(int aFromLine, int aToLine);
+
+		float GetMaxWidth() const { return mMapping ? mMappedWidth : mWidthCounts.empty() ? 0.0f : mWidthCounts.rbegin()->first; }
+		bool HasWidth(int aIndex) const { return !mMapping && mWidths[aIndex] >= 0.0f; }
+		void SetWidth(int aIndex, float aWidth);
+		// Forgets the widths of all the lines, for when the font or the tab size changed.
+		void ClearWidths();
+		// The first line which has no width, size() if they all have one (or the file is mapped).
+		int NextUnmeasured() const;
+
+	private:
+		struct Mapping;
+		struct Loader;
+
+		size_t MappedSize() const;
+		Line& GetMapped(size_t aIndex) const;
+
+		void BuildOffsets() const;
+		void BuildOffsetTrees() const;
+		void ClearOffsets() { mBlockLines.clear(); mBlockSizes.clear(); mLineTree.clear(); mSizeTree.clear(); }
+		int FindBlock(int aIndex, int& aFirstLine) const;
+		void UpdateBlockSize(int aBlock, int aFirstLine);
+		void AddOffsets(int aIndex, int aCount);
+		void RemoveOffsets(int aStart, int aEnd);
+		void AddWidths(int aIndex, int aCount);
+		void RemoveWidths(int aStart, int aEnd);
+		void CountWidth(float aWidth, int aCount);
+		void AddUnmeasured(int aStart, int aEnd);
+
+		std::vector<Line> mLines;
+		std::shared_ptr<Mapping> mMapping;
+		std::shared_ptr<Loader> mLoader;
+		mutable std::vector<int> mBlockLines;		// the number of lines in each block, empty until the offsets are needed
+		mutable std::vector<size_t> mBlockSizes;	// the size of the lines of each block (plus their newline)
+		mutable std::vector<size_t> mLineTree;		// Fenwick tree of mBlockLines
+		mutable std::vector<size_t> mSizeTree;		// Fenwick tree of mBlockSizes
+		std::vector<float> mWidths;				// the width of each line, negative until it is measured
+		std::map<float, int> mWidthCounts;		// the number of lines of each width
+		mutable int mUnmeasuredMin;				// the lines without a width are all in [mUnmeasuredMin, mUnmeasuredMax)
+		int mUnmeasuredMax;
+		float mMappedWidth;
+	};
 
 	struct LanguageDefinition
 	{
@@ -168,8 +426,11 @@ public:
 
 		bool mCaseSensitive;
 
+		// Lua style long strings, [[...]] or [=[...]=] (with any number of '='), which may span lines.
+		bool mLongStrings;
+
 		LanguageDefinition()
-			: mPreprocChar('#'), mAutoIndentation(true), mTokenize(nullptr), mCaseSensitive(true)
+			: mPreprocChar('#'), mAutoIndentation(true), mTokenize(nullptr), mCaseSensitive(true), mLongStrings(false)
 		{
 		}
 
@@ -182,6 +443,34 @@ public:
 		static const LanguageDefinition& Lua();
 	};
 
+	// The color spans of the lines tokenized before, keyed by the characters of a line, the state the comment
+	// scanner entered it in and the language, so that a line which comes back (after an undo, a move or a
+	// paste) or repeats is colorized by copying them. It holds a fixed number of lines, each in the slot its
+	// hash gives (replacing the line there), and no line longer than MaxLineLength. It is thread safe, so
+	// that editors can share one (see SetTokenCache()).
+	class TokenCache
+	{
+	public:
+		static const int MaxLineLength = 1024;
+
+		explicit TokenCache(int aCapacity = 8192);
+		~TokenCache();
+
+		int GetCapacity() const;
+
+		// Gives aLine the spans stored for it with aLanguage (see SetLanguageDefinition()), if there are
+		// any. aKey is set to what Store() takes once the line is tokenized, 0 if it can't be kept.
+		bool Find(Line& aLine, uint64_t aLanguage, uint64_t& aKey) const;
+		void Store(const Line& aLine, uint64_t aLanguage, uint64_t aKey);
+		void clear();
+
+	private:
+		struct Shard;
+
+		int mShardSize;
+		std::unique_ptr<Shard[]> mShards;
+	};
+
 	TextEditor();
 	~TextEditor();
 
@@ -191,30 +480,93 @@ public:
 	const Palette& GetPalette() const { return mPaletteBase; }
 	void SetPalette(const Palette& aValue);
 
-	void SetErrorMarkers(const ErrorMarkers& aMarkers) { mErrorMarkers = aMarkers; }
-	void SetBreakpoints(const Breakpoints& aMarkers) { mBreakpoints = aMarkers; }
+	void SetErrorMarkers(const ErrorMarkers& aMarkers) { mErrorMarkers = aMarkers; mRedrawNeeded = true; }
+	void SetBreakpoints(const Breakpoints& aMarkers) { mBreakpoints = aMarkers; mRedrawNeeded = true; }
 
 	void Render(const char* aTitle, const ImVec2& aSize = ImVec2(), bool aBorder = false);
 	void SetText(const std::string& aText);
+	void SetText(std::string&& aText);
+#ifdef TEXTEDITOR_STRING_VIEW
+	// Shows aText without copying it. It has to stay valid and unchanged until the text is replaced.
+	void SetTextView(std::string_view aText);
+#endif
 	std::string GetText() const;
 
 	void SetTextLines(const std::vector<std::string>& aLines);
+	void SetTextLines(std::vector<std::string>&& aLines);
+
+	// Loads a text on a background thread. The first lines are there right away, the others are added frame
+	// by frame, and the editor can be used in the meanwhile. The text is colorized once it is all loaded.
+	// Of a very long first line only the start is there right away, and it cannot be edited until it is loaded.
+	void SetTextAsync(std::string&& aText);
+	bool IsLoading() const { return mLines.IsLoading(); }
+	float GetLoadingProgress() const { return mLines.GetLoadProgress(); }
+	// Stops loading, keeping the lines loaded so far.
+	void CancelLoading();
 	std::vector<std::string> GetTextLines() const;
 
+	// Opens a file read-only through a memory mapping, see Lines. The editor stays read-only for as long as
+	// the file is open (until SetText or SetTextLines is called).
+	bool OpenMapped(const char* aPath);
+	bool IsMapped() const { return mLines.IsMapped(); }
+
 	std::string GetSelectedText() const;
 	std::string GetCurrentLineText()const;
 
 	int GetTotalLines() const { return (int)mLines.size(); }
+
+	// Conversion between coordinates and byte offsets into the text as GetText() returns it (for a mapped file,
+	// offsets into the file), in logarithmic time.
+	size_t CoordinatesToOffset(const Coordinates& aCoordinates) const;
+	Coordinates OffsetToCoordinates(size_t aOffset) const;
+
+	// Calls aFunc with the text of the document chunk by chunk, without copying it: the lines with the newlines
+	// between them (but no newline at the end). Unmodified lines are passed on together with their neighbors.
+	typedef std::function<void(const char* aText, size_t aSize)> ChunkCallback;
+	void ForEachChunk(const ChunkCallback& aFunc) const;
+
+	// The characters of a line, without its newline. They stay valid until the document changes, or for a
+	// mapped file, until the next frame.
+	const char* GetLineData(int aLine, int& aSize) const { auto& line = mLines[aLine]; aSize = line.size(); return (const char*)line.data(); }
+#ifdef TEXTEDITOR_STRING_VIEW
+	std::string_view GetLineView(int aLine) const { int size; auto data = GetLineData(aLine, size); return std::string_view(data, (size_t)size); }
+#endif
 	bool IsOverwrite() const { return mOverwrite; }
 
 	void SetReadOnly(bool aValue);
-	bool IsReadOnly() const { return mReadOnly; }
+	// a mapped file cannot be edited, whatever the setting, nor a first line which is still being loaded
+	bool IsReadOnly() const { return mReadOnly || mLines.IsMapped() || mLines.IsPartial(); }
 	bool IsTextChanged() const { return mTextChanged; }
 	bool IsCursorPositionChanged() const { return mCursorPositionChanged; }
 
+	// For hosts which only draw a frame when they have to. Whether the editor looks different than when it
+	// was last drawn, and the time (as ImGui::GetTime() tells it) it has to be drawn again by if there is no
+	// input: right away if it changed or its text is still being loaded, colorized or measured, at the next blink of
+	// the cursor otherwise, or never (infinity).
+	bool IsRedrawNeeded() const;
+	double GetNextRedrawTime() const;
+
 	bool IsColorizerEnabled() const { return mColorizerEnabled; }
 	void SetColorizerEnable(bool aValue);
 
+	// A threaded colorizer tokenizes copies of the lines on a background thread, taken in the same order and
+	// within the same time as below. Their colors are applied in the frames after the thread got through them,
+	// or dropped (and the lines taken again) if the text changed in the meantime. The thread is stopped early
+	// when a line comes into view which it does not have, so that it gets to it first.
+	bool IsColorizerThreaded() const { return mColorizer != nullptr; }
+	void SetColorizerThreaded(bool aValue);
+
+	// The time (in microseconds) the colorizer may take in a frame. The comments are scanned from the first
+	// changed line on (over as many frames as it takes, in either mode), then the visible lines are colorized
+	// regardless of the time, then a page ahead in the direction of scrolling, then the rest of the changed lines.
+	int GetColorizerBudget() const { return mColorizerBudget; }
+	void SetColorizerBudget(int aMicroseconds) { mColorizerBudget = aMicroseconds; }
+
+	// The cache of tokenized lines the colorizer uses, one of its own by default. Editors can be given the
+	// same one to share it, nullptr turns the cache off.
+	const std::shared_ptr<TokenCache>& GetTokenCache() const { return mTokenCache; }
+	void SetTokenCache(std::shared_ptr<TokenCache> aValue);
+
 	Coordinates GetCursorPosition() const { return GetActualCursorCoordinates(); }
 	void SetCursorPosition(const Coordinates& aPosition);
 
@@ -224,12 +576,18 @@ public:
 	inline void SetHandleKeyboardInputs (bool aValue){ mHandleKeyboardInputs = aValue;}
 	inline bool IsHandleKeyboardInputsEnabled() const { return mHandleKeyboardInputs; }
 
-	inline void SetImGuiChildIgnored    (bool aValue){ mIgnoreImGuiChild     = aValue;}
+	inline void SetImGuiChildIgnored    (bool aValue){ mIgnoreImGuiChild     = aValue; mRedrawNeeded = true;}
 	inline bool IsImGuiChildIgnored() const { return mIgnoreImGuiChild; }
 
-	inline void SetShowWhitespaces(bool aValue) { mShowWhitespaces = aValue; }
+	inline void SetShowWhitespaces(bool aValue) { mShowWhitespaces = aValue; mRedrawNeeded = true; }
 	inline bool IsShowingWhitespaces() const { return mShowWhitespaces; }
 
+	// In a monospace font, the x position of a column of an ASCII line is the column times the width of a
+	// space, so it is computed instead of measured. A font is found to be monospace when the printable ASCII
+	// characters have the same width, or it can be declared one (then its space gives the column width).
+	inline void SetMonospace(bool aValue) { mMonospace = aValue; mRedrawNeeded = true; }
+	inline bool IsMonospace() const { return mMonospace; }
+
 	void SetTabSize(int aValue);
 	inline int GetTabSize() const { return mTabSize; }
 
@@ -269,6 +627,99 @@ public:
 private:
 	typedef std::vector<std::pair<std::regex, PaletteIndex>> RegexList;
 
+	// The token regexes of a language compiled into a single DFA, which finds the token of the first
+	// matching regex in one pass over the characters (taking the longest match of that regex).
+	// Only the common subset of the regex syntax is supported: characters, escapes, classes, '.',
+	// groups, alternatives and greedy repetitions. Compile() fails on anything else (and on more than
+	// MaxRules regexes), in which case the std::regex list has to be used instead.
+	class TokenDFA
+	{
+	public:
+		static const int MaxRules = 32;
+		static const int MaxStates = 4096;
+
+		TokenDFA() : mClassCount(0) {}
+
+		bool Compile(const LanguageDefinition::TokenRegexStrings& aRegexes);
+		void clear();
+		bool empty() const { return mTransitions.empty(); }
+		bool Match(const char* in_begin, const char* in_end, const char*& out_begin, const char*& out_end, PaletteIndex& paletteIndex) const;
+
+	private:
+		struct Nfa;
+
+		int mClassCount;
+		uint8_t mClasses[256];				// the class of each character, characters of a class lead to the same states
+		std::vector<int> mTransitions;		// the next state for each state and class, -1 if there is none
+		std::vector<uint32_t> mAccepting;	// the mask of the regexes matching in each state
+		std::vector<PaletteIndex> mColors;	// the color of each regex
+	};
+
+	// The keywords and identifiers of a language in a perfect hash table (hash and displace): the names
+	// are hashed into small buckets, and each bucket gets a displacement that puts its names in slots no
+	// other name uses. An identifier is classified by hashing its characters once (upper-cased on the fly
+	// if the language is not case sensitive) and comparing with the single candidate, without making a
+	// string of it. Should no perfect table be found, the names are probed for from their hash instead.
+	class IdentifierClassifier
+	{
+	public:
+		IdentifierClassifier() : mSeed(0), mMask(0), mBucketMask(0), mMinLength(0), mMaxLength(0), mCaseSensitive(true) {}
+
+		void Build(const LanguageDefinition& aLanguage);
+		PaletteIndex Classify(const char* aBegin, const char* aEnd, bool aPreprocessor) const;
+
+	private:
+		struct Entry
+		{
+			uint32_t mOffset;			// where the characters are in mCharacters
+			uint16_t mLength;			// 0 if the slot is empty
+			PaletteIndex mColor;		// outside of preprocessor lines
+			bool mPreprocIdentifier;	// colored within preprocessor lines too
+		};
+
+		uint64_t Hash(const char* aBegin, const char* aEnd) const;
+		uint32_t Slot(uint64_t aHash) const;
+		bool Equals(const Entry& aEntry, const char* aBegin, int aLength) const;
+
+		uint64_t mSeed;
+		uint32_t mMask;
+		uint32_t mBucketMask;
+		int mMinLength, mMaxLength;
+		bool mCaseSensitive;
+		std::vector<Entry> mEntries;
+		std::vector<uint16_t> mDisplacements;	// for each bucket, empty if the entries are probed for
+		std::string mCharacters;
+	};
+
+	// The widths of the characters in a font at a size, each measured once: those of the ASCII characters
+	// are kept in an array, the others in a map keyed by their UTF-8 bytes. All the x positions are summed
+	// from these (see GetAdvances()).
+	class GlyphAdvances
+	{
+	public:
+		GlyphAdvances();
+
+		// Measures the ASCII characters again if the font or its size changed, and forgets the others.
+		void Update(const ImFont* aFont, float aFontSize);
+
+		float Get(char aChar) const { return mAscii[aChar & 0x7f]; }
+		// The width of the character at aChar, whose UTF-8 sequence is aLength bytes long.
+		float Get(const Char* aChar, int aLength) const { return aLength == 1 && *aChar < 0x80 ? mAscii[*aChar] : GetOther(aChar, aLength); }
+		// The width of the characters in [aBegin, aEnd), tabs aside, as ImFont::CalcTextSizeA() gives it.
+		float GetWidth(const Char* aBegin, const Char* aEnd) const;
+		// Whether the printable ASCII characters all have the same width.
+		bool IsMonospace() const { return mMonospace; }
+
+	private:
+		float GetOther(const Char* aChar, int aLength) const;
+
+		const ImFont* mFont;
+		float mFontSize;
+		float mAscii[128];
+		bool mMonospace;
+		mutable std::unordered_map<uint64_t, float> mOthers;
+	};
+
 	struct EditorState
 	{
 		Coordinates mSelectionStart;
@@ -311,11 +762,24 @@ private:
 
 	typedef std::vector<UndoRecord> UndoBuffer;
 
+	struct Colorizer;
+
 	void ProcessInputs();
+	void LoadText(const Char* aText, size_t aSize, std::shared_ptr<const void> aOwner);
 	void Colorize(int aFromLine = 0, int aCount = -1);
 	void ColorizeRange(int aFromLine = 0, int aToLine = 0);
+	static void ColorizeLine(Line& aLine, const LanguageDefinition& aLanguage, const TokenDFA& aTokenDFA, const RegexList& aRegexList, const IdentifierClassifier& aClassifier, TokenCache* aTokenCache, uint64_t aLanguageKey);
+	int ColorizeComments(int aFromLine, int aToLine, int aStableFrom);
+	void ColorizeCommentsParallel(int aFromLine, int aToLine);
 	void ColorizeInternal();
 	float TextDistanceToLineStart(const Coordinates& aFrom) const;
+	float TextDistance(const Line& aLine, int aFrom, int aTo, float aDistance) const;
+	const Line::Checkpoints* GetCheckpoints(const Line& aLine, bool aMeasured) const;
+	const GlyphAdvances& GetAdvances() const;
+	float GetColumnAdvance(const Line& aLine) const;
+	float GetLineWidth(const Line& aLine) const;
+	const std::vector<Line::TextRun>* GetTextRuns(const Line& aLine, float aColumnAdvance) const;
+	void MakeTextRuns(const Line& aLine, int aFrom, int aTo, float aX, float aColumnAdvance, std::vector<Line::TextRun>& aRuns) const;
 	void EnsureCursorVisible();
 	int GetPageSize() const;
 	std::string GetText(const Coordinates& aStart, const Coordinates& aEnd) const;
@@ -337,18 +801,22 @@ private:
 	void RemoveLine(int aStart, int aEnd);
 	void RemoveLine(int aIndex);
 	Line& InsertLine(int aIndex);
+	void InsertLines(int aIndex, std::vector<Line>&& aLines);
+	void MoveMarkers(int aIndex, int aCount);
+	void MoveColorRange(int aIndex, int aCount);
+	void MoveDrawnRange(int aIndex, int aCount);
 	void EnterCharacter(ImWchar aChar, bool aShift);
 	void Backspace();
 	void DeleteSelection();
 	std::string GetWordUnderCursor() const;
 	std::string GetWordAt(const Coordinates& aCoords) const;
-	ImU32 GetGlyphColor(const Glyph& aGlyph) const;
 
 	void HandleKeyboardInputs();
 	void HandleMouseInputs();
 	void Render();
 
 	float mLineSpacing;
+	std::shared_ptr<const void> mLoadedText;	// owns the text unmodified lines are pieces of
 	Lines mLines;
 	EditorState mState;
 	UndoBuffer mUndoBuffer;
@@ -363,27 +831,54 @@ private:
 	bool mTextChanged;
 	bool mColorizerEnabled;
 	float mTextStart;                   // position (in pixels) where a code line starts relative to the left of the TextEditor.
+	int mTextStartLines;				// the number of lines mTextStart was measured for
+	const ImFont* mLayoutFont;			// what mTextStart and the widths of the lines were measured with
+	float mLayoutFontSize;
+	int mLayoutTabSize;
+	bool mLayoutMonospace;
 	int  mLeftMargin;
 	bool mCursorPositionChanged;
 	int mColorRangeMin, mColorRangeMax;
+	int mColorizerBudget;
+	float mLastScrollY;
+	int mScrollDirection;		// 1 or -1, where the view was last scrolled to
+	std::shared_ptr<Colorizer> mColorizer;
 	SelectionMode mSelectionMode;
 	bool mHandleKeyboardInputs;
 	bool mHandleMouseInputs;
 	bool mIgnoreImGuiChild;
 	bool mShowWhitespaces;
+	bool mMonospace;
 
 	Palette mPaletteBase;
 	Palette mPalette;
+	std::array<ImU32, 2 * (unsigned)PaletteIndex::Max> mSpanPalette;	// the color of each Line::Span::mColor
+	float mPaletteAlpha;		// the style alpha mPalette was made with, negative if it has to be made again
+	unsigned mPaletteVersion;	// changed with mSpanPalette, the text runs of the lines are made again then
+	int mDrawnLineMin, mDrawnLineMax;	// the lines drawn in the last frame, the others drop their text runs
+	std::vector<Line::TextRun> mTextRunBuffer;	// the text runs of the long line being drawn
 	LanguageDefinition mLanguageDefinition;
 	RegexList mRegexList;
-
-	bool mCheckComments;
+	TokenDFA mTokenDFA;
+	IdentifierClassifier mIdentifierClassifier;
+	std::shared_ptr<TokenCache> mTokenCache;
+	uint64_t mLanguageKey;		// tells the language apart from others in the token cache
+
+	// The comments have to be rescanned from mCommentRangeMin (a changed line, or where the scan stopped when
+	// the time of the last frame was up). The last mCommentRangeTail lines are unchanged
+	// (counted from the end, so that it holds while lines are added or removed above them), and the scan
+	// stops in them as soon as it reaches a line whose state is the same as before.
+	int mCommentRangeMin, mCommentRangeTail;
 	Breakpoints mBreakpoints;
 	ErrorMarkers mErrorMarkers;
 	ImVec2 mCharAdvance;
+	mutable GlyphAdvances mAdvances;
 	Coordinates mInteractiveStart, mInteractiveEnd;
-	std::string mLineBuffer;
-	uint64_t mStartTime;
+	double mStartTime;		// when the cursor last blinked, in ImGui::GetTime() seconds
 
 	float mLastClick;
+
+	EditorState mDrawnState;	// the cursor and selection as they were last drawn
+	bool mRedrawNeeded;			// set by the options which change the looks, until the next frame
+	bool mBlinking;				// whether the cursor was blinking in the last frame
 };